@@ -0,0 +1,195 @@
+#include "aof.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "utils.h"
+
+static struct {
+  int fd = -1;
+  int policy = AOF_FSYNC_EVERYSEC;
+  Buffer pending;  // this loop iteration's commands
+  uint64_t size = 0;
+  uint64_t base_size = 0;
+  uint64_t writes = 0;
+  // commands since the rewrite child was forked
+  bool rewriting = false;
+  Buffer rewrite;
+  // shared with the everysec thread
+  std::mutex fd_mu;                  // guards `fd` against a rewrite swap
+  std::atomic<uint64_t> written{0};  // bytes handed to write()
+  std::atomic<uint64_t> synced{0};   // bytes known to be on disk
+  std::atomic<uint64_t> fsyncs{0};
+  std::atomic<uint64_t> fsync_usec_max{0};
+} g_aof;
+
+static uint64_t get_monotonic_usec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 + tv.tv_nsec / 1000;
+}
+
+// `written` is the byte count that `fd` covers
+static void aof_fsync(int fd, uint64_t written) {
+  if (written <= g_aof.synced.load(std::memory_order_relaxed)) {
+    return;
+  }
+  uint64_t start_us = get_monotonic_usec();
+  if (fdatasync(fd) != 0) {
+    return;  // retried on the next round
+  }
+  uint64_t usec = get_monotonic_usec() - start_us;
+  uint64_t synced = g_aof.synced.load(std::memory_order_relaxed);
+  while (synced < written && !g_aof.synced.compare_exchange_weak(
+                                 synced, written, std::memory_order_release)) {
+  }
+  g_aof.fsyncs.fetch_add(1, std::memory_order_relaxed);
+  if (usec > g_aof.fsync_usec_max.load(std::memory_order_relaxed)) {
+    g_aof.fsync_usec_max.store(usec, std::memory_order_relaxed);
+  }
+}
+
+// everysec: the event loop never waits for the disk
+static void aof_fsync_thread() {
+  while (true) {
+    struct timespec delay = {1, 0};
+    nanosleep(&delay, NULL);
+    int fd = -1;
+    uint64_t written = 0;
+    {
+      // a private fd stays valid if a rewrite closes the old one
+      std::lock_guard<std::mutex> lock(g_aof.fd_mu);
+      written = g_aof.written.load(std::memory_order_acquire);
+      if (written > g_aof.synced.load(std::memory_order_relaxed)) {
+        fd = dup(g_aof.fd);
+      }
+    }
+    if (fd >= 0) {
+      aof_fsync(fd, written);
+      close(fd);
+    }
+  }
+}
+
+bool aof_parse_fsync(const char* name, int& policy) {
+  const char* names[] = {"no", "everysec", "always"};
+  for (int i = 0; i < 3; i++) {
+    if (0 == strcasecmp(name, names[i])) {
+      policy = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool aof_open(const char* path, int policy) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    return false;
+  }
+  g_aof.fd = fd;
+  g_aof.policy = policy;
+  g_aof.size = g_aof.base_size = (uint64_t)st.st_size;
+  buf_init(&g_aof.pending, 64 * 1024);
+  if (policy == AOF_FSYNC_EVERYSEC) {
+    std::thread(aof_fsync_thread).detach();
+  }
+  return true;
+}
+
+bool aof_enabled() { return g_aof.fd >= 0; }
+
+void aof_append(const uint8_t* data, size_t len) {
+  if (g_aof.fd >= 0) {
+    buf_append(&g_aof.pending, data, len);
+  }
+}
+
+bool aof_flush() {
+  size_t len = g_aof.fd >= 0 ? buf_size(&g_aof.pending) : 0;
+  if (len == 0) {
+    return true;
+  }
+  if (write_all(g_aof.fd, g_aof.pending.data_begin, len) < 0) {
+    return false;
+  }
+  if (g_aof.rewriting) {
+    buf_append(&g_aof.rewrite, g_aof.pending.data_begin, len);
+  }
+  buf_clear(&g_aof.pending);
+  g_aof.size += len;
+  g_aof.writes++;
+  uint64_t written =
+      g_aof.written.fetch_add(len, std::memory_order_release) + len;
+  if (g_aof.policy == AOF_FSYNC_ALWAYS) {
+    aof_fsync(g_aof.fd, written);
+    return g_aof.synced.load(std::memory_order_relaxed) == written;
+  }
+  return true;
+}
+
+AofStats aof_stats() {
+  AofStats stats;
+  stats.size = g_aof.size;
+  stats.base_size = g_aof.base_size;
+  stats.writes = g_aof.writes;
+  stats.fsyncs = g_aof.fsyncs.load(std::memory_order_relaxed);
+  stats.fsync_usec_max = g_aof.fsync_usec_max.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void aof_rewrite_begin() {
+  buf_init(&g_aof.rewrite, 64 * 1024);
+  g_aof.rewriting = true;
+}
+
+void aof_rewrite_abort() {
+  if (g_aof.rewriting) {
+    buf_destroy(&g_aof.rewrite);
+    g_aof.rewriting = false;
+  }
+}
+
+bool aof_rewrite_end(const char* tmp, const char* path) {
+  // everything up to now goes into the new file too
+  if (!g_aof.rewriting || !aof_flush()) {
+    aof_rewrite_abort();
+    return false;
+  }
+  int fd = open(tmp, O_WRONLY | O_APPEND | O_CLOEXEC);
+  struct stat st;
+  bool ok = fd >= 0 &&
+            write_all(fd, g_aof.rewrite.data_begin,
+                      buf_size(&g_aof.rewrite)) == 0 &&
+            fdatasync(fd) == 0 && fstat(fd, &st) == 0 &&
+            rename(tmp, path) == 0;
+  aof_rewrite_abort();
+  if (!ok) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(tmp);
+    return false;
+  }
+  int old_fd = -1;
+  {
+    std::lock_guard<std::mutex> lock(g_aof.fd_mu);
+    old_fd = g_aof.fd;
+    g_aof.fd = fd;
+    // the new file is on disk as a whole
+    g_aof.synced.store(g_aof.written.load(std::memory_order_relaxed),
+                       std::memory_order_release);
+  }
+  close(old_fd);
+  g_aof.size = g_aof.base_size = (uint64_t)st.st_size;
+  return true;
+}
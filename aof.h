@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only command log. While the event loop processes requests the
+// commands that changed the keyspace are queued with aof_append(), in the
+// same framing as on the wire. aof_flush() writes the whole batch with one
+// write() before any reply of that loop iteration is sent. When the data
+// reaches the disk depends on the fsync policy:
+//   always:   fdatasync() in aof_flush(), a group commit per iteration
+//   everysec: a background thread calls fdatasync() once a second
+//   no:       left to the kernel
+//
+// A rewrite compacts the log. A forked child writes a new one from the
+// keyspace while aof_flush() keeps a copy of the commands that arrive
+// meanwhile. aof_rewrite_end() appends those to the new file and renames
+// it over the old one.
+
+enum {
+  AOF_FSYNC_NO = 0,
+  AOF_FSYNC_EVERYSEC = 1,
+  AOF_FSYNC_ALWAYS = 2,
+};
+
+struct AofStats {
+  uint64_t size = 0;       // bytes in the file
+  uint64_t base_size = 0;  // the size after the last rewrite
+  uint64_t writes = 0;     // write() batches
+  uint64_t fsyncs = 0;
+  uint64_t fsync_usec_max = 0;
+};
+
+bool aof_parse_fsync(const char* name, int& policy);
+// open for appending; starts the fsync thread for everysec
+bool aof_open(const char* path, int policy);
+bool aof_enabled();
+void aof_append(const uint8_t* data, size_t len);
+// write what was appended; false on an I/O error
+bool aof_flush();
+AofStats aof_stats();
+
+// call after aof_flush() and fork(), in the parent
+void aof_rewrite_begin();
+// the child wrote `tmp` successfully; false if it could not be installed
+bool aof_rewrite_end(const char* tmp, const char* path);
+void aof_rewrite_abort();
@@ -0,0 +1,100 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+constexpr size_t k_arena_max_chunk = 64 * 1024;
+
+static size_t slot_class(size_t size) {
+  return (size + k_arena_align - 1) / k_arena_align - 1;
+}
+
+static ArenaChunk* chunk_new(Arena* arena, size_t size) {
+  ArenaChunk* chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + size);
+  if (!chunk) die("malloc()");
+  chunk->prev = chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  arena->nbytes += sizeof(ArenaChunk) + size;
+  return chunk;
+}
+
+static void* chunk_data(ArenaChunk* chunk) { return (void*)(chunk + 1); }
+
+static void* alloc_large(Arena* arena, size_t size) {
+  ArenaChunk* chunk = chunk_new(arena, size);
+  chunk->used = size;
+  chunk->next = arena->large;
+  if (arena->large) {
+    arena->large->prev = chunk;
+  }
+  arena->large = chunk;
+  return chunk_data(chunk);
+}
+
+static void free_large(Arena* arena, void* ptr) {
+  ArenaChunk* chunk = (ArenaChunk*)ptr - 1;
+  if (chunk->prev) {
+    chunk->prev->next = chunk->next;
+  } else {
+    arena->large = chunk->next;
+  }
+  if (chunk->next) {
+    chunk->next->prev = chunk->prev;
+  }
+  arena->nbytes -= sizeof(ArenaChunk) + chunk->size;
+  free(chunk);
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+  assert(size > 0);
+  if (size > k_arena_max_slot) {
+    return alloc_large(arena, size);
+  }
+  // recycle a freed slot of the same class
+  size_t cls = slot_class(size);
+  if (void* slot = arena->free_slots[cls]) {
+    arena->free_slots[cls] = *(void**)slot;
+    return slot;
+  }
+  // carve from the newest chunk
+  size = (cls + 1) * k_arena_align;
+  ArenaChunk* chunk = arena->chunks;
+  if (!chunk || chunk->size - chunk->used < size) {
+    chunk = chunk_new(arena, arena->next_chunk_size);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    if (arena->next_chunk_size < k_arena_max_chunk) {
+      arena->next_chunk_size *= 2;
+    }
+  }
+  void* slot = (char*)chunk_data(chunk) + chunk->used;
+  chunk->used += size;
+  return slot;
+}
+
+void arena_free(Arena* arena, void* ptr, size_t size) {
+  if (size > k_arena_max_slot) {
+    return free_large(arena, ptr);
+  }
+  size_t cls = slot_class(size);
+  *(void**)ptr = arena->free_slots[cls];
+  arena->free_slots[cls] = ptr;
+}
+
+static void chunks_free(ArenaChunk* chunk) {
+  while (chunk) {
+    ArenaChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+// O(number of chunks), regardless of how many slots are live
+void arena_clear(Arena* arena) {
+  chunks_free(arena->chunks);
+  chunks_free(arena->large);
+  *arena = Arena{};
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Slab arena for many small objects with the same owner. Slots are carved
+// from chunks that grow geometrically and recycled through per-size free
+// lists; everything is released at once by arena_clear().
+
+constexpr size_t k_arena_align = 8;
+constexpr size_t k_arena_max_slot = 256;  // larger ones get their own chunk
+constexpr size_t k_arena_classes = k_arena_max_slot / k_arena_align;
+
+struct ArenaChunk {
+  ArenaChunk* prev = NULL;
+  ArenaChunk* next = NULL;
+  size_t size = 0;  // bytes after the header
+  size_t used = 0;
+};
+
+struct Arena {
+  ArenaChunk* chunks = NULL;  // slab chunks, the newest first
+  ArenaChunk* large = NULL;   // one chunk per large slot
+  void* free_slots[k_arena_classes] = {};
+  size_t next_chunk_size = 1024;
+  size_t nbytes = 0;  // bytes held from malloc
+};
+
+void* arena_alloc(Arena* arena, size_t size);
+void arena_free(Arena* arena, void* ptr, size_t size);
+void arena_clear(Arena* arena);
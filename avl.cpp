@@ -222,6 +222,38 @@ AVLNode* avl_offset(AVLNode* node, int64_t offset) {
   return node;
 }
 
+// in-order successor; amortized O(1) over a sequential walk
+AVLNode* avl_next(AVLNode* node) {
+  if (node->right) {
+    // the leftmost node of the right subtree
+    node = node->right;
+    while (node->left) {
+      node = node->left;
+    }
+    return node;
+  }
+  // climb until we come up from a left subtree
+  while (node->parent && node->parent->right == node) {
+    node = node->parent;
+  }
+  return node->parent;
+}
+
+// in-order predecessor, the mirror of avl_next()
+AVLNode* avl_prev(AVLNode* node) {
+  if (node->left) {
+    node = node->left;
+    while (node->right) {
+      node = node->right;
+    }
+    return node;
+  }
+  while (node->parent && node->parent->left == node) {
+    node = node->parent;
+  }
+  return node->parent;
+}
+
 int64_t avl_rank(AVLNode* node) {
   int64_t pos = 0;
   while (node->parent) {
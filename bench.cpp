@@ -0,0 +1,668 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "hist.h"
+#include "kvclient.h"
+#include "utils.h"
+
+// Load generator for the binary protocol:
+//   bench [--host 127.0.0.1] [--port 1234] [--unix path] [--threads 4]
+//         [--connections 50] [--pipeline 1] [--batch 0] [--duration 10]
+//         [--rate 0] [--mix get:90,set:10] [--keys 100000] [--zsets 100]
+//         [--dist uniform|zipf] [--zipf-theta 0.99] [--value-size 32]
+//         [--preload] [--json]
+// Closed loop by default: each connection keeps --pipeline frames in
+// flight. With --rate (requests/s over all connections) requests go out on
+// a fixed schedule whatever the replies, and latency counts from when a
+// request was due, so a stalled server is not hidden by the client waiting
+// for it. --batch n sends n commands per batch frame, each of them timed
+// as the whole frame.
+
+static uint64_t get_monotonic_nsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 * 1000 + tv.tv_nsec;
+}
+
+enum {
+  CMD_GET = 0,
+  CMD_SET = 1,
+  CMD_DEL = 2,
+  CMD_ZADD = 3,
+  CMD_ZSCORE = 4,
+  CMD_ZREM = 5,
+  CMD_ZRANK = 6,
+  CMD_ZQUERY = 7,
+  CMD_COUNT = 8,
+};
+
+static const char* const k_cmd_names[CMD_COUNT] = {
+    "get", "set", "del", "zadd", "zscore", "zrem", "zrank", "zquery",
+};
+
+constexpr uint32_t k_batch_flag = 1u << 31;  // on the commands of a batch
+constexpr size_t k_open_max = 1 << 16;  // in flight per connection, --rate
+
+static struct {
+  std::string host = "127.0.0.1";
+  std::string unix_path;  // instead of host and port
+  uint16_t port = 1234;
+  size_t threads = 4;
+  size_t conns = 50;
+  size_t pipeline = 1;  // frames in flight per connection
+  size_t batch = 0;     // commands per batch frame, 0 for plain frames
+  double duration = 10;
+  double rate = 0;  // 0 is closed loop
+  double weights[CMD_COUNT] = {90, 10};
+  uint64_t keys = 100000;
+  uint64_t zsets = 100;
+  bool zipf = false;
+  double theta = 0.99;
+  size_t value_size = 32;
+  bool preload = false;
+  bool json = false;
+} g_opt;
+
+// Zipfian ranks in O(1) per draw after an O(n) setup, after Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases"; rank 0 is the
+// most popular.
+struct Zipf {
+  uint64_t n = 0;
+  double theta = 0;
+  double alpha = 0;
+  double zetan = 0;
+  double eta = 0;
+};
+
+static double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= n; i++) {
+    sum += 1 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+static void zipf_init(Zipf* z, uint64_t n, double theta) {
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1 / (1 - theta);
+  z->zetan = zeta(n, theta);
+  z->eta = (1 - pow(2.0 / (double)n, 1 - theta)) /
+           (1 - zeta(2, theta) / z->zetan);
+}
+
+static uint64_t zipf_next(const Zipf* z, double u) {
+  double uz = u * z->zetan;
+  if (uz < 1) {
+    return 0;
+  }
+  if (uz < 1 + pow(0.5, z->theta)) {
+    return 1;
+  }
+  uint64_t rank =
+      (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return rank < z->n ? rank : z->n - 1;
+}
+
+static size_t frame_cmds() { return g_opt.batch > 0 ? g_opt.batch : 1; }
+
+static Zipf g_zipf;
+static std::string g_value;
+
+// a request frame, or without the length as a command of a batch frame
+static void put_req(std::string& out,
+                    std::initializer_list<std::string_view> args,
+                    bool framed) {
+  uint32_t len = 4;
+  for (std::string_view arg : args) {
+    len += 4 + (uint32_t)arg.size();
+  }
+  uint32_t n = (uint32_t)args.size();
+  if (framed) {
+    out.append((const char*)&len, 4);
+  }
+  out.append((const char*)&n, 4);
+  for (std::string_view arg : args) {
+    uint32_t size = (uint32_t)arg.size();
+    out.append((const char*)&size, 4);
+    out.append(arg.data(), arg.size());
+  }
+}
+
+static void put_cmd(std::string& out, uint32_t cmd, uint64_t k,
+                    bool framed = true) {
+  std::string key = "key:" + std::to_string(k);
+  std::string zkey = "zset:" + std::to_string(k % g_opt.zsets);
+  std::string member = "m:" + std::to_string(k);
+  std::string score = std::to_string(k);
+  switch (cmd) {
+    case CMD_GET:
+      return put_req(out, {"get", key}, framed);
+    case CMD_SET:
+      return put_req(out, {"set", key, g_value}, framed);
+    case CMD_DEL:
+      return put_req(out, {"del", key}, framed);
+    case CMD_ZADD:
+      return put_req(out, {"zadd", zkey, score, member}, framed);
+    case CMD_ZSCORE:
+      return put_req(out, {"zscore", zkey, member}, framed);
+    case CMD_ZREM:
+      return put_req(out, {"zrem", zkey, member}, framed);
+    case CMD_ZRANK:
+      return put_req(out, {"zrank", zkey, member}, framed);
+    case CMD_ZQUERY:
+      return put_req(out, {"zquery", zkey, score, "", "0", "10"}, framed);
+  }
+}
+
+// a command sent; the first of a frame has the number in the frame
+struct Inflight {
+  uint32_t cmd = 0;
+  uint32_t frame_cmds = 0;
+  uint64_t start_ns = 0;  // sent, or due with --rate
+};
+
+struct BenchConn {
+  int fd = -1;
+  Buffer in;
+  std::string out;
+  size_t sent = 0;
+  std::deque<Inflight> inflight;
+  size_t frames = 0;     // in flight
+  uint64_t next_ns = 0;  // --rate: the next request is due
+};
+
+struct Worker {
+  std::vector<BenchConn> conns;
+  std::mt19937_64 rng;
+  std::vector<Hist> hists = std::vector<Hist>(CMD_COUNT);
+  uint64_t errors = 0;
+  bool failed = false;
+};
+
+static int bench_dial_unix() {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, g_opt.unix_path.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int bench_dial() {
+  if (!g_opt.unix_path.empty()) {
+    return bench_dial_unix();
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(g_opt.port);
+  if (inet_pton(AF_INET, g_opt.host.c_str(), &addr.sin_addr) != 1) {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  return fd;
+}
+
+static uint32_t pick_cmd(Worker* w) {
+  double total = 0;
+  for (double weight : g_opt.weights) {
+    total += weight;
+  }
+  double x = std::uniform_real_distribution<double>(0, total)(w->rng);
+  for (uint32_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+    if (x < g_opt.weights[cmd]) {
+      return cmd;
+    }
+    x -= g_opt.weights[cmd];
+  }
+  return CMD_GET;
+}
+
+static uint64_t pick_key(Worker* w) {
+  double u = std::uniform_real_distribution<double>(0, 1)(w->rng);
+  return g_opt.zipf ? zipf_next(&g_zipf, u) : (uint64_t)(u * g_opt.keys);
+}
+
+static void conn_queue(Worker* w, BenchConn* conn, uint64_t start_ns) {
+  conn->frames++;
+  if (g_opt.batch == 0) {
+    uint32_t cmd = pick_cmd(w);
+    put_cmd(conn->out, cmd, pick_key(w));
+    conn->inflight.push_back(Inflight{cmd, 1, start_ns});
+    return;
+  }
+  std::string& out = conn->out;
+  size_t header_idx = out.size();
+  uint32_t n = (uint32_t)g_opt.batch | k_batch_flag;
+  out.append(4, '\0');
+  out.append((const char*)&n, 4);
+  for (size_t i = 0; i < g_opt.batch; i++) {
+    uint32_t cmd = pick_cmd(w);
+    put_cmd(out, cmd, pick_key(w), false);
+    uint32_t frame_cmds = i == 0 ? (uint32_t)g_opt.batch : 0;
+    conn->inflight.push_back(Inflight{cmd, frame_cmds, start_ns});
+  }
+  uint32_t len = (uint32_t)(out.size() - header_idx - 4);
+  memcpy(&out[header_idx], &len, 4);
+}
+
+static bool conn_write(BenchConn* conn) {
+  if (conn->sent == conn->out.size()) {
+    return true;
+  }
+  ssize_t rv = send(conn->fd, conn->out.data() + conn->sent,
+                    conn->out.size() - conn->sent, MSG_DONTWAIT);
+  if (rv < 0) {
+    return errno == EAGAIN;
+  }
+  conn->sent += (size_t)rv;
+  if (conn->sent == conn->out.size()) {
+    conn->out.clear();
+    conn->sent = 0;
+  }
+  return true;
+}
+
+// record the replies that are in
+static bool conn_read(Worker* w, BenchConn* conn) {
+  uint8_t buf[64 * 1024];
+  ssize_t rv = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if (rv < 0 && errno == EAGAIN) {
+    return true;
+  }
+  if (rv <= 0) {
+    return false;
+  }
+  uint64_t now_ns = get_monotonic_nsec();
+  Buffer* in = &conn->in;
+  buf_append(in, buf, (size_t)rv);
+  while (buf_size(in) >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, in->data_begin, 4);
+    if (buf_size(in) < 4 + (size_t)len) {
+      break;
+    }
+    if (len == 0 || conn->inflight.empty()) {
+      return false;
+    }
+    KvValue v = {in->data_begin + 4, in->data_begin + 4 + len};
+    uint32_t n = conn->inflight.front().frame_cmds;
+    if (g_opt.batch > 0) {
+      if (kv_type(v) != KV_ARR || kv_arr_len(v) != n) {
+        return false;
+      }
+      v = kv_arr_first(v);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      Inflight req = conn->inflight.front();
+      conn->inflight.pop_front();
+      hist_add(&w->hists[req.cmd], now_ns - req.start_ns);
+      if (!v.data || v.data == v.end) {
+        return false;
+      }
+      w->errors += kv_type(v) == KV_ERR ? 1 : 0;
+      v = kv_next(v);
+    }
+    conn->frames--;
+    buf_consume(in, 4 + (size_t)len);
+  }
+  return true;
+}
+
+static void worker_run(Worker* w, uint64_t end_ns) {
+  uint64_t interval_ns = 0;
+  if (g_opt.rate > 0) {
+    interval_ns = (uint64_t)(1e9 * (double)(g_opt.conns * frame_cmds()) /
+                             g_opt.rate);
+  }
+  std::vector<struct pollfd> pfds(w->conns.size());
+  while (!w->failed) {
+    uint64_t now_ns = get_monotonic_nsec();
+    if (now_ns >= end_ns) {
+      break;
+    }
+    uint64_t wake_ns = end_ns;
+    for (size_t i = 0; i < w->conns.size(); i++) {
+      BenchConn* conn = &w->conns[i];
+      if (interval_ns == 0) {
+        while (conn->frames < g_opt.pipeline) {
+          conn_queue(w, conn, now_ns);
+        }
+      } else {
+        while (conn->next_ns <= now_ns && conn->frames < k_open_max) {
+          conn_queue(w, conn, conn->next_ns);
+          conn->next_ns += interval_ns;
+        }
+        wake_ns = std::min(wake_ns, conn->next_ns);
+      }
+      w->failed = w->failed || !conn_write(conn);
+      pfds[i].fd = conn->fd;
+      pfds[i].events = POLLIN | (conn->out.empty() ? 0 : POLLOUT);
+      pfds[i].revents = 0;
+    }
+    uint64_t wait_ns = wake_ns > now_ns ? wake_ns - now_ns : 0;
+    struct timespec ts = {(time_t)(wait_ns / 1000000000),
+                          (long)(wait_ns % 1000000000)};
+    if (ppoll(pfds.data(), (nfds_t)pfds.size(), &ts, NULL) < 0) {
+      continue;
+    }
+    for (size_t i = 0; i < w->conns.size(); i++) {
+      if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+        w->failed = w->failed || !conn_read(w, &w->conns[i]);
+      }
+    }
+  }
+}
+
+// set every key and add every member, before the clock starts
+static bool preload() {
+  int fd = bench_dial();
+  if (fd < 0) {
+    return false;
+  }
+  constexpr uint64_t k_batch = 1000;
+  bool ok = true;
+  for (uint64_t first = 0; ok && first < g_opt.keys; first += k_batch) {
+    uint64_t last = std::min(first + k_batch, g_opt.keys);
+    std::string out;
+    for (uint64_t k = first; k < last; k++) {
+      put_cmd(out, CMD_SET, k);
+      put_cmd(out, CMD_ZADD, k);
+    }
+    ok = write_all(fd, (uint8_t*)out.data(), out.size()) == 0;
+    std::vector<uint8_t> body;
+    for (uint64_t i = 0; ok && i < (last - first) * 2; i++) {
+      uint32_t len = 0;
+      ok = read_all(fd, (uint8_t*)&len, 4) == 0 && len <= k_max_msg;
+      body.resize(len);
+      ok = ok && read_all(fd, body.data(), len) == 0;
+    }
+  }
+  close(fd);
+  return ok;
+}
+
+static bool parse_mix(const char* spec) {
+  std::fill(std::begin(g_opt.weights), std::end(g_opt.weights), 0);
+  std::string s = spec;
+  size_t pos = 0;
+  while (pos < s.size()) {
+    size_t comma = s.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = s.size();
+    }
+    std::string item = s.substr(pos, comma - pos);
+    size_t colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    double weight = colon == std::string::npos
+                        ? 1
+                        : strtod(item.c_str() + colon + 1, NULL);
+    uint32_t cmd = 0;
+    while (cmd < CMD_COUNT && name != k_cmd_names[cmd]) {
+      cmd++;
+    }
+    if (cmd == CMD_COUNT || !(weight >= 0)) {
+      return false;
+    }
+    g_opt.weights[cmd] = weight;
+    pos = comma + 1;
+  }
+  double total = 0;
+  for (double weight : g_opt.weights) {
+    total += weight;
+  }
+  return total > 0;
+}
+
+static void print_text(const std::vector<Hist>& hists, const Hist& all,
+                       double secs, uint64_t errors) {
+  printf("%zu connections, %zu threads, pipeline %zu, %s keys (%llu)",
+         g_opt.conns, g_opt.threads, g_opt.pipeline,
+         g_opt.zipf ? "zipfian" : "uniform", (unsigned long long)g_opt.keys);
+  if (!g_opt.unix_path.empty()) {
+    printf(", unix socket");
+  }
+  if (g_opt.batch > 0) {
+    printf(", batches of %zu", g_opt.batch);
+  }
+  if (g_opt.rate > 0) {
+    printf(", open loop at %.0f/s", g_opt.rate);
+  }
+  printf("\n%.0f requests/s over %.2f s, %llu errors\n",
+         (double)all.total / secs, secs, (unsigned long long)errors);
+  printf("%-8s %10s %10s %10s %10s %10s  (us)\n", "command", "requests",
+         "p50", "p99", "p99.9", "max");
+  for (uint32_t cmd = 0; cmd <= CMD_COUNT; cmd++) {
+    const Hist& h = cmd < CMD_COUNT ? hists[cmd] : all;
+    if (h.total == 0) {
+      continue;
+    }
+    printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f\n",
+           cmd < CMD_COUNT ? k_cmd_names[cmd] : "all",
+           (unsigned long long)h.total, hist_quantile(&h, 0.5) / 1e3,
+           hist_quantile(&h, 0.99) / 1e3, hist_quantile(&h, 0.999) / 1e3,
+           h.max / 1e3);
+  }
+}
+
+static void print_json_hist(const Hist& h) {
+  printf("{\"requests\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+         "\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+         (unsigned long long)h.total, hist_mean(&h) / 1e3,
+         hist_quantile(&h, 0.5) / 1e3, hist_quantile(&h, 0.99) / 1e3,
+         hist_quantile(&h, 0.999) / 1e3, h.max / 1e3);
+}
+
+static void print_json(const std::vector<Hist>& hists, const Hist& all,
+                       double secs, uint64_t errors) {
+  printf("{\"config\": {\"connections\": %zu, \"threads\": %zu, "
+         "\"pipeline\": %zu, \"batch\": %zu, \"rate\": %.0f, "
+         "\"keys\": %llu, "
+         "\"zsets\": %llu, \"dist\": \"%s\", \"zipf_theta\": %g, "
+         "\"value_size\": %zu, \"mix\": {",
+         g_opt.conns, g_opt.threads, g_opt.pipeline, g_opt.batch, g_opt.rate,
+         (unsigned long long)g_opt.keys, (unsigned long long)g_opt.zsets,
+         g_opt.zipf ? "zipf" : "uniform", g_opt.theta, g_opt.value_size);
+  const char* sep = "";
+  for (uint32_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+    if (g_opt.weights[cmd] > 0) {
+      printf("%s\"%s\": %g", sep, k_cmd_names[cmd], g_opt.weights[cmd]);
+      sep = ", ";
+    }
+  }
+  printf("}},\n \"seconds\": %.3f, \"requests_per_sec\": %.1f, "
+         "\"errors\": %llu,\n \"all\": ",
+         secs, (double)all.total / secs, (unsigned long long)errors);
+  print_json_hist(all);
+  printf(",\n \"commands\": {");
+  sep = "";
+  for (uint32_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+    if (hists[cmd].total > 0) {
+      printf("%s\n  \"%s\": ", sep, k_cmd_names[cmd]);
+      print_json_hist(hists[cmd]);
+      sep = ",";
+    }
+  }
+  printf("}}\n");
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: bench [--host ip] [--port n] [--unix path] [--threads n] "
+          "[--connections n]\n"
+          "             [--pipeline n] [--batch n] [--duration secs] "
+          "[--rate req/s]\n"
+          "             [--mix cmd:weight,...] [--keys n] [--zsets n]\n"
+          "             [--dist uniform|zipf] [--zipf-theta t] "
+          "[--value-size bytes]\n"
+          "             [--preload] [--json]\n"
+          "commands: get set del zadd zscore zrem zrank zquery\n");
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    bool more = i + 1 < argc;
+    if (0 == strcmp(argv[i], "--host") && more) {
+      g_opt.host = argv[++i];
+    } else if (0 == strcmp(argv[i], "--unix") && more) {
+      g_opt.unix_path = argv[++i];
+    } else if (0 == strcmp(argv[i], "--port") && more) {
+      g_opt.port = (uint16_t)strtoul(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--threads") && more) {
+      g_opt.threads = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--connections") && more) {
+      g_opt.conns = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--pipeline") && more) {
+      g_opt.pipeline = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--batch") && more) {
+      g_opt.batch = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--duration") && more) {
+      g_opt.duration = strtod(argv[++i], NULL);
+    } else if (0 == strcmp(argv[i], "--rate") && more) {
+      g_opt.rate = strtod(argv[++i], NULL);
+    } else if (0 == strcmp(argv[i], "--mix") && more && parse_mix(argv[i + 1])) {
+      i++;
+    } else if (0 == strcmp(argv[i], "--keys") && more) {
+      g_opt.keys = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--zsets") && more) {
+      g_opt.zsets = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--dist") && more &&
+               (0 == strcmp(argv[i + 1], "uniform") ||
+                0 == strcmp(argv[i + 1], "zipf"))) {
+      g_opt.zipf = 0 == strcmp(argv[++i], "zipf");
+    } else if (0 == strcmp(argv[i], "--zipf-theta") && more) {
+      g_opt.theta = strtod(argv[++i], NULL);
+    } else if (0 == strcmp(argv[i], "--value-size") && more) {
+      g_opt.value_size = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--preload")) {
+      g_opt.preload = true;
+    } else if (0 == strcmp(argv[i], "--json")) {
+      g_opt.json = true;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  bool ok = g_opt.threads > 0 && g_opt.conns >= g_opt.threads &&
+            g_opt.pipeline > 0 && g_opt.duration > 0 && g_opt.rate >= 0 &&
+            g_opt.keys > 0 && g_opt.zsets > 0 &&
+            (!g_opt.zipf || (g_opt.theta > 0 && g_opt.theta < 1));
+  if (!ok) {
+    usage();
+    return 1;
+  }
+  g_value.assign(g_opt.value_size, 'x');
+  if (g_opt.zipf) {
+    zipf_init(&g_zipf, g_opt.keys, g_opt.theta);
+  }
+  if (g_opt.preload && !preload()) {
+    fprintf(stderr, "preload failed\n");
+    return 1;
+  }
+
+  // the default 50us of timer slack would delay the sends of --rate
+  prctl(PR_SET_TIMERSLACK, 1);
+  std::vector<Worker> workers(g_opt.threads);
+  std::random_device rd;
+  for (Worker& w : workers) {
+    w.rng.seed(((uint64_t)rd() << 32) ^ rd());
+  }
+  for (size_t c = 0; c < g_opt.conns; c++) {
+    BenchConn conn;
+    conn.fd = bench_dial();
+    if (conn.fd < 0) {
+      if (g_opt.unix_path.empty()) {
+        fprintf(stderr, "connect to %s:%u: %s\n", g_opt.host.c_str(),
+                (unsigned)g_opt.port, strerror(errno));
+      } else {
+        fprintf(stderr, "connect to %s: %s\n", g_opt.unix_path.c_str(),
+                strerror(errno));
+      }
+      return 1;
+    }
+    buf_init(&conn.in, 64 * 1024);
+    workers[c % g_opt.threads].conns.push_back(std::move(conn));
+  }
+
+  uint64_t start_ns = get_monotonic_nsec();
+  uint64_t end_ns = start_ns + (uint64_t)(g_opt.duration * 1e9);
+  // spread the schedules of the connections over one interval
+  if (g_opt.rate > 0) {
+    double interval_ns =
+        1e9 * (double)(g_opt.conns * frame_cmds()) / g_opt.rate;
+    for (size_t c = 0; c < g_opt.conns; c++) {
+      BenchConn& conn = workers[c % g_opt.threads].conns[c / g_opt.threads];
+      conn.next_ns = start_ns + (uint64_t)(interval_ns * (double)c /
+                                           (double)g_opt.conns);
+    }
+  }
+  std::vector<std::thread> threads;
+  for (Worker& w : workers) {
+    threads.emplace_back(&worker_run, &w, end_ns);
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  double secs = (double)(get_monotonic_nsec() - start_ns) / 1e9;
+
+  std::vector<Hist> hists(CMD_COUNT);
+  Hist all;
+  uint64_t errors = 0;
+  bool failed = false;
+  for (Worker& w : workers) {
+    for (uint32_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+      hist_merge(&hists[cmd], &w.hists[cmd]);
+      hist_merge(&all, &w.hists[cmd]);
+    }
+    errors += w.errors;
+    failed = failed || w.failed;
+    for (BenchConn& conn : w.conns) {
+      close(conn.fd);
+      buf_destroy(&conn.in);
+    }
+  }
+  if (g_opt.json) {
+    print_json(hists, all, secs, errors);
+  } else {
+    print_text(hists, all, secs, errors);
+  }
+  if (failed) {
+    fprintf(stderr, "a connection failed\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+#include "zset.h"
+
+// Per-element cost of a zset range scan: rank-walking with znode_offset()
+// versus the in-order successor used by zquery.
+
+static uint64_t get_monotonic_nsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 * 1000 + tv.tv_nsec;
+}
+
+constexpr size_t k_members = 1000 * 1000;
+constexpr size_t k_limit = 1000;  // elements per range query
+constexpr size_t k_queries = 2000;
+
+static double scan(ZSet* zset, bool use_offset, double& checksum) {
+  uint64_t elems = 0;
+  uint64_t start = get_monotonic_nsec();
+  for (size_t q = 0; q < k_queries; q++) {
+    double score = (double)(rand() % (k_members - k_limit));
+    ZNode* znode = zset_seekge(zset, score, "", 0);
+    for (size_t n = 0; znode && n < k_limit; n++) {
+      checksum += znode->score;
+      znode = use_offset ? znode_offset(znode, +1) : znode_next(znode);
+      elems++;
+    }
+  }
+  return (double)(get_monotonic_nsec() - start) / (double)elems;
+}
+
+int main() {
+  ZSet zset;
+  for (size_t i = 0; i < k_members; i++) {
+    std::string name = "member:" + std::to_string(i);
+    zset_insert(&zset, name.data(), name.size(), (double)i);
+  }
+
+  double checksum = 0;
+  srand(1);
+  double offset_ns = scan(&zset, true, checksum);
+  srand(1);
+  double next_ns = scan(&zset, false, checksum);
+  printf("members=%zu limit=%zu queries=%zu\n", k_members, k_limit, k_queries);
+  printf("znode_offset(+1): %.2f ns/elem\n", offset_ns);
+  printf("znode_next():     %.2f ns/elem\n", next_ns);
+  printf("(checksum %g)\n", checksum);
+
+  zset_clear(&zset);
+  return 0;
+}
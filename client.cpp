@@ -1,236 +1,86 @@
-#include <arpa/inet.h>
-#include <assert.h>
-#include <errno.h>
-#include <netinet/ip.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
 
 #include <string>
+#include <string_view>
 #include <vector>
 
-static void msg(const char* msg) { fprintf(stderr, "%s\n", msg); }
-
-static void die(const char* msg) {
-  int err = errno;
-  fprintf(stderr, "[%d] %s\n", err, msg);
-  abort();
-}
-
-static int32_t read_full(int fd, char* buf, size_t n) {
-  while (n > 0) {
-    ssize_t rv = read(fd, buf, n);
-    if (rv <= 0) {
-      return -1;  // error, or unexpected EOF
-    }
-    assert((size_t)rv <= n);
-    n -= (size_t)rv;
-    buf += rv;
-  }
-  return 0;
-}
-
-static int32_t write_all(int fd, const char* buf, size_t n) {
-  while (n > 0) {
-    ssize_t rv = write(fd, buf, n);
-    if (rv <= 0) {
-      return -1;  // error
-    }
-    assert((size_t)rv <= n);
-    n -= (size_t)rv;
-    buf += rv;
-  }
-  return 0;
-}
-
-const size_t k_max_msg = 4096;
-
-static int32_t send_req(int fd, const std::vector<std::string>& cmd) {
-  uint32_t len = 4;
-  for (const std::string& s : cmd) {
-    len += 4 + s.size();
-  }
-  if (len > k_max_msg) {
-    return -1;
-  }
-
-  char wbuf[4 + k_max_msg];
-  memcpy(&wbuf[0], &len, 4);  // assume little endian
-  uint32_t n = (uint32_t)cmd.size();
-  memcpy(&wbuf[4], &n, 4);
-  size_t cur = 8;
-  for (const std::string& s : cmd) {
-    uint32_t p = (uint32_t)s.size();
-    memcpy(&wbuf[cur], &p, 4);
-    memcpy(&wbuf[cur + 4], s.data(), s.size());
-    cur += 4 + s.size();
-  }
-  return write_all(fd, wbuf, 4 + len);
-}
+#include "kvclient.h"
 
-enum {
-  TAG_NIL = 0,  // nil
-  TAG_ERR = 1,  // error code + msg
-  TAG_STR = 2,  // string
-  TAG_INT = 3,  // int64
-  TAG_DBL = 4,  // double
-  TAG_ARR = 5,  // array
-};
+static void msg(const char* msg) { fprintf(stderr, "%s\n", msg); }
 
-static int32_t print_response(const uint8_t* data, size_t size) {
-  if (size < 1) {
-    msg("bad response");
-    return -1;
-  }
-  switch (data[0]) {
-    case TAG_NIL:
+static void print_value(KvValue v) {
+  std::string_view s;
+  switch (kv_type(v)) {
+    case KV_NIL:
       printf("(nil)\n");
-      return 1;
-    case TAG_ERR:
-      if (size < 1 + 8) {
-        msg("bad response");
-        return -1;
-      }
-      {
-        int32_t code = 0;
-        uint32_t len = 0;
-        memcpy(&code, &data[1], 4);
-        memcpy(&len, &data[1 + 4], 4);
-        if (size < 1 + 8 + len) {
-          msg("bad response");
-          return -1;
-        }
-        printf("(err) %d %.*s\n", code, len, &data[1 + 8]);
-        return 1 + 8 + len;
-      }
-    case TAG_STR:
-      if (size < 1 + 4) {
-        msg("bad response");
-        return -1;
+      break;
+    case KV_ERR:
+      s = kv_str(v);
+      printf("(err) %d %.*s\n", (int32_t)kv_err_code(v), (int)s.size(),
+             s.data());
+      break;
+    case KV_STR:
+      s = kv_str(v);
+      printf("(str) %.*s\n", (int)s.size(), s.data());
+      break;
+    case KV_INT:
+      printf("(int) %ld\n", kv_int(v));
+      break;
+    case KV_DBL:
+      printf("(dbl) %g\n", kv_dbl(v));
+      break;
+    case KV_ARR: {
+      uint32_t len = kv_arr_len(v);
+      printf("(arr) len=%u\n", len);
+      KvValue elem = kv_arr_first(v);
+      for (uint32_t i = 0; i < len; ++i) {
+        print_value(elem);
+        elem = kv_next(elem);
       }
-      {
-        uint32_t len = 0;
-        memcpy(&len, &data[1], 4);
-        if (size < 1 + 4 + len) {
-          msg("bad response");
-          return -1;
-        }
-        printf("(str) %.*s\n", len, &data[1 + 4]);
-        return 1 + 4 + len;
-      }
-    case TAG_INT:
-      if (size < 1 + 8) {
-        msg("bad response");
-        return -1;
-      }
-      {
-        int64_t val = 0;
-        memcpy(&val, &data[1], 8);
-        printf("(int) %ld\n", val);
-        return 1 + 8;
-      }
-    case TAG_DBL:
-      if (size < 1 + 8) {
-        msg("bad response");
-        return -1;
-      }
-      {
-        double val = 0;
-        memcpy(&val, &data[1], 8);
-        printf("(dbl) %g\n", val);
-        return 1 + 8;
-      }
-    case TAG_ARR:
-      if (size < 1 + 4) {
-        msg("bad response");
-        return -1;
-      }
-      {
-        uint32_t len = 0;
-        memcpy(&len, &data[1], 4);
-        printf("(arr) len=%u\n", len);
-        size_t arr_bytes = 1 + 4;
-        for (uint32_t i = 0; i < len; ++i) {
-          int32_t rv = print_response(&data[arr_bytes], size - arr_bytes);
-          if (rv < 0) {
-            return rv;
-          }
-          arr_bytes += (size_t)rv;
-        }
-        printf("(arr) end\n");
-        return (int32_t)arr_bytes;
-      }
-    default:
-      msg("bad response");
-      return -1;
-  }
-}
-
-static int32_t read_res(int fd) {
-  // 4 bytes header
-  char rbuf[4 + k_max_msg];
-  errno = 0;
-  int32_t err = read_full(fd, rbuf, 4);
-  if (err) {
-    if (errno == 0) {
-      msg("EOF");
-    } else {
-      msg("read() error");
+      printf("(arr) end\n");
+      break;
     }
-    return err;
   }
-
-  uint32_t len = 0;
-  memcpy(&len, rbuf, 4);  // assume little endian
-  if (len > k_max_msg) {
-    msg("too long");
-    return -1;
-  }
-
-  // reply body
-  err = read_full(fd, &rbuf[4], len);
-  if (err) {
-    msg("read() error");
-    return err;
-  }
-
-  // print the result
-  int32_t rv = print_response((uint8_t*)&rbuf[4], len);
-  if (rv > 0 && (uint32_t)rv != len) {
-    msg("bad response");
-    rv = -1;
-  }
-  return rv;
 }
 
+// client [--unix path] cmd [args...]
+// client [--unix path] --batch cmd [args...] [';' cmd [args...] ...]
 int main(int argc, char** argv) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) die("socket()");
-
-  struct sockaddr_in addr = {};
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(1234);
-  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
-  if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr))) {
-    die("connect");
+  int i = 1;
+  const char* unix_path = NULL;
+  if (i + 1 < argc && std::string_view(argv[i]) == "--unix") {
+    unix_path = argv[i + 1];
+    i += 2;
   }
-
-  std::vector<std::string> cmd;
-  for (int i = 1; i < argc; i++) {
-    cmd.push_back(argv[i]);
+  KvClient* client = unix_path ? kv_connect_unix(unix_path, 1)
+                               : kv_connect("127.0.0.1", 1234, 1);
+  if (!client) {
+    msg("connect failed");
+    abort();
   }
 
-  if (send_req(fd, cmd) != 0) {
-    die("send_req");
+  bool batch = i < argc && std::string_view(argv[i]) == "--batch";
+  std::vector<std::vector<std::string_view>> cmds(1);
+  for (i += batch ? 1 : 0; i < argc; i++) {
+    if (batch && std::string_view(argv[i]) == ";") {
+      cmds.emplace_back();
+    } else {
+      cmds.back().push_back(argv[i]);
+    }
   }
-  if (read_res(fd) < 0) {
-    die("read_res");
+
+  KvReply reply =
+      batch ? kv_batch(client, cmds).get() : kv_call(client, cmds[0]).get();
+  KvValue v = kv_root(reply);
+  if (kv_type(v) == KV_ERR && kv_err_code(v) == k_kv_err_client) {
+    std::string_view s = kv_str(v);
+    fprintf(stderr, "%.*s\n", (int)s.size(), s.data());
+    abort();
   }
+  print_value(v);
 
-  close(fd);
+  kv_close(client);
   return 0;
 }
@@ -0,0 +1,100 @@
+#include "cluster.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Crc16Table {
+  uint16_t t[256] = {};
+  constexpr Crc16Table() {
+    for (int i = 0; i < 256; i++) {
+      uint16_t crc = (uint16_t)(i << 8);
+      for (int j = 0; j < 8; j++) {
+        crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021)
+                             : (uint16_t)(crc << 1);
+      }
+      t[i] = crc;
+    }
+  }
+};
+
+static constexpr Crc16Table k_crc16;
+
+uint16_t crc16(const uint8_t* data, size_t len) {
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++) {
+    crc = (uint16_t)((crc << 8) ^ k_crc16.t[((crc >> 8) ^ data[i]) & 0xff]);
+  }
+  return crc;
+}
+
+uint32_t key_slot(const char* key, size_t len) {
+  const char* open = (const char*)memchr(key, '{', len);
+  if (open) {
+    size_t rest = len - (size_t)(open - key) - 1;
+    const char* close = (const char*)memchr(open + 1, '}', rest);
+    if (close && close > open + 1) {
+      key = open + 1;
+      len = (size_t)(close - key);
+    }
+  }
+  return crc16((const uint8_t*)key, len) & (k_cluster_slots - 1);
+}
+
+bool cluster_parse_node(const std::string& s, ClusterNode& node) {
+  size_t colon = s.rfind(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  node.host = s.substr(0, colon);
+  const char* port = s.c_str() + colon + 1;
+  char* end = NULL;
+  unsigned long val = strtoul(port, &end, 10);
+  struct in_addr addr;
+  if (*port == '\0' || *end != '\0' || val == 0 || val > 65535 ||
+      inet_pton(AF_INET, node.host.c_str(), &addr) != 1) {
+    return false;
+  }
+  node.port = (uint16_t)val;
+  return true;
+}
+
+bool cluster_parse(const char* spec, ClusterMap* map) {
+  std::vector<ClusterNode> nodes;
+  std::string s = spec;
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t comma = s.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = s.size();
+    }
+    ClusterNode node;
+    if (!cluster_parse_node(s.substr(pos, comma - pos), node)) {
+      return false;
+    }
+    nodes.push_back(node);
+    pos = comma + 1;
+  }
+  if (nodes.empty() || nodes.size() > k_cluster_slots) {
+    return false;
+  }
+  map->nodes = nodes;
+  map->owner.resize(k_cluster_slots);
+  for (uint32_t slot = 0; slot < k_cluster_slots; slot++) {
+    map->owner[slot] = (uint16_t)(slot * nodes.size() / k_cluster_slots);
+  }
+  map->migrating.assign(k_cluster_slots, -1);
+  map->importing.assign(k_cluster_slots, -1);
+  return true;
+}
+
+size_t cluster_node(ClusterMap* map, const ClusterNode& node) {
+  for (size_t i = 0; i < map->nodes.size(); i++) {
+    const ClusterNode& n = map->nodes[i];
+    if (n.host == node.host && n.port == node.port) {
+      return i;
+    }
+  }
+  map->nodes.push_back(node);
+  return map->nodes.size() - 1;
+}
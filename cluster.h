@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Cluster mode. The keyspace is cut into k_cluster_slots slots by a CRC16
+// of the key, or of the part between the first `{` and the next `}` when
+// that is not empty, so that related keys can share a slot. Every server
+// has the whole slot-to-node map and redirects the keys it does not own.
+//
+// A slot moves while it is served: the owner marks it migrating to the
+// target and the target marks it importing from the owner. Keys that are
+// no longer at the owner are asked for at the target, which serves them to
+// clients that say `asking` first, until the slot is assigned to it.
+
+constexpr uint32_t k_cluster_slots = 16384;
+
+struct ClusterNode {
+  std::string host;  // IPv4
+  uint16_t port = 0;
+};
+
+struct ClusterMap {
+  std::vector<ClusterNode> nodes;  // empty when cluster mode is off
+  std::vector<uint16_t> owner;     // node index by slot
+  std::vector<int32_t> migrating;  // to this node index by slot, or -1
+  std::vector<int32_t> importing;  // from this node index by slot, or -1
+  size_t self = 0;                 // this server
+};
+
+// CRC16-CCITT (XMODEM)
+uint16_t crc16(const uint8_t* data, size_t len);
+uint32_t key_slot(const char* key, size_t len);
+bool cluster_parse_node(const std::string& s, ClusterNode& node);
+// "host:port,host:port,..." with the slots split evenly in that order
+bool cluster_parse(const char* spec, ClusterMap* map);
+// the index of `node`, which is added if it is new
+size_t cluster_node(ClusterMap* map, const ClusterNode& node);
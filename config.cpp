@@ -0,0 +1,69 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const ConfigVar* config_find(const ConfigVar* vars, size_t n,
+                             const std::string& name) {
+  for (size_t i = 0; i < n; i++) {
+    if (name == vars[i].name) {
+      return &vars[i];
+    }
+  }
+  return NULL;
+}
+
+bool config_set(const ConfigVar* vars, size_t n, const std::string& name,
+                const std::string& val, std::string& err) {
+  const ConfigVar* var = config_find(vars, n, name);
+  if (!var) {
+    err = "unknown setting " + name;
+    return false;
+  }
+  char* end = NULL;
+  errno = 0;
+  unsigned long long v = strtoull(val.c_str(), &end, 10);
+  if (val.empty() || val[0] == '-' || *end != '\0' || errno == ERANGE) {
+    err = "expect an integer for " + name;
+    return false;
+  }
+  if (v < var->min || v > var->max) {
+    err = name + " is in [" + std::to_string(var->min) + ", " +
+          std::to_string(var->max) + "]";
+    return false;
+  }
+  *var->val = v;
+  return true;
+}
+
+bool config_load(const char* path, const ConfigVar* vars, size_t n,
+                 std::string& err) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    err = std::string(path) + ": " + strerror(errno);
+    return false;
+  }
+  char line[1024];
+  bool ok = true;
+  for (size_t lineno = 1; ok && fgets(line, sizeof(line), fp); lineno++) {
+    if (char* hash = strchr(line, '#')) {
+      *hash = '\0';
+    }
+    char name[256], val[256], extra[2];
+    int words = sscanf(line, "%255s %255s %1s", name, val, extra);
+    if (words <= 0) {
+      continue;  // blank
+    }
+    if (words != 2) {
+      err = "expect a name and a value";
+    }
+    ok = words == 2 && config_set(vars, n, name, val, err);
+    if (!ok) {
+      err = std::string(path) + ":" + std::to_string(lineno) + ": " + err;
+    }
+  }
+  fclose(fp);
+  return ok;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// Integer settings that can change while the server runs. A config file of
+// "name value" lines sets them at startup, "#" starts a comment; config get
+// and config set read and change them later. A value out of its range is
+// refused and leaves the setting as it was.
+
+struct ConfigVar {
+  const char* name;
+  uint64_t* val;
+  uint64_t min = 0;
+  uint64_t max = UINT64_MAX;
+};
+
+const ConfigVar* config_find(const ConfigVar* vars, size_t n,
+                             const std::string& name);
+// false with `err` set if the name is unknown or the value is bad
+bool config_set(const ConfigVar* vars, size_t n, const std::string& name,
+                const std::string& val, std::string& err);
+bool config_load(const char* path, const ConfigVar* vars, size_t n,
+                 std::string& err);
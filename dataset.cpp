@@ -0,0 +1,286 @@
+#include "dataset.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+static uint64_t pad8(uint64_t n) { return (n + 7) & ~(uint64_t)7; }
+
+// a byte range that must lie between the header and the key index
+static bool ds_range(const Dataset* ds, uint64_t off, uint64_t len) {
+  uint64_t end = ds->hdr->slots_off;
+  return off >= sizeof(DsHeader) && off <= end && len <= end - off &&
+         (off & 7) == 0;
+}
+
+bool ds_open(const char* path, Dataset* ds) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DsHeader)) {
+    close(fd);
+    return false;
+  }
+  // shared, so every server on the same file uses the same page cache
+  void* ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+  const DsHeader* hdr = (const DsHeader*)ptr;
+  uint64_t size = (uint64_t)st.st_size;
+  bool ok = 0 == memcmp(hdr->magic, k_ds_magic, 8) &&
+            hdr->file_size == size && hdr->nslots > 0 &&
+            (hdr->nslots & (hdr->nslots - 1)) == 0 &&
+            hdr->slots_off >= sizeof(DsHeader) && (hdr->slots_off & 7) == 0 &&
+            hdr->slots_off <= size &&
+            hdr->nslots <= (size - hdr->slots_off) / sizeof(DsSlot);
+  if (!ok) {
+    munmap(ptr, (size_t)size);
+    return false;
+  }
+  // lookups hit random pages, readahead would only waste the cache
+  madvise(ptr, (size_t)size, MADV_RANDOM);
+  ds->data = (const uint8_t*)ptr;
+  ds->size = (size_t)size;
+  ds->hdr = hdr;
+  return true;
+}
+
+static const uint8_t* rec_body(const DsRec* rec) {
+  return (const uint8_t*)(rec + 1) + pad8(rec->klen);
+}
+
+// a record whose key and value are within bounds
+static const DsRec* rec_at(const Dataset* ds, uint64_t off) {
+  if (!ds_range(ds, off, sizeof(DsRec))) {
+    return NULL;
+  }
+  const DsRec* rec = (const DsRec*)(ds->data + off);
+  uint64_t body = off + sizeof(DsRec) + pad8(rec->klen);
+  if (rec->type == DS_STR) {
+    bool ok = rec->size <= ds->size && ds_range(ds, body, pad8(rec->size));
+    return ok ? rec : NULL;
+  } else if (rec->type == DS_ZSET) {
+    if (!ds_range(ds, body, 8)) {
+      return NULL;
+    }
+    uint64_t nslots = *(const uint64_t*)(ds->data + body);
+    uint64_t left = ds->hdr->slots_off - body - 8;
+    bool ok = nslots > 0 && (nslots & (nslots - 1)) == 0 &&
+              rec->size <= left / 8 &&
+              nslots <= (left - rec->size * 8) / sizeof(DsSlot);
+    return ok ? rec : NULL;
+  }
+  return NULL;
+}
+
+const DsRec* ds_lookup(const Dataset* ds, const char* key, size_t len) {
+  uint64_t hcode = str_hash((const uint8_t*)key, len);
+  const DsSlot* slots = (const DsSlot*)(ds->data + ds->hdr->slots_off);
+  uint64_t mask = ds->hdr->nslots - 1;
+  for (uint64_t i = 0; i <= mask; i++) {
+    const DsSlot& slot = slots[(hcode + i) & mask];
+    if (slot.off == 0) {
+      return NULL;
+    }
+    if (slot.hcode != hcode) {
+      continue;
+    }
+    const DsRec* rec = rec_at(ds, slot.off);
+    if (rec && rec->klen == len && 0 == memcmp(rec + 1, key, len)) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+const char* ds_str(const DsRec* rec) { return (const char*)rec_body(rec); }
+
+uint64_t ds_zcard(const DsRec* rec) { return rec->size; }
+
+const DsMember* ds_zat(const Dataset* ds, const DsRec* rec, uint64_t rank) {
+  if (rank >= rec->size) {
+    return NULL;
+  }
+  const uint64_t* offs = (const uint64_t*)rec_body(rec) + 1;
+  uint64_t off = offs[rank];
+  if (!ds_range(ds, off, sizeof(DsMember))) {
+    return NULL;
+  }
+  const DsMember* m = (const DsMember*)(ds->data + off);
+  bool ok =
+      m->len <= ds->size && ds_range(ds, off, sizeof(DsMember) + m->len);
+  return ok ? m : NULL;
+}
+
+int64_t ds_zrank(const Dataset* ds, const DsRec* rec, const char* name,
+                 size_t len) {
+  const uint64_t* body = (const uint64_t*)rec_body(rec);
+  const DsSlot* slots = (const DsSlot*)(body + 1 + rec->size);
+  uint64_t hcode = str_hash((const uint8_t*)name, len);
+  uint64_t mask = body[0] - 1;
+  for (uint64_t i = 0; i <= mask; i++) {
+    const DsSlot& slot = slots[(hcode + i) & mask];
+    if (slot.off == 0) {
+      return -1;
+    }
+    if (slot.hcode != hcode) {
+      continue;
+    }
+    const DsMember* m = ds_zat(ds, rec, slot.off - 1);
+    if (m && m->len == len && 0 == memcmp(ds_name(m), name, len)) {
+      return (int64_t)(slot.off - 1);
+    }
+  }
+  return -1;
+}
+
+// the same order as the ZSet tree
+static bool member_less(const DsMember* m, double score, const char* name,
+                        size_t len) {
+  if (m->score != score) {
+    return m->score < score;
+  }
+  int rv = memcmp(ds_name(m), name, m->len < len ? m->len : len);
+  return (rv != 0) ? (rv < 0) : (m->len < len);
+}
+
+uint64_t ds_zseekge(const Dataset* ds, const DsRec* rec, double score,
+                    const char* name, size_t len) {
+  uint64_t lo = 0, hi = rec->size;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    const DsMember* m = ds_zat(ds, rec, mid);
+    if (!m) {
+      return rec->size;
+    }
+    if (member_less(m, score, name, len)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void ds_write(DsWriter* w, const void* data, size_t len) {
+  if (!w->failed && len > 0 && fwrite(data, 1, len, w->fp) != len) {
+    w->failed = true;
+  }
+  w->off += len;
+}
+
+static void ds_pad(DsWriter* w) {
+  static const uint8_t zeros[8] = {};
+  ds_write(w, zeros, pad8(w->off) - w->off);
+}
+
+// a power of 2 that keeps the load factor at or below 1/2
+static uint64_t ds_nslots(uint64_t n) {
+  uint64_t nslots = 1;
+  while (nslots < n * 2) {
+    nslots *= 2;
+  }
+  return nslots;
+}
+
+// linear probing, with `off` 0 as the empty slot
+static void ds_put_index(DsWriter* w, const std::vector<DsSlot>& items,
+                         uint64_t nslots) {
+  std::vector<DsSlot> slots(nslots, DsSlot{0, 0});
+  for (const DsSlot& item : items) {
+    uint64_t i = item.hcode & (nslots - 1);
+    while (slots[i].off != 0) {
+      i = (i + 1) & (nslots - 1);
+    }
+    slots[i] = item;
+  }
+  ds_write(w, slots.data(), slots.size() * sizeof(DsSlot));
+}
+
+bool ds_begin(DsWriter* w, const char* path) {
+  w->path = path;
+  w->tmp = w->path + ".tmp";
+  w->fp = fopen(w->tmp.c_str(), "wb");
+  if (!w->fp) {
+    return false;
+  }
+  DsHeader hdr = {};
+  ds_write(w, &hdr, sizeof(hdr));  // written again by ds_finish()
+  return !w->failed;
+}
+
+static void ds_put_rec(DsWriter* w, uint32_t type, const char* key,
+                       size_t klen, uint64_t size) {
+  w->keys.push_back(DsSlot{str_hash((const uint8_t*)key, klen), w->off});
+  DsRec rec = {type, (uint32_t)klen, size};
+  ds_write(w, &rec, sizeof(rec));
+  ds_write(w, key, klen);
+  ds_pad(w);
+}
+
+void ds_put_str(DsWriter* w, const char* key, size_t klen, const char* val,
+                size_t vlen) {
+  ds_put_rec(w, DS_STR, key, klen, vlen);
+  ds_write(w, val, vlen);
+  ds_pad(w);
+}
+
+void ds_put_zset(DsWriter* w, const char* key, size_t klen,
+                 const std::vector<DsInput>& members) {
+  uint64_t count = members.size();
+  uint64_t nslots = ds_nslots(count);
+  ds_put_rec(w, DS_ZSET, key, klen, count);
+  ds_write(w, &nslots, 8);
+  // the members follow the rank table and the name index
+  uint64_t off = w->off + count * 8 + nslots * sizeof(DsSlot);
+  std::vector<DsSlot> names(count);
+  for (uint64_t i = 0; i < count; i++) {
+    const DsInput& in = members[i];
+    ds_write(w, &off, 8);
+    names[i] = DsSlot{str_hash((const uint8_t*)in.name, in.len), i + 1};
+    off += sizeof(DsMember) + pad8(in.len);
+  }
+  ds_put_index(w, names, nslots);
+  for (const DsInput& in : members) {
+    DsMember m = {in.score, in.len};
+    ds_write(w, &m, sizeof(m));
+    ds_write(w, in.name, in.len);
+    ds_pad(w);
+  }
+}
+
+bool ds_finish(DsWriter* w, uint64_t created_ms) {
+  DsHeader hdr = {};
+  memcpy(hdr.magic, k_ds_magic, 8);
+  hdr.nkeys = w->keys.size();
+  hdr.nslots = ds_nslots(hdr.nkeys);
+  hdr.slots_off = w->off;
+  ds_put_index(w, w->keys, hdr.nslots);
+  hdr.file_size = w->off;
+  hdr.created_ms = created_ms;
+  bool ok = !w->failed && fseek(w->fp, 0, SEEK_SET) == 0 &&
+            fwrite(&hdr, sizeof(hdr), 1, w->fp) == 1 && fflush(w->fp) == 0 &&
+            fsync(fileno(w->fp)) == 0;
+  ok = (fclose(w->fp) == 0) && ok;
+  w->fp = NULL;
+  // a server maps the old file; truncating it in place would fault there
+  ok = ok && rename(w->tmp.c_str(), w->path.c_str()) == 0;
+  if (!ok) {
+    unlink(w->tmp.c_str());
+  }
+  return ok;
+}
+
+void ds_abort(DsWriter* w) {
+  fclose(w->fp);
+  w->fp = NULL;
+  unlink(w->tmp.c_str());
+}
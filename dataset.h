@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+// Immutable, hash-indexed dataset, served straight from a read-only shared
+// mapping (--static) and built offline from a snapshot by kvbuild.
+//
+// +--------+---------+-----+---------+-----------------+
+// | header | record1 | ... | recordn | slots[nslots]   |
+// +--------+---------+-----+---------+-----------------+
+//
+// Slots are open-addressed by str_hash() of the key with linear probing;
+// an empty slot has off == 0. Everything is native-endian and 8-byte
+// aligned. A record is a DsRec, the key padded to 8 bytes, then
+//   DS_STR:  the value
+//   DS_ZSET: u64 nslots, u64 member offsets in (score, name) order, then
+//            DsSlot[nslots] by name whose `off` is the rank + 1
+// and each member is a DsMember followed by the name.
+
+constexpr char k_ds_magic[8] = {'K', 'V', 'D', 'S', 'E', 'T', '0', '1'};
+
+enum {
+  DS_STR = 1,
+  DS_ZSET = 2,
+};
+
+struct DsHeader {
+  char magic[8];
+  uint64_t nkeys;
+  uint64_t nslots;      // power of 2
+  uint64_t slots_off;   // DsSlot[nslots]
+  uint64_t file_size;
+  uint64_t created_ms;  // of the snapshot it was built from
+};
+
+struct DsSlot {
+  uint64_t hcode;
+  uint64_t off;
+};
+
+struct DsRec {
+  uint32_t type;
+  uint32_t klen;
+  uint64_t size;  // value bytes or member count
+};
+
+struct DsMember {
+  double score;
+  uint64_t len;
+};
+
+struct Dataset {
+  const uint8_t* data = NULL;
+  size_t size = 0;
+  const DsHeader* hdr = NULL;
+};
+
+// map `path`; the header and the index are checked, records are checked as
+// they are read
+bool ds_open(const char* path, Dataset* ds);
+const DsRec* ds_lookup(const Dataset* ds, const char* key, size_t len);
+const char* ds_str(const DsRec* rec);
+uint64_t ds_zcard(const DsRec* rec);
+const DsMember* ds_zat(const Dataset* ds, const DsRec* rec, uint64_t rank);
+// -1 if there is no such member
+int64_t ds_zrank(const Dataset* ds, const DsRec* rec, const char* name,
+                 size_t len);
+// rank of the first member >= (score, name); ds_zcard() if none
+uint64_t ds_zseekge(const Dataset* ds, const DsRec* rec, double score,
+                    const char* name, size_t len);
+
+inline const char* ds_name(const DsMember* m) {
+  return (const char*)(m + 1);
+}
+
+// Builder: records are written as they come, the key index at the end. The
+// file is built next to `path` and renamed over it.
+struct DsWriter {
+  std::string path;
+  std::string tmp;
+  FILE* fp = NULL;
+  uint64_t off = 0;
+  std::vector<DsSlot> keys;  // the offset of each record
+  bool failed = false;
+};
+
+struct DsInput {
+  double score = 0;
+  const char* name = NULL;
+  size_t len = 0;
+};
+
+bool ds_begin(DsWriter* w, const char* path);
+void ds_put_str(DsWriter* w, const char* key, size_t klen, const char* val,
+                size_t vlen);
+// `members` must be in (score, name) order
+void ds_put_zset(DsWriter* w, const char* key, size_t klen,
+                 const std::vector<DsInput>& members);
+bool ds_finish(DsWriter* w, uint64_t created_ms);
+void ds_abort(DsWriter* w);  // `path` is left as it was
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <stdlib.h>
 
+HMapConf g_hm_conf;
+
 static void h_init(HTab* htab, size_t n) {
   assert(n > 0 && ((n - 1) & n) == 0);  // n must be a power of 2
   htab->tab = (HNode**)calloc(n, sizeof(HNode*));
@@ -50,7 +52,7 @@ static void hm_trigger_rehashing(HMap* hmap) {
 
 static void hm_help_rehashing(HMap* hmap) {
   size_t nwork = 0;
-  while (nwork < k_rehashing_work && hmap->older.size > 0) {
+  while (nwork < g_hm_conf.rehashing_work && hmap->older.size > 0) {
     // find a non-empty slot
     HNode** from = &hmap->older.tab[hmap->migrate_pos];
     if (!*from) {
@@ -94,7 +96,7 @@ void hm_insert(HMap* hmap, HNode* node) {
   }
   h_insert(&hmap->newer, node);
   if (!hmap->older.tab) {
-    size_t threshold = (hmap->newer.mask + 1) * k_max_load_factor;
+    size_t threshold = (hmap->newer.mask + 1) * g_hm_conf.max_load_factor;
     if (hmap->newer.size >= threshold) {
       hm_trigger_rehashing(hmap);
     }
@@ -102,6 +104,22 @@ void hm_insert(HMap* hmap, HNode* node) {
   hm_help_rehashing(hmap);
 }
 
+// Size the table so that it holds `n` keys without rehashing. A larger
+// table is migrated to incrementally like any other.
+void hm_reserve(HMap* hmap, size_t n) {
+  size_t slots = 4;
+  while (slots * g_hm_conf.max_load_factor <= n) {
+    slots *= 2;
+  }
+  if (!hmap->newer.tab) {
+    h_init(&hmap->newer, slots);
+  } else if (!hmap->older.tab && hmap->newer.mask + 1 < slots) {
+    hmap->older = hmap->newer;
+    h_init(&hmap->newer, slots);
+    hmap->migrate_pos = 0;
+  }
+}
+
 void hm_clear(HMap* hmap) {
   free(hmap->newer.tab);
   free(hmap->older.tab);
@@ -6,6 +6,14 @@
 constexpr size_t k_max_load_factor = 8;
 constexpr size_t k_rehashing_work = 128;
 
+// the tunables in use, the constants above unless changed by config set
+struct HMapConf {
+  uint64_t max_load_factor = k_max_load_factor;
+  uint64_t rehashing_work = k_rehashing_work;  // keys moved per operation
+};
+
+extern HMapConf g_hm_conf;
+
 struct HNode {
   HNode* next = NULL;
   uint64_t hcode = 0;  // hash value
@@ -25,6 +33,7 @@ struct HMap {
 
 HNode* hm_lookup(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
 void hm_insert(HMap* hmap, HNode* node);
+void hm_reserve(HMap* hmap, size_t n);
 HNode* hm_delete(HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
 void hm_clear(HMap* hmap);
 size_t hm_size(HMap* hmap);
@@ -0,0 +1,73 @@
+#include "hist.h"
+
+static size_t hist_index(uint64_t val) {
+  if (val < k_hist_sub) {
+    return (size_t)val;
+  }
+  // the top k_hist_sub_bits bits of `val`
+  uint32_t shift = 64 - __builtin_clzll(val) - k_hist_sub_bits;
+  return (size_t)(shift * (k_hist_sub / 2) + (val >> shift));
+}
+
+// the largest value in the bucket
+static uint64_t hist_bucket_max(size_t idx) {
+  if (idx < k_hist_sub) {
+    return idx;
+  }
+  uint64_t half = k_hist_sub / 2;
+  uint32_t shift = (uint32_t)(idx / half - 1);
+  uint64_t top = idx % half + half;
+  return ((top + 1) << shift) - 1;
+}
+
+void hist_add(Hist* h, uint64_t val) {
+  if (val > k_hist_max) {
+    val = k_hist_max;
+  }
+  h->counts[hist_index(val)]++;
+  h->total++;
+  h->sum += val;
+  if (val < h->min) {
+    h->min = val;
+  }
+  if (val > h->max) {
+    h->max = val;
+  }
+}
+
+void hist_merge(Hist* dst, const Hist* src) {
+  for (size_t i = 0; i < k_hist_buckets; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->min < dst->min) {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+uint64_t hist_quantile(const Hist* h, double q) {
+  if (h->total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(q * (double)h->total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < k_hist_buckets; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t val = hist_bucket_max(i);
+      return val < h->max ? val : h->max;
+    }
+  }
+  return h->max;
+}
+
+double hist_mean(const Hist* h) {
+  return h->total ? (double)h->sum / (double)h->total : 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram in the manner of HDR histograms. Values below
+// k_hist_sub count exactly; above that each power of 2 is cut into
+// k_hist_sub / 2 buckets, so a quantile is within 1/64 of a value that was
+// recorded. Values are clamped to k_hist_max. Fixed size, so recording
+// does not allocate.
+
+constexpr uint32_t k_hist_sub_bits = 7;
+constexpr uint64_t k_hist_sub = 1 << k_hist_sub_bits;
+constexpr uint32_t k_hist_max_bits = 40;  // ~18 minutes in ns
+constexpr uint64_t k_hist_max = ((uint64_t)1 << k_hist_max_bits) - 1;
+constexpr size_t k_hist_buckets =
+    (k_hist_max_bits - k_hist_sub_bits + 2) * (k_hist_sub / 2);
+
+struct Hist {
+  uint64_t counts[k_hist_buckets] = {};
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+};
+
+void hist_add(Hist* h, uint64_t val);
+void hist_merge(Hist* dst, const Hist* src);
+// the smallest recorded value that `q` of the values are at or below,
+// rounded up to the end of its bucket; 0 if empty
+uint64_t hist_quantile(const Hist* h, double q);
+double hist_mean(const Hist* h);
@@ -0,0 +1,129 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "dataset.h"
+#include "snapshot.h"
+
+// Offline builder for the static dataset that `server --static` maps:
+//   kvbuild dump.kvs dataset.kvd
+// Keys that have already expired are left out; other TTLs are dropped, as a
+// static dataset never changes.
+
+static uint64_t get_realtime_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_REALTIME, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static bool input_less(const DsInput& a, const DsInput& b) {
+  if (a.score != b.score) {
+    return a.score < b.score;
+  }
+  int rv = memcmp(a.name, b.name, std::min(a.len, b.len));
+  return (rv != 0) ? (rv < 0) : (a.len < b.len);
+}
+
+static bool build(SnapReader* r, DsWriter* w, uint64_t& keys,
+                  uint64_t& dropped) {
+  uint64_t now_ms = get_realtime_msec();
+  std::vector<DsInput> members;
+  while (true) {
+    uint8_t type = snap_get_u8(r);
+    if (!r->ok || type == k_snap_eof) {
+      return r->ok;
+    }
+    uint64_t expire_ms = (type & k_snap_ttl) ? snap_get_u64(r) : 0;
+    bool expired = expire_ms && expire_ms <= now_ms;
+    size_t klen = 0;
+    const char* key = snap_get_str(r, klen);
+    type &= ~k_snap_ttl;
+    if (type == k_snap_str) {
+      size_t vlen = 0;
+      const char* val = snap_get_str(r, vlen);
+      if (!r->ok) {
+        return false;
+      }
+      if (!expired) {
+        ds_put_str(w, key, klen, val, vlen);
+      }
+    } else if (type == k_snap_zset) {
+      members.clear();
+      for (uint64_t n = snap_get_varint(r); n > 0 && r->ok; n--) {
+        DsInput in;
+        in.score = snap_get_dbl(r);
+        in.name = snap_get_str(r, in.len);
+        members.push_back(in);
+      }
+      if (!r->ok) {
+        return false;
+      }
+      // snapshots are written in order; the dataset relies on it
+      if (!std::is_sorted(members.begin(), members.end(), &input_less)) {
+        std::sort(members.begin(), members.end(), &input_less);
+      }
+      if (!expired) {
+        ds_put_zset(w, key, klen, members);
+      }
+    } else {
+      r->ok = false;
+      return false;
+    }
+    expired ? dropped++ : keys++;
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s snapshot dataset\n", argv[0]);
+    return 2;
+  }
+  int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  void* data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(argv[1]);
+    return 1;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  SnapReader r;
+  uint64_t nkeys = 0, created_ms = 0;
+  if (!data || !snap_open(&r, (const uint8_t*)data, size, nkeys, created_ms)) {
+    fprintf(stderr, "%s: not a snapshot\n", argv[1]);
+    return 1;
+  }
+  DsWriter w;
+  if (!ds_begin(&w, argv[2])) {
+    perror(argv[2]);
+    return 1;
+  }
+  uint64_t keys = 0, dropped = 0;
+  if (!build(&r, &w, keys, dropped) || !snap_verify(&r)) {
+    fprintf(stderr, "%s: corrupt snapshot\n", argv[1]);
+    ds_abort(&w);
+    return 1;
+  }
+  if (!ds_finish(&w, created_ms)) {
+    perror(argv[2]);
+    return 1;
+  }
+  printf("%s: %llu keys (%llu expired left out), %.1f MB\n", argv[2],
+         (unsigned long long)keys, (unsigned long long)dropped,
+         (double)w.off / 1e6);
+  munmap(data, size);
+  return 0;
+}
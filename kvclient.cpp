@@ -0,0 +1,498 @@
+#include "kvclient.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "utils.h"
+
+static uint32_t load_u32(const uint8_t* p) {
+  uint32_t val = 0;
+  memcpy(&val, p, 4);
+  return val;
+}
+
+// The end of the value at `p`, or NULL if it runs past `end` or is not a
+// value. Arrays are walked without recursion.
+static const uint8_t* value_end(const uint8_t* p, const uint8_t* end) {
+  uint64_t left = 1;
+  while (left > 0) {
+    if (p >= end) {
+      return NULL;
+    }
+    uint8_t tag = *p++;
+    left--;
+    size_t avail = (size_t)(end - p);
+    switch (tag) {
+      case KV_NIL:
+        break;
+      case KV_ERR:
+        if (avail < 8 || avail - 8 < load_u32(p + 4)) {
+          return NULL;
+        }
+        p += 8 + load_u32(p + 4);
+        break;
+      case KV_STR:
+        if (avail < 4 || avail - 4 < load_u32(p)) {
+          return NULL;
+        }
+        p += 4 + load_u32(p);
+        break;
+      case KV_INT:
+      case KV_DBL:
+        if (avail < 8) {
+          return NULL;
+        }
+        p += 8;
+        break;
+      case KV_ARR:
+        if (avail < 4) {
+          return NULL;
+        }
+        left += load_u32(p);
+        p += 4;
+        break;
+      default:
+        return NULL;
+    }
+  }
+  return p;
+}
+
+uint32_t kv_type(KvValue v) { return v.data[0]; }
+
+std::string_view kv_str(KvValue v) {
+  if (v.data[0] == KV_ERR) {
+    return std::string_view((const char*)v.data + 9, load_u32(v.data + 5));
+  }
+  return std::string_view((const char*)v.data + 5, load_u32(v.data + 1));
+}
+
+uint32_t kv_err_code(KvValue v) { return load_u32(v.data + 1); }
+
+int64_t kv_int(KvValue v) {
+  int64_t val = 0;
+  memcpy(&val, v.data + 1, 8);
+  return val;
+}
+
+double kv_dbl(KvValue v) {
+  double val = 0;
+  memcpy(&val, v.data + 1, 8);
+  return val;
+}
+
+uint32_t kv_arr_len(KvValue v) { return load_u32(v.data + 1); }
+
+KvValue kv_arr_first(KvValue v) { return KvValue{v.data + 5, v.end}; }
+
+KvValue kv_next(KvValue v) { return KvValue{value_end(v.data, v.end), v.end}; }
+
+size_t kv_size(KvValue v) { return (size_t)(value_end(v.data, v.end) - v.data); }
+
+KvValue kv_root(const KvReply& reply) {
+  const uint8_t* data = reply.data.data();
+  return KvValue{data, data + reply.data.size()};
+}
+
+// a callback that fails
+static void kv_fail(const KvCallback& cb, const std::string& msg) {
+  std::string err(9, '\0');
+  uint32_t len = (uint32_t)msg.size();
+  err[0] = KV_ERR;
+  memcpy(&err[1], &k_kv_err_client, 4);
+  memcpy(&err[5], &len, 4);
+  err += msg;
+  const uint8_t* data = (const uint8_t*)err.data();
+  cb(KvValue{data, data + err.size()});
+}
+
+struct KvConn {
+  int fd = -1;
+  // under KvClient::mu
+  bool dead = false;
+  std::string queued;              // requests the I/O thread has not taken
+  std::deque<KvCallback> waiting;  // one per request queued or sent
+  // the I/O thread's
+  std::string sending;
+  size_t sent = 0;
+  Buffer incoming;
+};
+
+struct KvClient {
+  std::vector<KvConn*> conns;
+  std::mutex mu;
+  bool stop = false;   // under `mu`
+  bool woken = false;  // under `mu`, `wake_fd` was written
+  int wake_fd = -1;    // eventfd
+  std::thread io;
+  bool io_frees = false;  // kv_close() was called from a callback
+};
+
+static void kv_free(KvClient* client);
+
+// the pending callbacks fail, and no more calls go to the connection
+static void conn_fail(KvClient* client, KvConn* conn, const char* msg) {
+  std::deque<KvCallback> waiting;
+  {
+    std::lock_guard<std::mutex> lock(client->mu);
+    conn->dead = true;
+    conn->queued.clear();
+    waiting.swap(conn->waiting);
+  }
+  conn->sending.clear();
+  conn->sent = 0;
+  for (const KvCallback& cb : waiting) {
+    kv_fail(cb, msg);
+  }
+}
+
+static void conn_write(KvClient* client, KvConn* conn) {
+  if (conn->sent == conn->sending.size()) {
+    return;
+  }
+  ssize_t rv = write(conn->fd, conn->sending.data() + conn->sent,
+                     conn->sending.size() - conn->sent);
+  if (rv < 0 && errno == EAGAIN) {
+    return;
+  }
+  if (rv < 0) {
+    return conn_fail(client, conn, strerror(errno));
+  }
+  conn->sent += (size_t)rv;
+  if (conn->sent == conn->sending.size()) {
+    conn->sending.clear();
+    conn->sent = 0;
+  }
+}
+
+// complete the calls whose replies are in
+static void conn_read(KvClient* client, KvConn* conn) {
+  uint8_t buf[64 * 1024];
+  ssize_t rv = read(conn->fd, buf, sizeof(buf));
+  if (rv < 0 && errno == EAGAIN) {
+    return;
+  }
+  if (rv <= 0) {
+    return conn_fail(client, conn, rv == 0 ? "EOF" : strerror(errno));
+  }
+  Buffer* in = &conn->incoming;
+  buf_append(in, buf, (size_t)rv);
+  while (buf_size(in) >= 4) {
+    uint32_t len = load_u32(in->data_begin);
+    if (len > k_max_msg) {
+      return conn_fail(client, conn, "reply too long");
+    }
+    if (buf_size(in) < 4 + (size_t)len) {
+      return;
+    }
+    const uint8_t* body = in->data_begin + 4;
+    if (value_end(body, body + len) != body + len) {
+      return conn_fail(client, conn, "bad reply");
+    }
+    KvCallback cb;
+    {
+      std::lock_guard<std::mutex> lock(client->mu);
+      if (client->stop) {
+        return;  // closed by a callback
+      }
+      if (conn->waiting.empty()) {
+        break;
+      }
+      cb = std::move(conn->waiting.front());
+      conn->waiting.pop_front();
+    }
+    cb(KvValue{body, body + len});
+    buf_consume(in, 4 + (size_t)len);
+  }
+  if (buf_size(in) >= 4) {
+    conn_fail(client, conn, "unexpected reply");
+  }
+}
+
+static void kv_io(KvClient* client) {
+  std::vector<struct pollfd> pfds;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(client->mu);
+      if (client->stop) {
+        break;
+      }
+      client->woken = false;
+      // everything queued so far goes out in one write
+      for (KvConn* conn : client->conns) {
+        if (conn->sending.empty()) {
+          conn->sending.swap(conn->queued);
+        } else {
+          conn->sending.append(conn->queued);
+          conn->queued.clear();
+        }
+      }
+    }
+    pfds.clear();
+    pfds.push_back({client->wake_fd, POLLIN, 0});
+    for (KvConn* conn : client->conns) {
+      if (conn->fd < 0) {
+        continue;
+      }
+      conn_write(client, conn);
+      short events = POLLIN;
+      if (conn->sent < conn->sending.size()) {
+        events |= POLLOUT;
+      }
+      pfds.push_back({conn->fd, events, 0});
+    }
+    if (poll(pfds.data(), (nfds_t)pfds.size(), -1) < 0) {
+      continue;
+    }
+    if (pfds[0].revents) {
+      uint64_t val = 0;
+      (void)read(client->wake_fd, &val, sizeof(val));
+    }
+    size_t i = 1;
+    for (KvConn* conn : client->conns) {
+      if (conn->fd < 0) {
+        continue;
+      }
+      short revents = pfds[i++].revents;
+      if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        conn_read(client, conn);
+      }
+      if (revents & POLLOUT) {
+        conn_write(client, conn);
+      }
+      if (conn->dead) {
+        close(conn->fd);
+        conn->fd = -1;
+      }
+    }
+  }
+  if (client->io_frees) {
+    kv_free(client);
+  }
+}
+
+static int kv_dial(const struct sockaddr* addr, socklen_t addrlen) {
+  int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, addr, addrlen) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (addr->sa_family == AF_INET) {
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  }
+  fd_set_nonblock(fd);
+  return fd;
+}
+
+static KvClient* kv_open(const struct sockaddr* addr, socklen_t addrlen,
+                         size_t nconns) {
+  if (nconns == 0) {
+    return NULL;
+  }
+  KvClient* client = new KvClient();
+  client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  bool ok = client->wake_fd >= 0;
+  for (size_t i = 0; ok && i < nconns; i++) {
+    KvConn* conn = new KvConn();
+    conn->fd = kv_dial(addr, addrlen);
+    buf_init(&conn->incoming, 64 * 1024);
+    client->conns.push_back(conn);
+    ok = conn->fd >= 0;
+  }
+  if (!ok) {
+    kv_close(client);
+    return NULL;
+  }
+  client->io = std::thread(&kv_io, client);
+  return client;
+}
+
+KvClient* kv_connect(const char* host, uint16_t port, size_t nconns) {
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    return NULL;
+  }
+  return kv_open((const struct sockaddr*)&addr, sizeof(addr), nconns);
+}
+
+KvClient* kv_connect_unix(const char* path, size_t nconns) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+  return kv_open((const struct sockaddr*)&addr, sizeof(addr), nconns);
+}
+
+void kv_close(KvClient* client) {
+  // the I/O thread can not join itself
+  bool from_io = client->io.get_id() == std::this_thread::get_id();
+  {
+    std::lock_guard<std::mutex> lock(client->mu);
+    client->stop = true;
+  }
+  if (from_io) {
+    client->io_frees = true;
+    client->io.detach();
+    return;
+  }
+  if (client->io.joinable()) {
+    uint64_t val = 1;
+    (void)write(client->wake_fd, &val, sizeof(val));
+    client->io.join();
+  }
+  kv_free(client);
+}
+
+// after the I/O thread is done
+static void kv_free(KvClient* client) {
+  for (KvConn* conn : client->conns) {
+    for (const KvCallback& cb : conn->waiting) {
+      kv_fail(cb, "client closed");
+    }
+    if (conn->fd >= 0) {
+      close(conn->fd);
+    }
+    buf_destroy(&conn->incoming);
+    delete conn;
+  }
+  if (client->wake_fd >= 0) {
+    close(client->wake_fd);
+  }
+  delete client;
+}
+
+static void put_u32(std::string& out, uint32_t val) {
+  out.append((const char*)&val, 4);
+}
+
+// on the command count of a batch frame
+constexpr uint32_t k_kv_batch_flag = 1u << 31;
+
+static size_t cmd_size(const std::vector<std::string_view>& args) {
+  size_t len = 4;
+  for (std::string_view arg : args) {
+    len += 4 + arg.size();
+  }
+  return len;
+}
+
+static void put_cmd(std::string& out,
+                    const std::vector<std::string_view>& args) {
+  put_u32(out, (uint32_t)args.size());
+  for (std::string_view arg : args) {
+    put_u32(out, (uint32_t)arg.size());
+    out.append(arg.data(), arg.size());
+  }
+}
+
+// the connection with the fewest replies outstanding, under `mu`
+static KvConn* pick_conn(KvClient* client) {
+  KvConn* conn = NULL;
+  for (KvConn* c : client->conns) {
+    if (!c->dead && (!conn || c->waiting.size() < conn->waiting.size())) {
+      conn = c;
+    }
+  }
+  return client->stop ? NULL : conn;
+}
+
+// after a request is queued, under `lock`, which is released
+static void kv_wake(KvClient* client, std::unique_lock<std::mutex>& lock) {
+  bool wake = !client->woken;
+  client->woken = true;
+  lock.unlock();
+  if (wake) {
+    uint64_t val = 1;
+    (void)write(client->wake_fd, &val, sizeof(val));
+  }
+}
+
+void kv_call(KvClient* client, const std::vector<std::string_view>& args,
+             KvCallback cb) {
+  size_t len = cmd_size(args);
+  if (len > k_max_msg) {
+    return kv_fail(cb, "request too big");
+  }
+  std::unique_lock<std::mutex> lock(client->mu);
+  KvConn* conn = pick_conn(client);
+  if (!conn) {
+    lock.unlock();
+    return kv_fail(cb, "not connected");
+  }
+  put_u32(conn->queued, (uint32_t)len);
+  put_cmd(conn->queued, args);
+  conn->waiting.push_back(std::move(cb));
+  kv_wake(client, lock);
+}
+
+void kv_batch(KvClient* client,
+              const std::vector<std::vector<std::string_view>>& cmds,
+              KvCallback cb) {
+  size_t len = 4;
+  for (const std::vector<std::string_view>& args : cmds) {
+    len += cmd_size(args);
+  }
+  if (len > k_max_msg || cmds.size() >= k_kv_batch_flag) {
+    return kv_fail(cb, "request too big");
+  }
+  std::unique_lock<std::mutex> lock(client->mu);
+  KvConn* conn = pick_conn(client);
+  if (!conn) {
+    lock.unlock();
+    return kv_fail(cb, "not connected");
+  }
+  put_u32(conn->queued, (uint32_t)len);
+  put_u32(conn->queued, (uint32_t)cmds.size() | k_kv_batch_flag);
+  for (const std::vector<std::string_view>& args : cmds) {
+    put_cmd(conn->queued, args);
+  }
+  conn->waiting.push_back(std::move(cb));
+  kv_wake(client, lock);
+}
+
+// a callback that fulfills a promise of the reply
+static KvCallback kv_promise(std::future<KvReply>& future) {
+  auto promise = std::make_shared<std::promise<KvReply>>();
+  future = promise->get_future();
+  return [promise](KvValue v) {
+    KvReply reply;
+    reply.data.assign(v.data, v.data + kv_size(v));
+    promise->set_value(std::move(reply));
+  };
+}
+
+std::future<KvReply> kv_call(KvClient* client,
+                             const std::vector<std::string_view>& args) {
+  std::future<KvReply> future;
+  kv_call(client, args, kv_promise(future));
+  return future;
+}
+
+std::future<KvReply> kv_batch(
+    KvClient* client, const std::vector<std::vector<std::string_view>>& cmds) {
+  std::future<KvReply> future;
+  kv_batch(client, cmds, kv_promise(future));
+  return future;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <future>
+#include <string_view>
+#include <vector>
+
+// Client library for the binary protocol. A KvClient is a pool of
+// connections served by one I/O thread. kv_call() can be used from any
+// thread: it encodes the request and queues it on the connection with the
+// fewest replies outstanding. The I/O thread sends everything queued since
+// its last pass with one write() per connection, so concurrent calls are
+// batched, and runs the callbacks in request order as the replies arrive.
+//
+// Replies are parsed in place: a KvValue points into the reply bytes, and
+// reading a field allocates nothing. Requests and replies can be as large
+// as the server allows, k_max_msg.
+//
+// A blocking command (bzpopmin, bzpopmax) holds up the replies queued
+// behind it on the same connection.
+
+// value types, as on the wire
+enum {
+  KV_NIL = 0,
+  KV_ERR = 1,  // code and message
+  KV_STR = 2,
+  KV_INT = 3,
+  KV_DBL = 4,
+  KV_ARR = 5,
+};
+
+// KV_ERR code of errors from the library itself: a request that is too
+// big, or a connection that failed or was closed with the call pending
+constexpr uint32_t k_kv_err_client = 0;
+
+// a value in a reply, valid as long as the reply bytes are
+struct KvValue {
+  const uint8_t* data = NULL;  // at the type tag
+  const uint8_t* end = NULL;   // of the reply
+};
+
+uint32_t kv_type(KvValue v);
+std::string_view kv_str(KvValue v);  // KV_STR, or the message of KV_ERR
+uint32_t kv_err_code(KvValue v);
+int64_t kv_int(KvValue v);
+double kv_dbl(KvValue v);
+uint32_t kv_arr_len(KvValue v);
+KvValue kv_arr_first(KvValue v);  // the first element, if any
+KvValue kv_next(KvValue v);       // the value after `v` and its elements
+size_t kv_size(KvValue v);        // bytes, with the elements
+
+// a reply that owns its bytes
+struct KvReply {
+  std::vector<uint8_t> data;
+};
+
+KvValue kv_root(const KvReply& reply);
+
+// runs on the I/O thread; the value is only valid during the call
+using KvCallback = std::function<void(KvValue)>;
+
+struct KvClient;
+
+// `nconns` connections to an IPv4 address; NULL if any of them fails
+KvClient* kv_connect(const char* host, uint16_t port, size_t nconns);
+// the same over the server's unix socket, --unixsocket
+KvClient* kv_connect_unix(const char* path, size_t nconns);
+// Stop the I/O thread and fail the calls still pending, whose callbacks
+// run on this thread. Called from a callback, it returns at once instead:
+// the I/O thread fails the pending calls and frees the client after the
+// callback returns. Either way `client` must not be used again.
+void kv_close(KvClient* client);
+// a call that can not be sent fails at once, on this thread
+void kv_call(KvClient* client, const std::vector<std::string_view>& args,
+             KvCallback cb);
+std::future<KvReply> kv_call(KvClient* client,
+                             const std::vector<std::string_view>& args);
+
+// Several commands in one batch frame. The server runs them with no other
+// client's command in between and replies with one KV_ARR holding a value,
+// or a KV_ERR, per command. Blocking commands are refused. Once the reply
+// would grow past k_max_msg, the commands left are not run and get errors.
+void kv_batch(KvClient* client,
+              const std::vector<std::vector<std::string_view>>& cmds,
+              KvCallback cb);
+std::future<KvReply> kv_batch(
+    KvClient* client, const std::vector<std::vector<std::string_view>>& cmds);
@@ -0,0 +1,242 @@
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "utils.h"
+
+constexpr size_t k_log_slots = 4096;  // power of 2
+constexpr size_t k_log_line = 240;    // longer messages are truncated
+constexpr uint32_t k_log_burst = 20;  // per call site per second
+
+struct LogSlot {
+  std::atomic<size_t> seq;
+  uint64_t time_ms;
+  uint8_t level;
+  uint16_t len;
+  char text[k_log_line];
+};
+
+static struct {
+  int fd = 2;
+  std::atomic<int> level{LOG_INFO};
+  LogSlot slots[k_log_slots];
+  std::atomic<size_t> enqueue_pos{0};  // producers
+  std::mutex drain_mu;                 // the writer thread or log_flush()
+  size_t dequeue_pos = 0;              // under `drain_mu`
+  uint64_t reported_drops = 0;         // under `drain_mu`
+  std::atomic<uint64_t> written{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> suppressed{0};
+} g_log;
+
+static uint64_t get_realtime_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_REALTIME, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+// claim a slot; bounded MPMC queue with per-slot sequence numbers
+static LogSlot* ring_claim(size_t& pos) {
+  pos = g_log.enqueue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    LogSlot* slot = &g_log.slots[pos & (k_log_slots - 1)];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (g_log.enqueue_pos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        return slot;
+      }
+    } else if (diff < 0) {
+      return NULL;  // full
+    } else {
+      pos = g_log.enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+static void ring_push(int level, const char* fmt, va_list ap) {
+  size_t pos = 0;
+  LogSlot* slot = ring_claim(pos);
+  if (!slot) {
+    g_log.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  slot->time_ms = get_realtime_msec();
+  slot->level = (uint8_t)level;
+  int n = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+  slot->len = (uint16_t)(n < 0 ? 0 : std::min<size_t>(n, k_log_line - 1));
+  slot->seq.store(pos + 1, std::memory_order_release);  // publish
+}
+
+static void ring_pushf(int level, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  ring_push(level, fmt, ap);
+  va_end(ap);
+}
+
+// per call site, keyed by the format string
+struct RateLimit {
+  const char* fmt = NULL;
+  uint64_t window = 0;  // in seconds
+  uint32_t count = 0;
+  uint32_t suppressed = 0;
+};
+
+static bool rate_allow(const char* fmt) {
+  static thread_local RateLimit sites[64];
+  RateLimit& site = sites[((uintptr_t)fmt >> 3) & 63];
+  uint64_t window = get_realtime_msec() / 1000;
+  if (site.fmt != fmt || site.window != window) {
+    if (site.suppressed) {
+      ring_pushf(LOG_WARN, "%u similar messages suppressed: %s",
+                 site.suppressed, site.fmt);
+    }
+    site = RateLimit{fmt, window, 0, 0};
+  }
+  if (++site.count > k_log_burst) {
+    site.suppressed++;
+    g_log.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void log_msg(int level, const char* fmt, ...) {
+  if (level < g_log.level.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (!rate_allow(fmt)) {
+    return;
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  ring_push(level, fmt, ap);
+  va_end(ap);
+}
+
+static size_t format_slot(const LogSlot* slot, char* out, size_t cap) {
+  time_t sec = (time_t)(slot->time_ms / 1000);
+  struct tm tm;
+  localtime_r(&sec, &tm);
+  char ts[32];
+  strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+  int n = snprintf(out, cap, "%s.%03u %c %.*s\n", ts,
+                   (unsigned)(slot->time_ms % 1000), "DIWE"[slot->level],
+                   (int)slot->len, slot->text);
+  return n < 0 ? 0 : std::min<size_t>(n, cap - 1);
+}
+
+// Format what is in the ring into `buf`, as much as fits, and write it
+// out in one write(). The bytes written; 0 if the ring is empty.
+static size_t log_drain(char* buf, size_t cap) {
+  size_t len = 0;
+  while (len + k_log_line + 64 < cap) {
+    size_t pos = g_log.dequeue_pos;
+    LogSlot* slot = &g_log.slots[pos & (k_log_slots - 1)];
+    if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+      break;  // empty
+    }
+    len += format_slot(slot, buf + len, cap - len);
+    slot->seq.store(pos + k_log_slots, std::memory_order_release);
+    g_log.dequeue_pos = pos + 1;
+    g_log.written.fetch_add(1, std::memory_order_relaxed);
+  }
+  uint64_t drops = g_log.dropped.load(std::memory_order_relaxed);
+  if (drops != g_log.reported_drops && len + 64 < cap) {
+    int n = snprintf(buf + len, cap - len, "log: %llu messages dropped\n",
+                     (unsigned long long)(drops - g_log.reported_drops));
+    len += n < 0 ? 0 : n;
+    g_log.reported_drops = drops;
+  }
+  for (size_t off = 0; off < len;) {
+    ssize_t rv = write(g_log.fd, buf + off, len - off);
+    if (rv <= 0) {
+      break;  // nowhere to report it
+    }
+    off += (size_t)rv;
+  }
+  return len;
+}
+
+// the writer thread: batch everything available into one write()
+static void log_writer() {
+  char buf[64 * 1024];
+  while (true) {
+    size_t len = 0;
+    {
+      std::lock_guard<std::mutex> lock(g_log.drain_mu);
+      len = log_drain(buf, sizeof(buf));
+    }
+    if (len == 0) {
+      struct timespec delay = {0, 10 * 1000 * 1000};
+      nanosleep(&delay, NULL);
+    }
+  }
+}
+
+void log_flush() {
+  // The writer may be stuck in a write(), or may not exist in a forked
+  // child with the lock taken: give up after ~100ms rather than hang.
+  std::unique_lock<std::mutex> lock(g_log.drain_mu, std::defer_lock);
+  for (int i = 0; i < 100 && !lock.try_lock(); i++) {
+    struct timespec delay = {0, 1000 * 1000};
+    nanosleep(&delay, NULL);
+  }
+  if (!lock.owns_lock()) {
+    return;
+  }
+  char buf[16 * 1024];
+  while (log_drain(buf, sizeof(buf)) > 0) {
+  }
+}
+
+bool log_init(const char* path, int level) {
+  if (path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    g_log.fd = fd;
+  }
+  g_log.level = level;
+  for (size_t i = 0; i < k_log_slots; i++) {
+    g_log.slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+  std::thread(log_writer).detach();
+  // the last messages before an exit or a die() are the ones that matter
+  g_die_hook = &log_flush;
+  atexit(&log_flush);
+  return true;
+}
+
+bool log_parse_level(const char* name, int& level) {
+  const char* names[] = {"debug", "info", "warn", "error"};
+  for (int i = 0; i < 4; i++) {
+    if (0 == strcasecmp(name, names[i])) {
+      level = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+LogStats log_stats() {
+  LogStats stats;
+  stats.written = g_log.written.load(std::memory_order_relaxed);
+  stats.dropped = g_log.dropped.load(std::memory_order_relaxed);
+  stats.suppressed = g_log.suppressed.load(std::memory_order_relaxed);
+  return stats;
+}
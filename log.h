@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous logging. log_msg() formats into a slot of a lock-free ring
+// buffer and returns; a background thread drains the ring to the log file.
+// When the ring is full the message is dropped and counted rather than
+// blocking the caller. Each call site is also limited to a burst of
+// messages per second; the rest are counted, and reported by the site the
+// next time it logs. log_init() makes die() and exit() flush the ring.
+
+enum {
+  LOG_DEBUG = 0,
+  LOG_INFO = 1,
+  LOG_WARN = 2,
+  LOG_ERROR = 3,
+};
+
+struct LogStats {
+  uint64_t written = 0;
+  uint64_t dropped = 0;     // the ring was full
+  uint64_t suppressed = 0;  // rate limited
+};
+
+// `path` is NULL for stderr
+bool log_init(const char* path, int level);
+bool log_parse_level(const char* name, int& level);
+void log_msg(int level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+LogStats log_stats();
+// write out what is in the ring now, on this thread
+void log_flush();
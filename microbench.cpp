@@ -0,0 +1,626 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "avl.h"
+#include "common.h"
+#include "hashtable.h"
+#include "heap.h"
+#include "zset.h"
+
+// Cost per operation of the server's data structures:
+//   microbench [--filter str] [--min-size n] [--max-size n] [--reps n]
+//              [--warmup n] [--cpu n] [--save file] [--baseline file]
+// Each benchmark runs at sizes 10^3 up to --max-size (10^6 by default, up
+// to 10^8 if memory allows), --warmup times discarded and --reps times
+// measured, pinned to one CPU. It reports the median and the minimum
+// ns/op and the allocations per op. Small sizes repeat the work on
+// separate structures so a run is at least k_min_ops operations.
+// --save writes the medians to a file; --baseline reads such a file and
+// prints the change against it.
+
+static uint64_t get_monotonic_nsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 * 1000 + tv.tv_nsec;
+}
+
+// count every allocation, operator new included
+static uint64_t g_allocs = 0;
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  g_allocs++;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  g_allocs++;
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  g_allocs++;
+  return __libc_realloc(ptr, size);
+}
+}
+
+constexpr size_t k_min_ops = 1000 * 1000;
+constexpr size_t k_range_len = 100;  // members per zset range scan
+
+// the measured part of a run
+static struct {
+  uint64_t start_ns = 0;
+  uint64_t start_allocs = 0;
+  uint64_t ns = 0;
+  uint64_t allocs = 0;
+} g_timer;
+
+static void timer_start() {
+  g_timer.start_allocs = g_allocs;
+  g_timer.start_ns = get_monotonic_nsec();
+}
+
+static void timer_stop() {
+  g_timer.ns = get_monotonic_nsec() - g_timer.start_ns;
+  g_timer.allocs = g_allocs - g_timer.start_allocs;
+}
+
+static std::mt19937_64 g_rng(1);
+static volatile uint64_t g_sink = 0;  // keeps results alive
+
+// 0..n-1 in random order
+static std::vector<uint64_t> shuffled(size_t n) {
+  std::vector<uint64_t> v(n);
+  for (size_t i = 0; i < n; i++) {
+    v[i] = i;
+  }
+  std::shuffle(v.begin(), v.end(), g_rng);
+  return v;
+}
+
+// HMap
+
+struct HEnt {
+  HNode node;
+  uint64_t key = 0;
+};
+
+static void hent_init(HEnt* ent, uint64_t key) {
+  ent->key = key;
+  ent->node.hcode = str_hash((const uint8_t*)&key, sizeof(key));
+}
+
+static bool hent_eq(HNode* lhs, HNode* rhs) {
+  return container_of(lhs, HEnt, node)->key ==
+         container_of(rhs, HEnt, node)->key;
+}
+
+// `rounds` maps of `n` keys, inserted in random order
+static void hmap_fill(std::vector<HMap>& maps, std::vector<HEnt>& ents,
+                      size_t n, size_t rounds, bool timed) {
+  maps.resize(rounds);
+  ents.resize(n * rounds);
+  std::vector<uint64_t> keys = shuffled(n);
+  for (size_t i = 0; i < ents.size(); i++) {
+    hent_init(&ents[i], keys[i % n]);
+  }
+  if (timed) {
+    timer_start();
+  }
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      hm_insert(&maps[r], &ents[r * n + i].node);
+    }
+  }
+  if (timed) {
+    timer_stop();
+  }
+}
+
+static void hmap_clear(std::vector<HMap>& maps) {
+  for (HMap& map : maps) {
+    hm_clear(&map);
+  }
+}
+
+static size_t bench_hmap_insert(size_t n, size_t rounds) {
+  std::vector<HMap> maps;
+  std::vector<HEnt> ents;
+  hmap_fill(maps, ents, n, rounds, true);
+  hmap_clear(maps);
+  return n * rounds;
+}
+
+static size_t bench_hmap_lookup(size_t n, size_t rounds) {
+  std::vector<HMap> maps;
+  std::vector<HEnt> ents;
+  hmap_fill(maps, ents, n, 1, false);
+  std::vector<uint64_t> order = shuffled(n);
+  size_t ops = n * rounds;
+  timer_start();
+  for (size_t i = 0; i < ops; i++) {
+    HEnt key;
+    hent_init(&key, order[i % n]);
+    g_sink += (uintptr_t)hm_lookup(&maps[0], &key.node, &hent_eq);
+  }
+  timer_stop();
+  hmap_clear(maps);
+  return ops;
+}
+
+static size_t bench_hmap_delete(size_t n, size_t rounds) {
+  std::vector<HMap> maps;
+  std::vector<HEnt> ents;
+  hmap_fill(maps, ents, n, rounds, false);
+  std::vector<uint64_t> order = shuffled(n);
+  timer_start();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      HEnt key;
+      hent_init(&key, order[i]);
+      g_sink += (uintptr_t)hm_delete(&maps[r], &key.node, &hent_eq);
+    }
+  }
+  timer_stop();
+  hmap_clear(maps);
+  return n * rounds;
+}
+
+// AVL, an ordered set of integers as in test_avl.cpp
+
+struct ANode {
+  AVLNode node;
+  uint64_t val = 0;
+};
+
+static void avl_add(AVLNode** root, ANode* data) {
+  avl_init(&data->node);
+  AVLNode* cur = NULL;
+  AVLNode** from = root;
+  while (*from) {
+    cur = *from;
+    uint64_t node_val = container_of(cur, ANode, node)->val;
+    from = (data->val < node_val) ? &cur->left : &cur->right;
+  }
+  *from = &data->node;
+  data->node.parent = cur;
+  *root = avl_fix(&data->node);
+}
+
+static AVLNode* avl_find(AVLNode* root, uint64_t val) {
+  AVLNode* cur = root;
+  while (cur) {
+    uint64_t node_val = container_of(cur, ANode, node)->val;
+    if (val == node_val) {
+      break;
+    }
+    cur = (val < node_val) ? cur->left : cur->right;
+  }
+  return cur;
+}
+
+static void avl_fill(std::vector<AVLNode*>& roots, std::vector<ANode>& nodes,
+                     size_t n, size_t rounds, bool timed) {
+  roots.assign(rounds, NULL);
+  nodes.resize(n * rounds);
+  std::vector<uint64_t> vals = shuffled(n);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    nodes[i].val = vals[i % n];
+  }
+  if (timed) {
+    timer_start();
+  }
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      avl_add(&roots[r], &nodes[r * n + i]);
+    }
+  }
+  if (timed) {
+    timer_stop();
+  }
+}
+
+static size_t bench_avl_insert(size_t n, size_t rounds) {
+  std::vector<AVLNode*> roots;
+  std::vector<ANode> nodes;
+  avl_fill(roots, nodes, n, rounds, true);
+  return n * rounds;
+}
+
+static size_t bench_avl_lookup(size_t n, size_t rounds) {
+  std::vector<AVLNode*> roots;
+  std::vector<ANode> nodes;
+  avl_fill(roots, nodes, n, 1, false);
+  std::vector<uint64_t> order = shuffled(n);
+  size_t ops = n * rounds;
+  timer_start();
+  for (size_t i = 0; i < ops; i++) {
+    g_sink += (uintptr_t)avl_find(roots[0], order[i % n]);
+  }
+  timer_stop();
+  return ops;
+}
+
+static size_t bench_avl_delete(size_t n, size_t rounds) {
+  std::vector<AVLNode*> roots;
+  std::vector<ANode> nodes;
+  avl_fill(roots, nodes, n, rounds, false);
+  // nodes[r * n + i] holds shuffled value i, so delete in another order
+  std::vector<uint64_t> order = shuffled(n);
+  timer_start();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      roots[r] = avl_del(&nodes[r * n + order[i]].node);
+    }
+  }
+  timer_stop();
+  return n * rounds;
+}
+
+// ZSet, members "m<i>" with score i
+
+static std::vector<std::string> zset_names(size_t n) {
+  std::vector<std::string> names(n);
+  for (size_t i = 0; i < n; i++) {
+    names[i] = "m" + std::to_string(i);
+  }
+  return names;
+}
+
+static void zset_fill(std::vector<ZSet>& zsets,
+                      const std::vector<std::string>& names, size_t rounds,
+                      bool timed) {
+  size_t n = names.size();
+  zsets.resize(rounds);
+  std::vector<uint64_t> order = shuffled(n);
+  if (timed) {
+    timer_start();
+  }
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      const std::string& name = names[order[i]];
+      zset_insert(&zsets[r], name.data(), name.size(), (double)order[i]);
+    }
+  }
+  if (timed) {
+    timer_stop();
+  }
+}
+
+static void zset_clear_all(std::vector<ZSet>& zsets) {
+  for (ZSet& zset : zsets) {
+    zset_clear(&zset);
+  }
+}
+
+static size_t bench_zset_insert(size_t n, size_t rounds) {
+  std::vector<std::string> names = zset_names(n);
+  std::vector<ZSet> zsets;
+  zset_fill(zsets, names, rounds, true);
+  zset_clear_all(zsets);
+  return n * rounds;
+}
+
+static size_t bench_zset_lookup(size_t n, size_t rounds) {
+  std::vector<std::string> names = zset_names(n);
+  std::vector<ZSet> zsets;
+  zset_fill(zsets, names, 1, false);
+  std::vector<uint64_t> order = shuffled(n);
+  size_t ops = n * rounds;
+  timer_start();
+  for (size_t i = 0; i < ops; i++) {
+    const std::string& name = names[order[i % n]];
+    g_sink += (uintptr_t)zset_lookup(&zsets[0], name.data(), name.size());
+  }
+  timer_stop();
+  zset_clear_all(zsets);
+  return ops;
+}
+
+static size_t bench_zset_delete(size_t n, size_t rounds) {
+  std::vector<std::string> names = zset_names(n);
+  std::vector<ZSet> zsets;
+  zset_fill(zsets, names, rounds, false);
+  std::vector<uint64_t> order = shuffled(n);
+  timer_start();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      const std::string& name = names[order[i]];
+      zset_delete(&zsets[r],
+                  zset_lookup(&zsets[r], name.data(), name.size()));
+    }
+  }
+  timer_stop();
+  zset_clear_all(zsets);
+  return n * rounds;
+}
+
+// zrank: find the member, then its rank
+static size_t bench_zset_rank(size_t n, size_t rounds) {
+  std::vector<std::string> names = zset_names(n);
+  std::vector<ZSet> zsets;
+  zset_fill(zsets, names, 1, false);
+  std::vector<uint64_t> order = shuffled(n);
+  size_t ops = n * rounds;
+  timer_start();
+  for (size_t i = 0; i < ops; i++) {
+    const std::string& name = names[order[i % n]];
+    ZNode* znode = zset_lookup(&zsets[0], name.data(), name.size());
+    g_sink += (uint64_t)avl_rank(&znode->tree);
+  }
+  timer_stop();
+  zset_clear_all(zsets);
+  return ops;
+}
+
+// zquery: seek to a random score, then walk k_range_len members; one op
+// is one scan
+static size_t bench_zset_range(size_t n, size_t rounds) {
+  std::vector<std::string> names = zset_names(n);
+  std::vector<ZSet> zsets;
+  zset_fill(zsets, names, 1, false);
+  std::vector<uint64_t> order = shuffled(n);
+  size_t ops = std::max<size_t>(1, n * rounds / k_range_len);
+  timer_start();
+  for (size_t i = 0; i < ops; i++) {
+    ZNode* znode = zset_seekge(&zsets[0], (double)order[i % n], "", 0);
+    for (size_t j = 0; znode && j < k_range_len; j++) {
+      g_sink += znode->len;
+      znode = znode_next(znode);
+    }
+  }
+  timer_stop();
+  zset_clear_all(zsets);
+  return ops;
+}
+
+// heap, as the server keeps the TTL heap
+
+static void heap_upsert(std::vector<HeapItem>& a, size_t pos, HeapItem t) {
+  if (pos < a.size()) {
+    a[pos] = t;
+  } else {
+    pos = a.size();
+    a.push_back(t);
+  }
+  heap_update(a.data(), pos, a.size());
+}
+
+static void heap_delete(std::vector<HeapItem>& a, size_t pos) {
+  a[pos] = a.back();
+  a.pop_back();
+  if (pos < a.size()) {
+    heap_update(a.data(), pos, a.size());
+  }
+}
+
+static void heap_fill(std::vector<std::vector<HeapItem>>& heaps,
+                      std::vector<size_t>& refs, size_t n, size_t rounds,
+                      bool timed) {
+  heaps.resize(rounds);
+  refs.assign(n * rounds, (size_t)-1);
+  std::vector<uint64_t> vals = shuffled(n);
+  for (std::vector<HeapItem>& heap : heaps) {
+    heap.reserve(n);
+  }
+  if (timed) {
+    timer_start();
+  }
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      HeapItem item = {vals[i], &refs[r * n + i]};
+      heap_upsert(heaps[r], refs[r * n + i], item);
+    }
+  }
+  if (timed) {
+    timer_stop();
+  }
+}
+
+static size_t bench_heap_insert(size_t n, size_t rounds) {
+  std::vector<std::vector<HeapItem>> heaps;
+  std::vector<size_t> refs;
+  heap_fill(heaps, refs, n, rounds, true);
+  return n * rounds;
+}
+
+// an item already in the heap gets a new value, as a TTL update does
+static size_t bench_heap_update(size_t n, size_t rounds) {
+  std::vector<std::vector<HeapItem>> heaps;
+  std::vector<size_t> refs;
+  heap_fill(heaps, refs, n, 1, false);
+  std::vector<uint64_t> order = shuffled(n);
+  std::vector<uint64_t> vals = shuffled(n);
+  size_t ops = n * rounds;
+  timer_start();
+  for (size_t i = 0; i < ops; i++) {
+    size_t* ref = &refs[order[i % n]];
+    HeapItem item = {vals[i % n], ref};
+    heap_upsert(heaps[0], *ref, item);
+  }
+  timer_stop();
+  return ops;
+}
+
+static size_t bench_heap_delete(size_t n, size_t rounds) {
+  std::vector<std::vector<HeapItem>> heaps;
+  std::vector<size_t> refs;
+  heap_fill(heaps, refs, n, rounds, false);
+  std::vector<uint64_t> order = shuffled(n);
+  timer_start();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      heap_delete(heaps[r], refs[r * n + order[i]]);
+    }
+  }
+  timer_stop();
+  return n * rounds;
+}
+
+struct Bench {
+  const char* name;
+  size_t (*fn)(size_t n, size_t rounds);  // the ops timed
+};
+
+static const Bench k_benches[] = {
+    {"hmap_insert", &bench_hmap_insert},
+    {"hmap_lookup", &bench_hmap_lookup},
+    {"hmap_delete", &bench_hmap_delete},
+    {"avl_insert", &bench_avl_insert},
+    {"avl_lookup", &bench_avl_lookup},
+    {"avl_delete", &bench_avl_delete},
+    {"zset_insert", &bench_zset_insert},
+    {"zset_lookup", &bench_zset_lookup},
+    {"zset_delete", &bench_zset_delete},
+    {"zset_rank", &bench_zset_rank},
+    {"zset_range100", &bench_zset_range},
+    {"heap_insert", &bench_heap_insert},
+    {"heap_update", &bench_heap_update},
+    {"heap_delete", &bench_heap_delete},
+};
+
+static std::string result_key(const char* name, size_t n) {
+  return std::string(name) + " " + std::to_string(n);
+}
+
+// "name size ns_per_op allocs_per_op" lines
+static bool load_baseline(const char* path,
+                          std::map<std::string, double>& out) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    return false;
+  }
+  char name[64];
+  size_t n = 0;
+  double ns = 0, allocs = 0;
+  while (fscanf(fp, "%63s %zu %lf %lf", name, &n, &ns, &allocs) == 4) {
+    out[result_key(name, n)] = ns;
+  }
+  fclose(fp);
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: microbench [--filter str] [--min-size n] [--max-size n] "
+          "[--reps n]\n"
+          "                  [--warmup n] [--cpu n|-1] [--save file] "
+          "[--baseline file]\n");
+}
+
+int main(int argc, char** argv) {
+  const char* filter = "";
+  size_t min_size = 1000;
+  size_t max_size = 1000 * 1000;
+  size_t reps = 5;
+  size_t warmup = 1;
+  int cpu = sched_getcpu();
+  const char* save_path = NULL;
+  const char* baseline_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    bool more = i + 1 < argc;
+    if (0 == strcmp(argv[i], "--filter") && more) {
+      filter = argv[++i];
+    } else if (0 == strcmp(argv[i], "--min-size") && more) {
+      min_size = (size_t)strtod(argv[++i], NULL);  // 1e3 works
+    } else if (0 == strcmp(argv[i], "--max-size") && more) {
+      max_size = (size_t)strtod(argv[++i], NULL);
+    } else if (0 == strcmp(argv[i], "--reps") && more) {
+      reps = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--warmup") && more) {
+      warmup = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--cpu") && more) {
+      cpu = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "--save") && more) {
+      save_path = argv[++i];
+    } else if (0 == strcmp(argv[i], "--baseline") && more) {
+      baseline_path = argv[++i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (reps == 0 || min_size == 0 || min_size > max_size) {
+    usage();
+    return 1;
+  }
+
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      fprintf(stderr, "can not pin to CPU %d\n", cpu);
+      return 1;
+    }
+  }
+  std::map<std::string, double> baseline;
+  if (baseline_path && !load_baseline(baseline_path, baseline)) {
+    fprintf(stderr, "can not read %s\n", baseline_path);
+    return 1;
+  }
+  FILE* save = NULL;
+  if (save_path && !(save = fopen(save_path, "w"))) {
+    fprintf(stderr, "can not write %s\n", save_path);
+    return 1;
+  }
+
+  printf("%-14s %10s %10s %10s %10s", "benchmark", "size", "ns/op",
+         "min", "allocs/op");
+  if (baseline_path) {
+    printf(" %10s %8s", "baseline", "change");
+  }
+  printf("\n");
+  for (const Bench& bench : k_benches) {
+    if (!strstr(bench.name, filter)) {
+      continue;
+    }
+    for (size_t n = 1000; n <= max_size; n *= 10) {
+      if (n < min_size) {
+        continue;
+      }
+      size_t rounds = std::max<size_t>(1, k_min_ops / n);
+      std::vector<double> ns_per_op;
+      double allocs_per_op = 0;
+      for (size_t rep = 0; rep < warmup + reps; rep++) {
+        size_t ops = bench.fn(n, rounds);
+        if (rep >= warmup) {
+          ns_per_op.push_back((double)g_timer.ns / (double)ops);
+          allocs_per_op = (double)g_timer.allocs / (double)ops;
+        }
+      }
+      std::sort(ns_per_op.begin(), ns_per_op.end());
+      double median = ns_per_op[ns_per_op.size() / 2];
+      printf("%-14s %10zu %10.1f %10.1f %10.4f", bench.name, n, median,
+             ns_per_op[0], allocs_per_op);
+      auto it = baseline.find(result_key(bench.name, n));
+      if (it != baseline.end()) {
+        printf(" %10.1f %+7.1f%%", it->second,
+               100 * (median - it->second) / it->second);
+      }
+      printf("\n");
+      fflush(stdout);
+      if (save) {
+        fprintf(save, "%s %zu %.3f %.6f\n", bench.name, n, median,
+                allocs_per_op);
+      }
+    }
+  }
+  if (save) {
+    fclose(save);
+  }
+  return 0;
+}
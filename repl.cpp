@@ -0,0 +1,54 @@
+#include "repl.h"
+
+#include <algorithm>
+#include <random>
+
+void backlog_init(ReplBacklog* b, size_t size) {
+  b->ring.assign(std::max<size_t>(size, 1), 0);
+}
+
+void backlog_feed(ReplBacklog* b, const uint8_t* data, size_t len) {
+  size_t size = b->ring.size();
+  if (size == 0) {
+    return;
+  }
+  b->off += len;
+  if (len > size) {  // only the tail survives
+    data += len - size;
+    len = size;
+  }
+  size_t pos = (size_t)((b->off - len) % size);
+  size_t n = std::min(len, size - pos);
+  std::copy(data, data + n, b->ring.begin() + pos);
+  std::copy(data + n, data + len, b->ring.begin());
+}
+
+uint64_t backlog_start(const ReplBacklog* b) {
+  uint64_t size = b->ring.size();
+  return b->off > size ? b->off - size : 0;
+}
+
+size_t backlog_read(const ReplBacklog* b, uint64_t from, Buffer* out,
+                    size_t max) {
+  size_t size = b->ring.size();
+  size_t len = (size_t)std::min<uint64_t>(b->off - from, max);
+  if (len == 0) {
+    return 0;
+  }
+  size_t pos = (size_t)(from % size);
+  size_t n = std::min(len, size - pos);
+  buf_append(out, &b->ring[pos], n);
+  buf_append(out, &b->ring[0], len - n);
+  return len;
+}
+
+std::string repl_new_id() {
+  std::random_device rd;
+  std::mt19937_64 rng(((uint64_t)rd() << 32) ^ rd());
+  const char* hex = "0123456789abcdef";
+  std::string id;
+  for (int i = 0; i < 40; i++) {
+    id.push_back(hex[rng() % 16]);
+  }
+  return id;
+}
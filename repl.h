@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+// Replication backlog: the latest bytes of the write stream, which is the
+// same framing as the append-only log, in a fixed-size ring. `off` counts
+// every byte ever fed, so a replica that reconnects with its offset can
+// resume as long as the bytes from there on are still in the ring.
+struct ReplBacklog {
+  std::vector<uint8_t> ring;  // empty until the first replica
+  uint64_t off = 0;           // end of the stream
+};
+
+void backlog_init(ReplBacklog* b, size_t size);
+void backlog_feed(ReplBacklog* b, const uint8_t* data, size_t len);
+// the oldest offset still held
+uint64_t backlog_start(const ReplBacklog* b);
+// append up to `max` bytes from offset `from` to `out`; `from` must be in
+// [backlog_start(), off]
+size_t backlog_read(const ReplBacklog* b, uint64_t from, Buffer* out,
+                    size_t max);
+
+// a random id for a write stream, 40 hex digits
+std::string repl_new_id();
@@ -0,0 +1,180 @@
+#include "resp.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <charconv>
+
+constexpr size_t k_resp_max_inline = 64 * 1024;
+
+// A decimal length and crlf at `pos`. Returns the position after it, 0 if
+// it is incomplete, or -1 if it is bad. Lengths are at most `max`.
+static int64_t resp_len(const uint8_t* data, size_t size, size_t pos,
+                        uint64_t max, uint64_t& val) {
+  val = 0;
+  size_t i = pos;
+  for (; i < size && data[i] >= '0' && data[i] <= '9'; i++) {
+    val = val * 10 + (data[i] - '0');
+    if (val > max) {
+      return -1;
+    }
+  }
+  if (i + 2 > size) {
+    return 0;
+  }
+  if (i == pos || data[i] != '\r' || data[i + 1] != '\n') {
+    return -1;
+  }
+  return (int64_t)(i + 2);
+}
+
+// words separated by spaces, up to a newline
+static int64_t resp_inline(const uint8_t* data, size_t size, size_t max_args,
+                           std::vector<std::string>& out) {
+  size_t limit = std::min(size, k_resp_max_inline);
+  const uint8_t* nl = (const uint8_t*)memchr(data, '\n', limit);
+  if (!nl) {
+    return size >= k_resp_max_inline ? -1 : 0;
+  }
+  size_t end = (size_t)(nl - data);
+  size_t len = (end > 0 && data[end - 1] == '\r') ? end - 1 : end;
+  size_t i = 0;
+  while (i < len) {
+    if (data[i] == ' ' || data[i] == '\t') {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    while (i < len && data[i] != ' ' && data[i] != '\t') {
+      i++;
+    }
+    if (out.size() == max_args) {
+      return -1;
+    }
+    out.emplace_back((const char*)data + start, i - start);
+  }
+  return (int64_t)(end + 1);
+}
+
+// The array of bulk strings, into `out` unless it is NULL. Only the headers
+// are read; the values are skipped over until the whole request is here.
+static int64_t resp_array(const uint8_t* data, size_t size, size_t max_args,
+                          size_t max_msg, std::vector<std::string>* out,
+                          size_t& need) {
+  uint64_t n = 0;
+  int64_t pos = resp_len(data, size, 1, max_msg, n);
+  if (pos <= 0) {
+    return pos;
+  }
+  if (n > max_args) {
+    return -1;
+  }
+  if (out) {
+    out->reserve(std::min<uint64_t>(n, 64));
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    if ((size_t)pos >= size) {
+      return 0;
+    }
+    uint64_t len = 0;
+    int64_t body =
+        data[pos] == '$' ? resp_len(data, size, pos + 1, max_msg, len) : -1;
+    if (body <= 0) {
+      return body;
+    }
+    uint64_t end = (uint64_t)body + len + 2;
+    if (end > max_msg) {
+      return -1;  // the same limit as a binary frame
+    }
+    if (end > size) {
+      need = (size_t)end;
+      return 0;
+    }
+    if (data[end - 2] != '\r' || data[end - 1] != '\n') {
+      return -1;
+    }
+    if (out) {
+      out->emplace_back((const char*)data + body, len);
+    }
+    pos = (int64_t)end;
+  }
+  return pos;
+}
+
+int64_t resp_parse(const uint8_t* data, size_t size, size_t max_args,
+                   size_t max_msg, std::vector<std::string>& out,
+                   size_t& need) {
+  need = 0;
+  if (size == 0) {
+    return 0;
+  }
+  if (data[0] != '*') {
+    return resp_inline(data, size, max_args, out);
+  }
+  int64_t rv = resp_array(data, size, max_args, max_msg, NULL, need);
+  if (rv > 0) {
+    resp_array(data, size, max_args, max_msg, &out, need);
+  }
+  return rv;
+}
+
+static void resp_put(Buffer* out, const char* s, size_t len) {
+  buf_append(out, (const uint8_t*)s, len);
+}
+
+// a type byte, a number, crlf
+static void resp_put_num(Buffer* out, char type, int64_t val) {
+  char buf[32];
+  buf[0] = type;
+  char* end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, val).ptr;
+  *end++ = '\r';
+  *end++ = '\n';
+  resp_put(out, buf, (size_t)(end - buf));
+}
+
+void resp_put_nil(Buffer* out, bool resp3) {
+  if (resp3) {
+    resp_put(out, "_\r\n", 3);
+  } else {
+    resp_put(out, "$-1\r\n", 5);
+  }
+}
+
+void resp_put_bulk_header(Buffer* out, size_t len) {
+  resp_put_num(out, '$', (int64_t)len);
+}
+
+void resp_put_crlf(Buffer* out) { resp_put(out, "\r\n", 2); }
+
+void resp_put_int(Buffer* out, int64_t val) { resp_put_num(out, ':', val); }
+
+// the shortest text that reads back as the same double
+void resp_put_dbl(Buffer* out, double val, bool resp3) {
+  char buf[32];
+  char* end = std::to_chars(buf, buf + sizeof(buf), val).ptr;
+  size_t len = (size_t)(end - buf);
+  if (resp3) {
+    resp_put(out, ",", 1);
+  } else {
+    resp_put_bulk_header(out, len);
+  }
+  resp_put(out, buf, len);
+  resp_put_crlf(out);
+}
+
+void resp_put_arr(Buffer* out, uint32_t n) { resp_put_num(out, '*', n); }
+
+void resp_put_err(Buffer* out, const char* prefix, const char* msg,
+                  size_t len) {
+  resp_put(out, "-", 1);
+  resp_put(out, prefix, strlen(prefix));
+  resp_put(out, " ", 1);
+  // a line of its own; messages may hold names that a client sent
+  size_t start = buf_size(out);
+  resp_put(out, msg, len);
+  std::replace(out->data_begin + start, out->data_end, '\r', ' ');
+  std::replace(out->data_begin + start, out->data_end, '\n', ' ');
+  resp_put_crlf(out);
+}
+
+void resp_put_ok(Buffer* out) { resp_put(out, "+OK\r\n", 5); }
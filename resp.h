@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+// RESP, the protocol of Redis clients and tools. A request is an array of
+// bulk strings, "*2\r\n$3\r\nget\r\n$1\r\nk\r\n", or an inline command of
+// words, "get k\r\n". RESP3 differs from RESP2 in the replies only: it has
+// its own types for nil and doubles, which RESP2 sends as a nil bulk string
+// and as a bulk string.
+//
+// Text can not start a binary frame: any 4 bytes of it, read as a length,
+// are above k_max_msg.
+
+// Parse one request at the start of `data` into `out`. Returns the bytes it
+// spans, 0 if it is incomplete, or -1 on a protocol error. An incomplete
+// request sets `need` to a size that must be buffered before trying again.
+// An empty inline command is parsed into an empty `out`. A request is at
+// most `max_msg` bytes, as a binary frame is.
+int64_t resp_parse(const uint8_t* data, size_t size, size_t max_args,
+                   size_t max_msg, std::vector<std::string>& out,
+                   size_t& need);
+
+void resp_put_nil(Buffer* out, bool resp3);
+void resp_put_ok(Buffer* out);
+void resp_put_bulk_header(Buffer* out, size_t len);  // then len bytes, crlf
+void resp_put_crlf(Buffer* out);
+void resp_put_int(Buffer* out, int64_t val);
+void resp_put_dbl(Buffer* out, double val, bool resp3);
+void resp_put_arr(Buffer* out, uint32_t n);
+void resp_put_err(Buffer* out, const char* prefix, const char* msg,
+                  size_t len);
@@ -1,27 +1,58 @@
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <math.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <random>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "aof.h"
+#include "cluster.h"
 #include "common.h"
+#include "config.h"
+#include "dataset.h"
 #include "hashtable.h"
 #include "heap.h"
+#include "hist.h"
 #include "list.h"
+#include "log.h"
+#include "repl.h"
+#include "resp.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "zset.h"
 
 constexpr size_t k_max_args = 200 * 1000;
+constexpr uint64_t k_idle_timeout_ms = 5 * 1000;
+constexpr uint64_t k_io_timeout_ms = 1 * 1000;
+constexpr size_t k_conn_buffer_size = 16 * 1024;  // initial, each way
 
 static uint64_t get_monotonic_msec() {
   struct timespec tv = {0, 0};  // (seconds, nanoseconds)
@@ -29,6 +60,70 @@ static uint64_t get_monotonic_msec() {
   return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+static uint64_t get_realtime_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_REALTIME, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static uint64_t get_monotonic_usec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t get_monotonic_nsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 * 1000 + tv.tv_nsec;
+}
+
+struct Conn;
+
+// connections blocked on a key, woken in FIFO order
+struct WaitList {
+  struct HNode node;  // g_data.waits
+  std::string key;
+  DList conns;  // Waiter::node
+};
+
+struct Waiter {
+  DList node;
+  WaitList* list = NULL;
+  Conn* conn = NULL;
+};
+
+// reply bytes sent from memory that outlives the connection, in front of
+// the byte at `pos` in `outgoing`
+struct OutRef {
+  size_t pos = 0;
+  const char* data = NULL;
+  size_t len = 0;
+};
+
+// replication state of a connection
+enum {
+  REPL_NONE = 0,
+  // a replica, on the primary
+  REPL_WAIT_BGSAVE = 1,  // needs a full sync
+  REPL_BGSAVE = 2,       // the snapshot for it is being written
+  REPL_SEND_SNAPSHOT = 3,
+  REPL_ONLINE = 4,  // sent the write stream from the backlog
+  // the link to the primary, on a replica
+  REPL_CONNECTING = 5,
+  REPL_HANDSHAKE = 6,  // psync sent
+  REPL_TRANSFER = 7,   // receiving the snapshot
+  REPL_CONNECTED = 8,  // applying the write stream
+};
+
+// wire protocol of a connection, from its first bytes
+enum {
+  PROTO_UNKNOWN = 0,
+  PROTO_BIN = 1,  // length-prefixed frames
+  PROTO_RESP2 = 2,
+  PROTO_RESP3 = 3,  // after hello 3
+};
+
 struct Conn {
   int fd = -1;
   // application's intention used by the event loop
@@ -38,48 +133,221 @@ struct Conn {
   // buffered input and output
   struct Buffer incoming;
   struct Buffer outgoing;
+  std::deque<OutRef> out_refs;  // zero-copy values, in order
+  size_t out_ref_bytes = 0;
   // timer
   uint64_t last_active_ms = 0;
   DList timer_node;
+  // blocking pop; no requests are processed while blocked
+  bool blocked = false;
+  bool block_max = false;        // bzpopmax instead of bzpopmin
+  std::vector<Waiter*> waiters;  // one per key
+  size_t block_heap_idx = -1;    // timeout in g_data.block_heap
+  // replies wait for the append-only log to be written
+  bool write_deferred = false;
+  // replication, no timeouts apply
+  uint32_t repl = REPL_NONE;
+  std::string repl_addr;      // of the replica
+  uint64_t repl_off = 0;      // next stream byte to send
+  uint64_t repl_left = 0;     // snapshot bytes still to send or receive
+  std::string repl_pending;   // the stream while the snapshot is sent
+  int repl_fd = -1;           // the snapshot file
+  uint64_t repl_ack = 0;      // stream offset the replica has applied
+  uint64_t repl_io_ms = 0;    // monotonic, last heard from the other side
+  // cluster: the next command may use a slot that is being imported
+  bool asking = false;
+  uint32_t proto = PROTO_UNKNOWN;
+  size_t resp_need = 0;  // input to wait for before parsing again
+  // the client: ip:port, or "unix" with the process from SO_PEERCRED
+  std::string peer_addr;
+  struct ucred peer_cred = {-1, (uid_t)-1, (gid_t)-1};
+};
+
+// a forked child writing a snapshot
+struct SnapChild {
+  pid_t pid = -1;
+  int stats_fd = -1;  // SnapStats from the child
+};
+
+// a checkpoint delta on disk
+struct DeltaFile {
+  uint64_t created_ms = 0;
+  std::string path;
 };
 
+struct DeltaMerge;
+
 static struct {
   DList idle_list;
   DList io_list;
   std::vector<HeapItem> heap;
   HMap db;
   std::vector<Conn*> fd2conn;
+  // blocking pops
+  HMap waits;                        // key -> WaitList
+  std::vector<HeapItem> block_heap;  // timeouts of blocked connections
+  std::vector<Conn*> unblocked;      // woken, with requests left to process
+  std::vector<std::string> ready_keys;  // zsets that blocked pops wait on
+  // tunables, config set; the message and argument limits can only be
+  // lowered, and the log and the replication stream keep the compiled-in
+  // ones
+  struct {
+    uint64_t max_msg = k_max_msg;
+    uint64_t max_args = k_max_args;
+    uint64_t idle_timeout_ms = k_idle_timeout_ms;
+    uint64_t io_timeout_ms = k_io_timeout_ms;
+    uint64_t conn_buffer_size = k_conn_buffer_size;  // new connections
+    uint64_t latency_sample = 16;  // time 1 in n calls of a command, 0 none
+  } conf;
+  // TTL expiry
+  struct {
+    uint64_t budget_us = 1000;  // per cycle, --expire-budget-us
+    double expired_frac = 0;    // sampled when a cycle runs out of budget
+    uint64_t backlog = 0;       // estimated expired keys not yet reclaimed
+    uint64_t expired = 0;       // total, active and lazy
+    uint64_t expired_lazy = 0;  // found expired on access
+    uint64_t cycles = 0;
+    uint64_t cycles_over_budget = 0;
+    uint64_t rate = 0;  // keys/sec over the last second
+    uint64_t rate_start_ms = 0;
+    uint64_t rate_start_count = 0;
+  } expiry;
+  // snapshots
+  struct {
+    std::string path = "dump.kvs";  // --dbfile
+    SnapChild child;                // bgsave in progress
+    uint64_t last_save_ms = 0;      // wall clock
+    bool last_ok = true;
+    uint64_t stamp_ms = 0;  // created_ms of the latest, see snapshot_stamp()
+  } snapshot;
+  // incremental checkpoints: deltas of the changed keys on top of the
+  // snapshot, merged into it in the background
+  struct {
+    uint64_t secs = 0;        // --checkpoint-secs, 0 is off
+    uint64_t max_deltas = 8;  // --checkpoint-max-deltas, then merged
+    std::unordered_set<std::string> dirty;    // since the last delta
+    std::unordered_set<std::string> writing;  // by the child
+    SnapChild child;
+    uint64_t child_ms = 0;          // created_ms of its delta
+    uint64_t last_ms = 0;           // monotonic, the last delta
+    std::vector<DeltaFile> deltas;  // oldest first
+    DeltaMerge* merge = NULL;       // in progress
+    uint64_t merges = 0;
+  } checkpoint;
+  // append-only log
+  struct {
+    bool enabled = false;                // --appendonly
+    std::string path = "appendonly.aof";  // --appendfile
+    int fsync = AOF_FSYNC_EVERYSEC;       // --appendfsync
+    // --auto-aof-rewrite-percentage, 0 is off
+    uint64_t auto_pct = 100;
+    // --auto-aof-rewrite-min-size
+    uint64_t auto_min_size = 64 << 20;
+    SnapChild child;  // rewrite in progress
+    uint64_t rewrites = 0;
+  } aof;
+  // replication
+  struct {
+    std::string id;                 // of the write stream this server makes
+    ReplBacklog backlog;            // starts with the first replica
+    size_t backlog_size = 1 << 20;  // --repl-backlog-size
+    std::vector<Conn*> replicas;
+    SnapChild child;         // snapshot for full syncs
+    uint64_t child_off = 0;  // the stream offset it was forked at
+    uint64_t ping_ms = 0;    // monotonic, the last ping into the stream
+    // as a replica of `host`:`port`, --replicaof
+    std::string host;  // empty for a primary
+    uint16_t port = 0;
+    Conn* link = NULL;        // to the primary
+    std::string master_id;    // the stream it follows
+    uint64_t master_off = 0;  // applied up to here
+    uint64_t retry_ms = 0;    // monotonic, reconnect
+    uint64_t ack_ms = 0;      // monotonic, the last ack sent
+  } repl;
+  // counters for info
+  struct {
+    uint64_t start_ms = 0;     // monotonic, for the uptime
+    uint16_t port = 0;         // --port
+    uint64_t connections = 0;  // accepted
+    uint64_t commands = 0;
+    uint64_t hits = 0;  // lookups that found the key
+    uint64_t misses = 0;
+    uint64_t net_in = 0;  // bytes
+    uint64_t net_out = 0;
+    uint64_t rate = 0;  // commands/sec over the last second
+    uint64_t rate_start_ms = 0;
+    uint64_t rate_start_count = 0;
+    HMap cmds;  // CmdStat by name
+  } stats;
+  ClusterMap cluster;            // --cluster
+  std::vector<DList> slot_keys;  // Entry::slot_node by slot, cluster mode
+  bool loading = false;          // replaying a snapshot or the log
+  // options
+  bool zset_arena = false;  // --zset-arena
+  Dataset dataset;          // --static, served read-only from the mapping
 } g_data;
 
 static Conn* handle_accept(int fd) {
   // accept
-  struct sockaddr_in client_addr = {};
+  struct sockaddr_storage client_addr = {};
   socklen_t addrlen = sizeof(client_addr);
   int connfd = accept(fd, (struct sockaddr*)&client_addr, &addrlen);
   if (connfd < 0) {
     return NULL;
   }
-  char ip_str[INET_ADDRSTRLEN];  // Buffer to hold the string
-                                 // (usually 16 bytes)
-  inet_ntop(AF_INET, &client_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
-  fprintf(stderr, "new client from %s:%u\n", ip_str,
-          ntohs(client_addr.sin_port));
-  // set the new connection fd to nonblocking mode
-  fd_set_nonblock(connfd);
+  g_data.stats.connections++;
   // create Conn struct to track state
   Conn* conn = new Conn();
   conn->fd = connfd;
+  if (client_addr.ss_family == AF_UNIX) {
+    socklen_t len = sizeof(conn->peer_cred);
+    (void)getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &conn->peer_cred, &len);
+    conn->peer_addr = "unix";
+    log_msg(LOG_INFO, "new client on the unix socket, pid %d uid %u gid %u",
+            (int)conn->peer_cred.pid, (unsigned)conn->peer_cred.uid,
+            (unsigned)conn->peer_cred.gid);
+  } else {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&client_addr;
+    char ip_str[INET_ADDRSTRLEN];  // Buffer to hold the string
+                                   // (usually 16 bytes)
+    inet_ntop(AF_INET, &sin->sin_addr, ip_str, INET_ADDRSTRLEN);
+    conn->peer_addr =
+        std::string(ip_str) + ":" + std::to_string(ntohs(sin->sin_port));
+    log_msg(LOG_INFO, "new client from %s", conn->peer_addr.c_str());
+  }
+  // set the new connection fd to nonblocking mode
+  fd_set_nonblock(connfd);
   conn->want_read = true;  // read the first request
   conn->last_active_ms = get_monotonic_msec();
   dlist_insert_before(&g_data.idle_list, &conn->timer_node);
 
-  buf_init(&conn->incoming, 16 * 1024);
-  buf_init(&conn->outgoing, 16 * 1024);
+  buf_init(&conn->incoming, g_data.conf.conn_buffer_size);
+  buf_init(&conn->outgoing, g_data.conf.conn_buffer_size);
 
   return conn;
 }
 
+// add into mapping of fd to Conn
+static void conn_register(Conn* conn) {
+  if (g_data.fd2conn.size() <= (size_t)conn->fd) {
+    g_data.fd2conn.resize(2 * conn->fd);
+  }
+  g_data.fd2conn[conn->fd] = conn;
+}
+
+static void conn_unblock(Conn* conn);
+static void repl_conn_closed(Conn* conn);
+
 static void conn_destroy(Conn* conn) {
+  if (conn->blocked) {
+    conn_unblock(conn);
+  }
+  if (conn->repl != REPL_NONE) {
+    repl_conn_closed(conn);
+  }
+  std::vector<Conn*>& unblocked = g_data.unblocked;
+  unblocked.erase(std::remove(unblocked.begin(), unblocked.end(), conn),
+                  unblocked.end());
   (void)close(conn->fd);
   buf_destroy(&conn->incoming);
   buf_destroy(&conn->outgoing);
@@ -112,14 +380,14 @@ static bool read_str(const uint8_t*& cur, const uint8_t* end, size_t len,
 // | nstr | len | str1 | len | str2 | ... | len | strn |
 // +------+-----+------+-----+------+-----+-----+------+
 
-static int32_t parse_req(const uint8_t* data, size_t size,
-                         std::vector<std::string>& out) {
-  const uint8_t* end = data + size;
+// one command, advancing `data` past it
+static int32_t parse_cmd(const uint8_t*& data, const uint8_t* end,
+                         size_t max_args, std::vector<std::string>& out) {
   uint32_t nstr = 0;
   if (!read_u32(data, end, nstr)) {
     return -1;
   }
-  if (nstr > k_max_args) {
+  if (nstr > max_args) {
     return -1;
   }
 
@@ -133,6 +401,15 @@ static int32_t parse_req(const uint8_t* data, size_t size,
       return -1;
     }
   }
+  return 0;
+}
+
+static int32_t parse_req(const uint8_t* data, size_t size, size_t max_args,
+                         std::vector<std::string>& out) {
+  const uint8_t* end = data + size;
+  if (parse_cmd(data, end, max_args, out) < 0) {
+    return -1;
+  }
 
   if (data != end) {
     return -1;  // trailing garbage
@@ -141,12 +418,75 @@ static int32_t parse_req(const uint8_t* data, size_t size,
   return 0;
 }
 
+// A batch frame carries n commands, each encoded like a request:
+// +------------------+------+-----+------+-----+------+-----+-----+
+// | n | k_batch_flag | nstr | len | str1 | ... | nstr | len | ... |
+// +------------------+------+-----+------+-----+------+-----+-----+
+constexpr uint32_t k_batch_flag = 1u << 31;
+
+// a command framed like a request
+static std::string req_frame(const std::vector<std::string>& args) {
+  uint32_t len = 4;
+  for (const std::string& s : args) {
+    len += 4 + (uint32_t)s.size();
+  }
+  std::string frame;
+  frame.reserve(k_header_size + len);
+  frame.append((const char*)&len, 4);
+  uint32_t nstr = (uint32_t)args.size();
+  frame.append((const char*)&nstr, 4);
+  for (const std::string& s : args) {
+    uint32_t slen = (uint32_t)s.size();
+    frame.append((const char*)&slen, 4);
+    frame.append(s);
+  }
+  return frame;
+}
+
+// Into the backlog, and to the replicas in a full sync, which need the
+// stream from the offset of their snapshot however long it takes to send.
+static void repl_feed(const uint8_t* data, size_t len) {
+  auto& repl = g_data.repl;
+  backlog_feed(&repl.backlog, data, len);
+  for (Conn* conn : repl.replicas) {
+    if (conn->repl == REPL_BGSAVE || conn->repl == REPL_SEND_SNAPSHOT) {
+      conn->repl_pending.append((const char*)data, len);
+    }
+  }
+}
+
+// Writes go to the append-only log and to the replicas, which both get the
+// same stream of request frames.
+static void propagate(const uint8_t* data, size_t len) {
+  aof_append(data, len);
+  repl_feed(data, len);
+}
+
+// log a command the server generated itself
+static void aof_feed(const std::vector<std::string>& args) {
+  if (!aof_enabled() && g_data.repl.backlog.ring.empty()) {
+    return;
+  }
+  std::string frame = req_frame(args);
+  propagate((const uint8_t*)frame.data(), frame.size());
+}
+
+// the key goes into the next checkpoint delta, deleted or not
+static void key_dirty(const std::string& key) {
+  if (g_data.checkpoint.secs > 0) {
+    g_data.checkpoint.dirty.insert(key);
+  }
+}
+
 // error code for TAG_ERR
 enum {
-  ERR_UNKNOWN = 1,  // unknown command
-  ERR_TOO_BIG = 2,  // response too big
-  ERR_BAD_TYP = 3,  // unexpected value type
-  ERR_BAD_ARG = 4,  // bad arguments
+  ERR_UNKNOWN = 1,    // unknown command
+  ERR_TOO_BIG = 2,    // response too big
+  ERR_BAD_TYP = 3,    // unexpected value type
+  ERR_BAD_ARG = 4,    // bad arguments
+  ERR_READ_ONLY = 5,  // not available on a static dataset or a replica
+  ERR_MOVED = 6,      // the key is on another node: "slot host:port"
+  ERR_ASK = 7,        // the slot is migrating, ask there once: "slot host:port"
 };
 
 // data types of serialized data
@@ -157,6 +497,7 @@ enum {
   TAG_INT = 3,  // int64
   TAG_DBL = 4,  // double
   TAG_ARR = 5,  // array
+  TAG_OK = 6,   // not on the wire: a nil that means success, see out_ok()
 };
 
 // serialization helper functions
@@ -175,11 +516,29 @@ static void buf_append_dbl(Buffer* buf, double data) {
 
 // append serialized data types to the back
 static void out_nil(Buffer* out) { buf_append_u8(out, TAG_NIL); }
+// Nil that means success, set, config set, save and the like. RESP
+// clients read a nil reply as "not done" and expect +OK, which
+// reply_encode() writes; run_cmd() turns it into a nil for the binary
+// protocol. A whole reply only.
+static void out_ok(Buffer* out) { buf_append_u8(out, TAG_OK); }
 static void out_str(Buffer* out, const char* s, size_t size) {
   buf_append_u8(out, TAG_STR);
   buf_append_u32(out, (uint32_t)size);
   buf_append(out, (const uint8_t*)s, size);
 }
+// Values at least this large are not copied into `outgoing`.
+constexpr size_t k_out_ref_min = 4 * 1024;
+
+// out_str() for a value that stays valid until it is sent
+static void out_str_ref(Conn* conn, Buffer* out, const char* s, size_t size) {
+  if (!conn || size < k_out_ref_min) {
+    return out_str(out, s, size);
+  }
+  buf_append_u8(out, TAG_STR);
+  buf_append_u32(out, (uint32_t)size);
+  conn->out_refs.push_back(OutRef{buf_size(out), s, size});
+  conn->out_ref_bytes += size;
+}
 static void out_int(Buffer* out, int64_t val) {
   buf_append_u8(out, TAG_INT);
   buf_append_i64(out, val);
@@ -207,6 +566,120 @@ static void out_end_arr(Buffer* out, size_t ctx, uint32_t n) {
   memcpy(out->data_begin + ctx, &n, 4);
 }
 
+// frame a response with a length header that is patched at the end
+static size_t response_begin(Buffer* out) {
+  size_t header_idx = buf_size(out);
+  uint32_t placeholder = 0;
+  buf_append(out, (const uint8_t*)&placeholder, k_header_size);
+  return header_idx;
+}
+// `ref_bytes` were added by out_str_ref() since response_begin()
+static void response_end(Buffer* out, size_t header_idx,
+                         size_t ref_bytes = 0) {
+  uint32_t payload_size =
+      (uint32_t)(buf_size(out) - header_idx - k_header_size + ref_bytes);
+  memcpy(out->data_begin + header_idx, &payload_size, k_header_size);
+}
+
+static const char* resp_err_prefix(uint32_t code) {
+  switch (code) {
+    case ERR_BAD_TYP:
+      return "WRONGTYPE";
+    case ERR_READ_ONLY:
+      return "READONLY";
+    case ERR_MOVED:
+      return "MOVED";
+    case ERR_ASK:
+      return "ASK";
+    default:
+      return "ERR";
+  }
+}
+
+// Handlers write the binary encoding. For a RESP connection, the responses
+// from `reply_idx` to the end of `outgoing` are rewritten as RESP, with the
+// values of out_str_ref() still sent from where they are.
+static void reply_encode(Conn* conn, size_t reply_idx) {
+  Buffer& out = conn->outgoing;
+  if (conn->proto < PROTO_RESP2 || buf_size(&out) == reply_idx) {
+    return;
+  }
+  bool resp3 = conn->proto == PROTO_RESP3;
+  static std::string bin;
+  bin.assign(out.data_begin + reply_idx, out.data_end);
+  out.data_end = out.data_begin + reply_idx;
+  std::deque<OutRef> refs;
+  while (!conn->out_refs.empty() && conn->out_refs.back().pos > reply_idx) {
+    refs.push_front(conn->out_refs.back());
+    conn->out_refs.pop_back();
+  }
+  const uint8_t* data = (const uint8_t*)bin.data();
+  size_t pos = 0;
+  uint64_t values = 0;  // left in the current response
+  while (pos < bin.size()) {
+    if (values == 0) {
+      pos += k_header_size;  // the next response
+      values = 1;
+    }
+    uint8_t tag = data[pos++];
+    values--;
+    uint32_t len = 0;
+    switch (tag) {
+      case TAG_NIL:
+        resp_put_nil(&out, resp3);
+        break;
+      case TAG_OK:
+        resp_put_ok(&out);
+        break;
+      case TAG_ERR: {
+        uint32_t code = 0;
+        memcpy(&code, data + pos, 4);
+        memcpy(&len, data + pos + 4, 4);
+        pos += 8;
+        resp_put_err(&out, resp_err_prefix(code), (const char*)data + pos,
+                     len);
+        pos += len;
+        break;
+      }
+      case TAG_STR:
+        memcpy(&len, data + pos, 4);
+        pos += 4;
+        resp_put_bulk_header(&out, len);
+        if (!refs.empty() && refs.front().pos == reply_idx + pos) {
+          OutRef ref = refs.front();
+          refs.pop_front();
+          ref.pos = buf_size(&out);
+          conn->out_refs.push_back(ref);
+        } else {
+          buf_append(&out, data + pos, len);
+          pos += len;
+        }
+        resp_put_crlf(&out);
+        break;
+      case TAG_INT: {
+        int64_t val = 0;
+        memcpy(&val, data + pos, 8);
+        pos += 8;
+        resp_put_int(&out, val);
+        break;
+      }
+      case TAG_DBL: {
+        double val = 0;
+        memcpy(&val, data + pos, 8);
+        pos += 8;
+        resp_put_dbl(&out, val, resp3);
+        break;
+      }
+      case TAG_ARR:
+        memcpy(&len, data + pos, 4);
+        pos += 4;
+        resp_put_arr(&out, len);
+        values += len;
+        break;
+    }
+  }
+}
+
 enum {
   T_INIT = 0,
   T_STR = 1,   // string
@@ -215,6 +688,7 @@ enum {
 
 struct Entry {
   struct HNode node;  // hashtable node
+  DList slot_node;    // g_data.slot_keys, in cluster mode
   std::string key;
   // for TTL
   size_t heap_idx = -1;
@@ -228,6 +702,7 @@ struct Entry {
 static Entry* entry_new(uint32_t type) {
   Entry* ent = new Entry();
   ent->type = type;
+  dlist_init(&ent->slot_node);
   return ent;
 }
 
@@ -238,9 +713,18 @@ static void entry_del(Entry* ent) {
     zset_clear(&ent->zset);
   }
   entry_set_ttl(ent, -1);
+  dlist_detach(&ent->slot_node);
   delete ent;
 }
 
+static void db_insert(Entry* ent) {
+  hm_insert(&g_data.db, &ent->node);
+  if (!g_data.slot_keys.empty()) {
+    uint32_t slot = key_slot(ent->key.data(), ent->key.size());
+    dlist_insert_before(&g_data.slot_keys[slot], &ent->slot_node);
+  }
+}
+
 struct LookupKey {
   struct HNode node;
   std::string key;
@@ -252,15 +736,47 @@ static bool entry_eq(HNode* node, HNode* key) {
   return ent->key == keydata->key;
 }
 
+static bool hnode_same(HNode* node, HNode* key) { return node == key; }
+
+static bool entry_expired(Entry* ent, uint64_t now_ms) {
+  return ent->heap_idx != (size_t)-1 &&
+         g_data.heap[ent->heap_idx].val <= now_ms;
+}
+
+static void entry_expire(Entry* ent) {
+  // the log replays without expiring anything, so it needs the deletion
+  aof_feed({"del", ent->key});
+  hm_delete(&g_data.db, &ent->node, &hnode_same);
+  log_msg(LOG_DEBUG, "key expired: %s", ent->key.c_str());
+  entry_del(ent);
+  g_data.expiry.expired++;
+}
+
+// hm_lookup() that treats a key past its TTL as missing and reclaims it
+static HNode* db_lookup(LookupKey* key) {
+  HNode* node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+  if (node && !g_data.loading) {
+    Entry* ent = container_of(node, Entry, node);
+    if (entry_expired(ent, get_monotonic_msec())) {
+      entry_expire(ent);
+      g_data.expiry.expired_lazy++;
+      return NULL;
+    }
+  }
+  return node;
+}
+
 static void do_get(std::vector<std::string>& cmd, struct Buffer& out) {
   LookupKey key;
   key.key.swap(cmd[1]);
   key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
 
-  HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  HNode* node = db_lookup(&key);
   if (!node) {
+    g_data.stats.misses++;
     return out_nil(&out);
   }
+  g_data.stats.hits++;
 
   Entry* ent = container_of(node, Entry, node);
   if (ent->type != T_STR) {
@@ -269,26 +785,156 @@ static void do_get(std::vector<std::string>& cmd, struct Buffer& out) {
   return out_str(&out, ent->str.data(), ent->str.size());
 }
 
+static bool str2dbl(const std::string& s, double& out) {
+  char* endp = NULL;
+  out = strtod(s.c_str(), &endp);
+  return endp == s.c_str() + s.size() && !isnan(out);
+}
+
+static bool str2int(const std::string& s, int64_t& out) {
+  char* endp = NULL;
+  out = strtoll(s.c_str(), &endp, 10);
+  return endp == s.c_str() + s.size();
+}
+
+// ex s | px ms | exat unix_s | pxat unix_ms, converted to a relative TTL.
+// Returns 0 if cmd[i] is not one of them, -1 if its argument is bad.
+static int parse_ttl_opt(std::vector<std::string>& cmd, size_t i,
+                         int64_t& ttl_ms) {
+  const char* opt = cmd[i].c_str();
+  int64_t scale = 0;
+  bool absolute = false;
+  if (0 == strcasecmp(opt, "ex")) {
+    scale = 1000;
+  } else if (0 == strcasecmp(opt, "px")) {
+    scale = 1;
+  } else if (0 == strcasecmp(opt, "exat")) {
+    scale = 1000;
+    absolute = true;
+  } else if (0 == strcasecmp(opt, "pxat")) {
+    scale = 1;
+    absolute = true;
+  } else {
+    return 0;
+  }
+  int64_t val = 0;
+  if (i + 1 >= cmd.size() || !str2int(cmd[i + 1], val) || val <= 0 ||
+      val > INT64_MAX / 1000) {
+    return -1;
+  }
+  ttl_ms = val * scale;
+  if (absolute) {
+    int64_t now_ms = (int64_t)get_realtime_msec();
+    ttl_ms = ttl_ms > now_ms ? ttl_ms - now_ms : 0;
+  }
+  return 1;
+}
+
+// set key value [ex s|px ms|exat s|pxat ms] [nx|xx] [get] [keepttl]
 static void do_set(std::vector<std::string>& cmd, struct Buffer& out) {
+  bool nx = false, xx = false, get = false, keepttl = false;
+  int64_t ttl_ms = -1;
+  for (size_t i = 3; i < cmd.size(); i++) {
+    const char* opt = cmd[i].c_str();
+    int rv = ttl_ms < 0 ? parse_ttl_opt(cmd, i, ttl_ms) : 0;
+    if (rv < 0) {
+      return out_err(&out, ERR_BAD_ARG, "invalid expire time");
+    } else if (rv > 0) {
+      i++;
+    } else if (0 == strcasecmp(opt, "nx")) {
+      nx = true;
+    } else if (0 == strcasecmp(opt, "xx")) {
+      xx = true;
+    } else if (0 == strcasecmp(opt, "get")) {
+      get = true;
+    } else if (0 == strcasecmp(opt, "keepttl")) {
+      keepttl = true;
+    } else {
+      return out_err(&out, ERR_BAD_ARG, "syntax error");
+    }
+  }
+  if ((nx && xx) || (keepttl && ttl_ms >= 0)) {
+    return out_err(&out, ERR_BAD_ARG, "syntax error");
+  }
+
+  // one lookup; a new key is inserted without probing again
   LookupKey key;
   key.key.swap(cmd[1]);
   key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  HNode* node = db_lookup(&key);
+  Entry* ent = node ? container_of(node, Entry, node) : NULL;
+  if (ent && ent->type != T_STR) {
+    return out_err(&out, ERR_BAD_TYP, "a non-string value exists");
+  }
 
-  HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (node) {
-    Entry* ent = container_of(node, Entry, node);
-    if (ent->type != T_STR) {
-      return out_err(&out, ERR_BAD_TYP, "a non-string value exists");
+  if (get) {  // reply with the old value
+    ent ? out_str(&out, ent->str.data(), ent->str.size()) : out_nil(&out);
+  }
+  bool apply = !(nx && ent) && !(xx && !ent);
+  if (apply) {
+    if (!ent) {
+      ent = entry_new(T_STR);
+      ent->key.swap(key.key);
+      ent->node.hcode = key.node.hcode;
+      db_insert(ent);
     }
     ent->str.swap(cmd[2]);
-  } else {
-    Entry* ent = entry_new(T_STR);
-    ent->key.swap(key.key);
-    ent->node.hcode = key.node.hcode;
-    ent->str.swap(cmd[2]);
-    hm_insert(&g_data.db, &ent->node);
+    if (ttl_ms >= 0 || !keepttl) {
+      entry_set_ttl(ent, ttl_ms);
+    }
   }
-  return out_nil(&out);
+  if (!get) {
+    // nx/xx report whether the value was set
+    (nx || xx) ? out_int(&out, apply ? 1 : 0) : out_ok(&out);
+  }
+}
+
+// getex key [ex s|px ms|exat s|pxat ms|persist]
+static void do_getex(std::vector<std::string>& cmd, struct Buffer& out) {
+  int64_t ttl_ms = -2;  // -2 keeps the TTL, -1 removes it
+  if (cmd.size() == 3 && 0 == strcasecmp(cmd[2].c_str(), "persist")) {
+    ttl_ms = -1;
+  } else if (cmd.size() == 4) {
+    if (parse_ttl_opt(cmd, 2, ttl_ms) <= 0) {
+      return out_err(&out, ERR_BAD_ARG, "invalid expire time");
+    }
+  } else if (cmd.size() != 2) {
+    return out_err(&out, ERR_BAD_ARG, "syntax error");
+  }
+
+  LookupKey key;
+  key.key.swap(cmd[1]);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  HNode* node = db_lookup(&key);
+  if (!node) {
+    return out_nil(&out);
+  }
+  Entry* ent = container_of(node, Entry, node);
+  if (ent->type != T_STR) {
+    return out_err(&out, ERR_BAD_TYP, "not a string value");
+  }
+  out_str(&out, ent->str.data(), ent->str.size());
+  if (ttl_ms != -2) {
+    entry_set_ttl(ent, ttl_ms);
+  }
+}
+
+// getdel key
+static void do_getdel(std::vector<std::string>& cmd, struct Buffer& out) {
+  LookupKey key;
+  key.key.swap(cmd[1]);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  HNode* node = db_lookup(&key);
+  if (!node) {
+    return out_nil(&out);
+  }
+  Entry* ent = container_of(node, Entry, node);
+  if (ent->type != T_STR) {
+    return out_err(&out, ERR_BAD_TYP, "not a string value");
+  }
+  out_str(&out, ent->str.data(), ent->str.size());
+  hm_delete(&g_data.db, &ent->node, &hnode_same);
+  entry_del(ent);
 }
 
 static void do_del(std::vector<std::string>& cmd, struct Buffer& out) {
@@ -297,11 +943,13 @@ static void do_del(std::vector<std::string>& cmd, struct Buffer& out) {
   key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
 
   HNode* node = hm_delete(&g_data.db, &key.node, &entry_eq);
+  bool deleted = false;
   if (node) {
-    entry_del(container_of(node, Entry, node));
+    Entry* ent = container_of(node, Entry, node);
+    deleted = !entry_expired(ent, get_monotonic_msec());
+    entry_del(ent);
   }
-
-  return out_int(&out, node ? 1 : 0);
+  return out_int(&out, deleted ? 1 : 0);
 }
 
 static void heap_upsert(std::vector<HeapItem>& a, size_t pos, HeapItem t) {
@@ -333,29 +981,32 @@ static void entry_set_ttl(Entry* ent, int64_t ttl_ms) {
   }
 }
 
+struct KeysArg {
+  Buffer* out = NULL;
+  uint64_t now_ms = 0;
+  uint32_t n = 0;
+};
+
 static bool cb_keys(HNode* node, void* arg) {
-  Buffer* out = (Buffer*)arg;
-  const std::string& key = container_of(node, Entry, node)->key;
-  out_str(out, key.data(), key.size());
+  KeysArg* keys = (KeysArg*)arg;
+  Entry* ent = container_of(node, Entry, node);
+  if (!entry_expired(ent, keys->now_ms)) {  // not reclaimed yet
+    out_str(keys->out, ent->key.data(), ent->key.size());
+    keys->n++;
+  }
   return true;
 }
 
 static void do_keys(std::vector<std::string>& cmd, Buffer& out) {
-  out_arr(&out, (uint32_t)hm_size(&g_data.db));
-  hm_foreach(&g_data.db, &cb_keys, (void*)&out);
-}
-
-static bool str2dbl(const std::string& s, double& out) {
-  char* endp = NULL;
-  out = strtod(s.c_str(), &endp);
-  return endp == s.c_str() + s.size() && !isnan(out);
+  KeysArg keys;
+  keys.out = &out;
+  keys.now_ms = get_monotonic_msec();
+  size_t ctx = out_begin_arr(&out);
+  hm_foreach(&g_data.db, &cb_keys, (void*)&keys);
+  out_end_arr(&out, ctx, keys.n);
 }
 
-static bool str2int(const std::string& s, int64_t& out) {
-  char* endp = NULL;
-  out = strtoll(s.c_str(), &endp, 10);
-  return endp == s.c_str() + s.size();
-}
+static void zset_wake(Entry* ent);
 
 // zadd zset score name
 static void do_zadd(std::vector<std::string>& cmd, Buffer& out) {
@@ -368,14 +1019,17 @@ static void do_zadd(std::vector<std::string>& cmd, Buffer& out) {
   LookupKey key;
   key.key.swap(cmd[1]);
   key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-  HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  HNode* hnode = db_lookup(&key);
 
   Entry* ent = NULL;
   if (!hnode) {  // insert a new key
     ent = entry_new(T_ZSET);
+    if (g_data.zset_arena) {
+      zset_use_arena(&ent->zset);
+    }
     ent->key.swap(key.key);
     ent->node.hcode = key.node.hcode;
-    hm_insert(&g_data.db, &ent->node);
+    db_insert(ent);
   } else {  // check the existing key
     ent = container_of(hnode, Entry, node);
     if (ent->type != T_ZSET) {
@@ -386,6 +1040,7 @@ static void do_zadd(std::vector<std::string>& cmd, Buffer& out) {
   // add or update the tuple
   const std::string& name = cmd[3];
   bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
+  zset_wake(ent);
   return out_int(&out, (int64_t)added);
 }
 
@@ -395,10 +1050,12 @@ static ZSet* expect_zset(std::string& s) {
   LookupKey key;
   key.key.swap(s);
   key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-  HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  HNode* hnode = db_lookup(&key);
   if (!hnode) {  // a non-existent key is treated as an empty zset
+    g_data.stats.misses++;
     return (ZSet*)&k_empty_zset;
   }
+  g_data.stats.hits++;
   Entry* ent = container_of(hnode, Entry, node);
   return ent->type == T_ZSET ? &ent->zset : NULL;
 }
@@ -462,7 +1119,7 @@ static void do_zquery(std::vector<std::string>& cmd, Buffer& out) {
   while (znode && n < limit) {
     out_str(&out, znode->name, znode->len);
     out_dbl(&out, znode->score);
-    znode = znode_offset(znode, +1);
+    znode = znode_next(znode);
     n += 2;
   }
   out_end_arr(&out, ctx, (uint32_t)n);
@@ -500,7 +1157,7 @@ static void do_zqueryr(std::vector<std::string>& cmd, Buffer& out) {
   while (znode && n < limit) {
     out_str(&out, znode->name, znode->len);
     out_dbl(&out, znode->score);
-    znode = znode_offset(znode, -1);
+    znode = znode_prev(znode);
     n += 2;
   }
   out_end_arr(&out, ctx, (uint32_t)n);
@@ -545,58 +1202,2482 @@ static void do_zrank(std::vector<std::string>& cmd, Buffer& out) {
   return out_int(&out, avl_rank(&znode->tree));
 }
 
-// PEXPIRE key ttl_ms
-static void do_expire(std::vector<std::string>& cmd, Buffer& out) {
-  int64_t ttl_ms = 0;
-  if (!str2int(cmd[2], ttl_ms)) {
-    return out_err(&out, ERR_BAD_ARG, "expect int64");
-  }
+enum {
+  AGG_SUM = 0,
+  AGG_MIN = 1,
+  AGG_MAX = 2,
+};
 
-  LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-  HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (node) {
-    Entry* ent = container_of(node, Entry, node);
-    entry_set_ttl(ent, ttl_ms);
+struct ZSetOp {
+  std::vector<ZSet*> zsets;
+  std::vector<double> weights;
+  uint32_t agg = AGG_SUM;
+};
+
+// numkeys key [key ...] [weights w [w ...]] [aggregate sum|min|max]
+static bool parse_zsetop(std::vector<std::string>& cmd, size_t pos, ZSetOp& op,
+                         Buffer& out) {
+  int64_t numkeys = 0;
+  if (!str2int(cmd[pos], numkeys) || numkeys <= 0 ||
+      (size_t)numkeys > cmd.size() - pos - 1) {
+    out_err(&out, ERR_BAD_ARG, "bad numkeys");
+    return false;
   }
-  return out_int(&out, node ? 1 : 0);
+  size_t keys = pos + 1;
+  pos = keys + (size_t)numkeys;
+  op.weights.assign((size_t)numkeys, 1.0);
+  while (pos < cmd.size()) {
+    if (0 == strcasecmp(cmd[pos].c_str(), "weights") &&
+        cmd.size() - pos - 1 >= (size_t)numkeys) {
+      for (size_t i = 0; i < (size_t)numkeys; i++) {
+        if (!str2dbl(cmd[pos + 1 + i], op.weights[i])) {
+          out_err(&out, ERR_BAD_ARG, "expect float");
+          return false;
+        }
+      }
+      pos += 1 + (size_t)numkeys;
+    } else if (0 == strcasecmp(cmd[pos].c_str(), "aggregate") &&
+               pos + 1 < cmd.size()) {
+      const char* agg = cmd[pos + 1].c_str();
+      if (0 == strcasecmp(agg, "sum")) {
+        op.agg = AGG_SUM;
+      } else if (0 == strcasecmp(agg, "min")) {
+        op.agg = AGG_MIN;
+      } else if (0 == strcasecmp(agg, "max")) {
+        op.agg = AGG_MAX;
+      } else {
+        out_err(&out, ERR_BAD_ARG, "expect sum|min|max");
+        return false;
+      }
+      pos += 2;
+    } else {
+      out_err(&out, ERR_BAD_ARG, "syntax error");
+      return false;
+    }
+  }
+  // resolve the keys last since expect_zset() consumes the strings
+  for (size_t i = 0; i < (size_t)numkeys; i++) {
+    ZSet* zset = expect_zset(cmd[keys + i]);
+    if (!zset) {
+      out_err(&out, ERR_BAD_TYP, "expect zset");
+      return false;
+    }
+    op.zsets.push_back(zset);
+  }
+  return true;
 }
 
-// PTTL key
-static void do_ttl(std::vector<std::string>& cmd, Buffer& out) {
-  LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+static double zweight(double score, double weight) {
+  double val = score * weight;
+  return isnan(val) ? 0 : val;  // 0 * inf
+}
 
-  HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (!node) {
-    return out_int(&out, -2);  // not found
+static double zaggregate(uint32_t agg, double acc, double val) {
+  switch (agg) {
+    case AGG_MIN:
+      return val < acc ? val : acc;
+    case AGG_MAX:
+      return val > acc ? val : acc;
+    default: {
+      double sum = acc + val;
+      return isnan(sum) ? 0 : sum;  // inf + -inf
+    }
   }
+}
 
-  Entry* ent = container_of(node, Entry, node);
-  if (ent->heap_idx == (size_t)-1) {
-    return out_int(&out, -1);  // no TTL
+// merge every input into `dst` through its hashmap, then build the tree once
+static void zset_union(ZSetOp& op, ZSet* dst) {
+  for (size_t i = 0; i < op.zsets.size(); i++) {
+    for (ZNode* z = zset_min(op.zsets[i]); z; z = znode_next(z)) {
+      double score = zweight(z->score, op.weights[i]);
+      if (ZNode* acc = zset_lookup(dst, z->name, z->len)) {
+        acc->score = zaggregate(op.agg, acc->score, score);
+      } else {
+        zset_stage(dst, z->name, z->len, score);
+      }
+    }
   }
+  zset_build(dst);
+}
 
-  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-  uint64_t now_ms = get_monotonic_msec();
-  return out_int(&out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+// walk the smallest input and probe the others by name
+static void zset_inter(ZSetOp& op, ZSet* dst) {
+  std::vector<size_t> order(op.zsets.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return avl_cnt(op.zsets[lhs]->root) < avl_cnt(op.zsets[rhs]->root);
+  });
+
+  size_t first = order[0];
+  for (ZNode* z = zset_min(op.zsets[first]); z; z = znode_next(z)) {
+    double score = zweight(z->score, op.weights[first]);
+    size_t i = 1;
+    for (; i < order.size(); i++) {
+      ZNode* other = zset_lookup(op.zsets[order[i]], z->name, z->len);
+      if (!other) {
+        break;
+      }
+      score = zaggregate(op.agg, score,
+                         zweight(other->score, op.weights[order[i]]));
+    }
+    if (i == order.size()) {
+      zset_stage(dst, z->name, z->len, score);
+    }
+  }
+  zset_build(dst);
 }
 
-static void do_request(std::vector<std::string>& cmd, struct Buffer& out) {
-  // remember where the msg starts to leave room for the length header
-  size_t header_idx = buf_size(&out);
+// a reply of more members would not fit in k_max_msg
+constexpr int64_t k_max_members = k_max_msg / 16;
 
-  // append placeholder
-  uint32_t placeholder = 0;
-  buf_append(&out, (const uint8_t*)&placeholder, k_header_size);
+// name/score pairs of `count` members from `znode` on, or ERR_TOO_BIG if
+// they would not fit in k_max_msg
+static void out_zrange(Buffer& out, ZNode* znode, int64_t count) {
+  if (count > k_max_members) {
+    return out_err(&out, ERR_TOO_BIG, "reply too big");
+  }
+  size_t start = buf_size(&out);
+  out_arr(&out, (uint32_t)(2 * count));
+  for (int64_t i = 0; i < count; i++) {
+    out_str(&out, znode->name, znode->len);
+    out_dbl(&out, znode->score);
+    znode = znode_next(znode);
+    if (buf_size(&out) - start > k_max_msg - 64) {  // long names
+      out.data_end = out.data_begin + start;
+      return out_err(&out, ERR_TOO_BIG, "reply too big");
+    }
+  }
+}
 
-  // Route the command
+static void out_zset(Buffer& out, ZSet* zset) {
+  out_zrange(out, zset_min(zset), avl_cnt(zset->root));
+}
+
+// replace whatever is at `key` with the zset, which is moved from
+static void store_zset(std::string& s, ZSet* zset) {
+  LookupKey key;
+  key.key.swap(s);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  if (HNode* node = hm_delete(&g_data.db, &key.node, &entry_eq)) {
+    entry_del(container_of(node, Entry, node));
+  }
+  if (!zset->root) {
+    return;  // an empty result deletes the key
+  }
+  Entry* ent = entry_new(T_ZSET);
+  ent->key.swap(key.key);
+  ent->node.hcode = key.node.hcode;
+  ent->zset = *zset;
+  *zset = ZSet{};
+  db_insert(ent);
+  zset_wake(ent);
+}
+
+// zunion numkeys key [key ...] [weights ...] [aggregate ...]
+// zinter numkeys key [key ...] [weights ...] [aggregate ...]
+static void do_zsetop(std::vector<std::string>& cmd, Buffer& out, bool inter) {
+  ZSetOp op;
+  if (!parse_zsetop(cmd, 1, op, out)) {
+    return;
+  }
+  ZSet result;
+  inter ? zset_inter(op, &result) : zset_union(op, &result);
+  out_zset(out, &result);
+  zset_clear(&result);
+}
+
+// zunionstore dst numkeys key [key ...] [weights ...] [aggregate ...]
+// zinterstore dst numkeys key [key ...] [weights ...] [aggregate ...]
+static void do_zsetopstore(std::vector<std::string>& cmd, Buffer& out,
+                           bool inter) {
+  ZSetOp op;
+  if (!parse_zsetop(cmd, 2, op, out)) {
+    return;
+  }
+  ZSet result;
+  if (g_data.zset_arena) {
+    zset_use_arena(&result);
+  }
+  inter ? zset_inter(op, &result) : zset_union(op, &result);
+  int64_t size = avl_cnt(result.root);
+  store_zset(cmd[1], &result);
+  zset_clear(&result);
+  return out_int(&out, size);
+}
+
+// pop `count` members from either end as name/score pairs
+static void zset_pop(ZSet* zset, bool max, int64_t count, Buffer& out) {
+  count = std::min(count, (int64_t)avl_cnt(zset->root));
+  out_arr(&out, (uint32_t)(2 * count));
+  for (int64_t i = 0; i < count; i++) {
+    ZNode* znode = max ? zset_max(zset) : zset_min(zset);
+    out_str(&out, znode->name, znode->len);
+    out_dbl(&out, znode->score);
+    zset_delete(zset, znode);
+  }
+}
+
+// zpopmin zset [count]
+// zpopmax zset [count]
+static void do_zpop(std::vector<std::string>& cmd, Buffer& out, bool max) {
+  int64_t count = 1;
+  if (cmd.size() == 3 && !str2int(cmd[2], count)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int");
+  }
+  if (count < 0) {
+    return out_err(&out, ERR_BAD_ARG, "count is negative");
+  }
+  ZSet* zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+  return zset_pop(zset, max, count, out);
+}
+
+static bool waitlist_eq(HNode* node, HNode* key) {
+  WaitList* wl = container_of(node, WaitList, node);
+  LookupKey* keydata = container_of(key, LookupKey, node);
+  return wl->key == keydata->key;
+}
+
+// park the connection at the tail of each key's wait list
+static void conn_block(Conn* conn, std::vector<std::string>& keys, bool max,
+                       int64_t timeout_ms) {
+  conn->blocked = true;
+  conn->block_max = max;
+  for (std::string& s : keys) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.waits, &key.node, &waitlist_eq);
+    WaitList* wl = NULL;
+    if (node) {
+      wl = container_of(node, WaitList, node);
+    } else {
+      wl = new WaitList();
+      wl->key.swap(key.key);
+      wl->node.hcode = key.node.hcode;
+      dlist_init(&wl->conns);
+      hm_insert(&g_data.waits, &wl->node);
+    }
+    Waiter* w = new Waiter();
+    w->list = wl;
+    w->conn = conn;
+    dlist_insert_before(&wl->conns, &w->node);
+    conn->waiters.push_back(w);
+  }
+  if (timeout_ms > 0) {
+    HeapItem item = {get_monotonic_msec() + (uint64_t)timeout_ms,
+                     &conn->block_heap_idx};
+    heap_upsert(g_data.block_heap, conn->block_heap_idx, item);
+  }
+  // idle timers do not apply while blocked
+  dlist_detach(&conn->timer_node);
+  dlist_init(&conn->timer_node);
+}
+
+static void conn_unblock(Conn* conn) {
+  for (Waiter* w : conn->waiters) {
+    dlist_detach(&w->node);
+    if (dlist_empty(&w->list->conns)) {
+      hm_delete(&g_data.waits, &w->list->node, &hnode_same);
+      delete w->list;
+    }
+    delete w;
+  }
+  conn->waiters.clear();
+  if (conn->block_heap_idx != (size_t)-1) {
+    heap_delete(g_data.block_heap, conn->block_heap_idx);
+    conn->block_heap_idx = -1;
+  }
+  conn->blocked = false;
+}
+
+// the reply has been queued; let the connection resume its pipeline
+static void conn_wake(Conn* conn) {
+  conn_unblock(conn);
+  conn->last_active_ms = get_monotonic_msec();
+  dlist_insert_before(&g_data.idle_list, &conn->timer_node);
+  g_data.unblocked.push_back(conn);
+}
+
+// The zset got members. Blocked pops are served after the command that
+// added them has been logged, so that the log has the pops after it.
+static void zset_wake(Entry* ent) {
+  if (hm_size(&g_data.waits) > 0) {
+    g_data.ready_keys.push_back(ent->key);
+  }
+}
+
+// serve the connections blocked on this key, oldest first
+static void zset_serve(Entry* ent) {
+  LookupKey key;
+  key.key = ent->key;
+  key.node.hcode = ent->node.hcode;
+  HNode* node = hm_lookup(&g_data.waits, &key.node, &waitlist_eq);
+  WaitList* wl = node ? container_of(node, WaitList, node) : NULL;
+  while (wl && ent->zset.root) {
+    Waiter* w = container_of(wl->conns.next, Waiter, node);
+    Conn* conn = w->conn;
+
+    ZNode* znode =
+        conn->block_max ? zset_max(&ent->zset) : zset_min(&ent->zset);
+    Buffer& out = conn->outgoing;
+    size_t header_idx = response_begin(&out);
+    out_arr(&out, 3);
+    out_str(&out, ent->key.data(), ent->key.size());
+    out_str(&out, znode->name, znode->len);
+    out_dbl(&out, znode->score);
+    response_end(&out, header_idx);
+    reply_encode(conn, header_idx);
+    zset_delete(&ent->zset, znode);
+    aof_feed({conn->block_max ? "zpopmax" : "zpopmin", ent->key});
+    key_dirty(ent->key);
+
+    // frees the wait list with its last waiter; look it up again rather
+    // than trust `wl`, the connection may have been queued more than once
+    conn_wake(conn);
+    node = hm_lookup(&g_data.waits, &key.node, &waitlist_eq);
+    wl = node ? container_of(node, WaitList, node) : NULL;
+  }
+}
+
+static void serve_ready_keys() {
+  std::vector<std::string>& ready = g_data.ready_keys;
+  for (size_t i = 0; i < ready.size(); i++) {
+    LookupKey key;
+    key.key.swap(ready[i]);
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = db_lookup(&key);
+    Entry* ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type == T_ZSET) {
+      zset_serve(ent);
+    }
+  }
+  ready.clear();
+}
+
+// bzpopmin zset [zset ...] timeout
+// bzpopmax zset [zset ...] timeout
+static void do_bzpop(Conn* conn, std::vector<std::string>& cmd, Buffer& out,
+                     bool max) {
+  double timeout = 0;
+  if (!str2dbl(cmd.back(), timeout) || timeout < 0) {
+    return out_err(&out, ERR_BAD_ARG, "expect non-negative timeout");
+  }
+  // a key given twice would queue the connection twice on its wait list
+  std::vector<std::string> keys;
+  for (size_t i = 1; i + 1 < cmd.size(); i++) {
+    if (std::find(keys.begin(), keys.end(), cmd[i]) == keys.end()) {
+      keys.push_back(cmd[i]);
+    }
+  }
+  for (const std::string& key : keys) {
+    std::string name = key;  // consumed by expect_zset()
+    ZSet* zset = expect_zset(name);
+    if (!zset) {
+      return out_err(&out, ERR_BAD_TYP, "expect zset");
+    }
+    if (ZNode* znode = max ? zset_max(zset) : zset_min(zset)) {
+      out_arr(&out, 3);
+      out_str(&out, key.data(), key.size());
+      out_str(&out, znode->name, znode->len);
+      out_dbl(&out, znode->score);
+      zset_delete(zset, znode);
+      return;
+    }
+  }
+  if (!conn) {
+    return out_nil(&out);  // nobody to block
+  }
+  // the timeout is in seconds, 0 blocks forever; clamped to ~30000 years
+  // so that the conversion is defined
+  double timeout_ms = std::min(ceil(timeout * 1000), 1e15);
+  conn_block(conn, keys, max, (int64_t)timeout_ms);
+}
+
+// zrangebyrank zset start stop
+static void do_zrangebyrank(std::vector<std::string>& cmd, Buffer& out) {
+  int64_t start = 0, stop = 0;
+  if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int");
+  }
+  ZSet* zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+
+  // inclusive ranks, negative ones count from the end
+  int64_t size = avl_cnt(zset->root);
+  if (start < 0) {
+    start = std::max<int64_t>(start + size, 0);
+  }
+  if (stop < 0) {
+    stop += size;
+  }
+  stop = std::min(stop, size - 1);
+  if (start > stop) {
+    return out_arr(&out, 0);
+  }
+  return out_zrange(out, zset_at(zset, start), stop - start + 1);
+}
+
+// zquantile zset q [q ...]
+static void do_zquantile(std::vector<std::string>& cmd, Buffer& out) {
+  std::vector<double> qs(cmd.size() - 2);
+  for (size_t i = 0; i < qs.size(); i++) {
+    if (!str2dbl(cmd[2 + i], qs[i]) || qs[i] < 0 || qs[i] > 1) {
+      return out_err(&out, ERR_BAD_ARG, "expect quantile in [0, 1]");
+    }
+  }
+  ZSet* zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+
+  // nearest rank, one O(log n) selection per quantile
+  int64_t size = avl_cnt(zset->root);
+  if (size == 0) {
+    return out_arr(&out, 0);
+  }
+  out_arr(&out, 2 * (uint32_t)qs.size());
+  for (double q : qs) {
+    ZNode* znode = zset_at(zset, (int64_t)llround(q * (double)(size - 1)));
+    out_str(&out, znode->name, znode->len);
+    out_dbl(&out, znode->score);
+  }
+}
+
+// zrandmember zset [count]
+// A positive count samples distinct members, a negative one may repeat.
+static void do_zrandmember(std::vector<std::string>& cmd, Buffer& out) {
+  int64_t count = 1;
+  if (cmd.size() == 3 && !str2int(cmd[2], count)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int");
+  }
+  if (count < -k_max_members) {  // also keeps -count defined
+    return out_err(&out, ERR_TOO_BIG, "count out of range");
+  }
+  ZSet* zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+
+  static std::mt19937_64 rng{std::random_device{}()};
+  int64_t size = avl_cnt(zset->root);
+  if (size == 0 || count == 0) {
+    return out_arr(&out, 0);
+  }
+  if (std::min(count, size) > k_max_members) {
+    return out_err(&out, ERR_TOO_BIG, "count out of range");
+  }
+  std::vector<int64_t> ranks;
+  if (count < 0) {
+    std::uniform_int_distribution<int64_t> dist(0, size - 1);
+    for (int64_t i = 0; i < -count; i++) {
+      ranks.push_back(dist(rng));
+    }
+  } else if (count >= size) {
+    return out_zset(out, zset);
+  } else {
+    // Floyd's algorithm: `count` distinct ranks in O(count) draws
+    std::set<int64_t> picked;
+    for (int64_t j = size - count; j < size; j++) {
+      int64_t r = std::uniform_int_distribution<int64_t>(0, j)(rng);
+      picked.insert(picked.count(r) ? j : r);
+    }
+    ranks.assign(picked.begin(), picked.end());
+  }
+
+  out_arr(&out, 2 * (uint32_t)ranks.size());
+  for (int64_t rank : ranks) {
+    ZNode* znode = zset_at(zset, rank);
+    out_str(&out, znode->name, znode->len);
+    out_dbl(&out, znode->score);
+  }
+}
+
+// expirestats
+static void expiry_update_rate(uint64_t now_ms);
+
+static void do_expirestats(std::vector<std::string>&, Buffer& out) {
+  auto& expiry = g_data.expiry;
+  expiry_update_rate(get_monotonic_msec());
+  const std::pair<const char*, int64_t> stats[] = {
+      {"expired_keys", (int64_t)expiry.expired},
+      {"expired_lazy", (int64_t)expiry.expired_lazy},
+      {"expired_per_sec", (int64_t)expiry.rate},
+      {"expiry_backlog", (int64_t)expiry.backlog},
+      {"expiry_budget_us", (int64_t)expiry.budget_us},
+      {"expiry_cycles", (int64_t)expiry.cycles},
+      {"expiry_cycles_over_budget", (int64_t)expiry.cycles_over_budget},
+      {"keys_with_ttl", (int64_t)g_data.heap.size()},
+  };
+  out_arr(&out, 2 * (sizeof(stats) / sizeof(stats[0])));
+  for (const auto& stat : stats) {
+    out_str(&out, stat.first, strlen(stat.first));
+    out_int(&out, stat.second);
+  }
+}
+
+struct SnapStats {
+  uint64_t keys = 0;
+  uint64_t bytes = 0;
+  uint64_t usec = 0;
+  uint64_t cow_bytes = 0;  // pages copied since the fork, bgsave only
+};
+
+struct SnapArg {
+  SnapWriter* w = NULL;
+  uint64_t mono_ms = 0;
+  uint64_t wall_ms = 0;
+  uint64_t keys = 0;
+};
+
+static bool cb_snap_entry(HNode* node, void* arg) {
+  SnapArg* snap = (SnapArg*)arg;
+  SnapWriter* w = snap->w;
+  Entry* ent = container_of(node, Entry, node);
+  if (entry_expired(ent, snap->mono_ms)) {
+    return true;
+  }
+  uint8_t type = ent->type == T_ZSET ? k_snap_zset : k_snap_str;
+  if (ent->heap_idx != (size_t)-1) {
+    // the TTL heap is monotonic; store wall-clock time
+    snap_put_u8(w, type | k_snap_ttl);
+    snap_put_u64(w, snap->wall_ms + g_data.heap[ent->heap_idx].val -
+                        snap->mono_ms);
+  } else {
+    snap_put_u8(w, type);
+  }
+  snap_put_str(w, ent->key.data(), ent->key.size());
+  if (ent->type == T_ZSET) {
+    snap_put_varint(w, avl_cnt(ent->zset.root));
+    for (ZNode* z = zset_min(&ent->zset); z; z = znode_next(z)) {
+      snap_put_dbl(w, z->score);
+      snap_put_str(w, z->name, z->len);
+    }
+  } else {
+    snap_put_str(w, ent->str.data(), ent->str.size());
+  }
+  snap->keys++;
+  return true;
+}
+
+// Serialize the keyspace, or only `keys` for a checkpoint delta, where a
+// key that is gone is written as deleted.
+static void snapshot_encode(SnapWriter* w,
+                            const std::unordered_set<std::string>* keys,
+                            uint64_t& count) {
+  SnapArg snap;
+  snap.w = w;
+  snap.mono_ms = get_monotonic_msec();
+  snap.wall_ms = get_realtime_msec();
+  if (!keys) {
+    snap_begin(w, hm_size(&g_data.db), g_data.snapshot.stamp_ms);
+    hm_foreach(&g_data.db, &cb_snap_entry, &snap);
+    count = snap.keys;
+    return;
+  }
+  snap_begin(w, keys->size(), g_data.snapshot.stamp_ms);
+  for (const std::string& name : *keys) {
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    uint64_t written = snap.keys;
+    if (node) {
+      cb_snap_entry(node, &snap);
+    }
+    if (snap.keys == written) {  // deleted or expired
+      snap_put_u8(w, k_snap_del);
+      snap_put_str(w, name.data(), name.size());
+      snap.keys++;
+    }
+  }
+  count = snap.keys;
+}
+
+// The creation time in the header orders the snapshot and the checkpoint
+// deltas on top of it, so it never repeats. Taken in the parent before a
+// snapshot is written.
+static void snapshot_stamp() {
+  uint64_t now_ms = get_realtime_msec();
+  g_data.snapshot.stamp_ms = std::max(now_ms, g_data.snapshot.stamp_ms + 1);
+}
+
+static std::string tmp_path(const std::string& path) {
+  return path + ".tmp." + std::to_string(getpid());
+}
+
+// Write to `tmp`, then rename it over `path`. A NULL `path` leaves the
+// file at `tmp` for the caller. `keys` limits it to a delta.
+static bool snapshot_write(
+    const std::string& tmp, const char* path, SnapStats& stats,
+    const std::unordered_set<std::string>* keys = NULL) {
+  uint64_t start_us = get_monotonic_usec();
+  SnapWriter w;
+  w.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (w.fd < 0) {
+    return false;
+  }
+  snapshot_encode(&w, keys, stats.keys);
+  if (!snap_end(&w)) {
+    close(w.fd);
+    unlink(tmp.c_str());
+    return false;
+  }
+  if (!snap_commit(w.fd, tmp.c_str(), path)) {
+    return false;
+  }
+  stats.bytes = w.nbytes;
+  stats.usec = get_monotonic_usec() - start_us;
+  return true;
+}
+
+// memory that is no longer shared with the parent, from the child's view
+static uint64_t proc_private_dirty() {
+  FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+  if (!fp) {
+    return 0;
+  }
+  char line[256];
+  uint64_t kb = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned long long val = 0;
+    if (1 == sscanf(line, "Private_Dirty: %llu kB", &val)) {
+      kb += val;
+    }
+  }
+  fclose(fp);
+  return kb * 1024;
+}
+
+static void snapshot_log(const char* what, const SnapStats& stats) {
+  double secs = (double)stats.usec / 1e6;
+  double gb = (double)stats.bytes / 1e9;
+  log_msg(LOG_INFO, "%s: %llu keys, %.1f MB in %.3f s (%.1f MB/s, %.2f s/GB)",
+          what, (unsigned long long)stats.keys, gb * 1e3, secs,
+          secs > 0 ? gb * 1e3 / secs : 0, gb > 0 ? secs / gb : 0);
+}
+
+// Fork a child that writes a point-in-time copy of the keyspace, see
+// snapshot_write(). Its SnapStats come back through a pipe.
+static bool snapshot_fork(
+    SnapChild& child, const std::string& tmp, const char* path,
+    const std::unordered_set<std::string>* keys = NULL) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // child: no logging here, the log thread does not survive fork()
+    close(fds[0]);
+    SnapStats stats;
+    bool ok = snapshot_write(tmp, path, stats, keys);
+    stats.cow_bytes = proc_private_dirty();
+    if (ok) {
+      (void)write_all(fds[1], (uint8_t*)&stats, sizeof(stats));
+    }
+    _exit(ok ? 0 : 1);
+  }
+  close(fds[1]);
+  child.pid = pid;
+  child.stats_fd = fds[0];
+  return true;
+}
+
+// 1 if the child succeeded, 0 if it failed, -1 while it is running
+static int snapshot_reap_child(SnapChild& child, SnapStats& stats) {
+  int status = 0;
+  if (child.pid <= 0 || waitpid(child.pid, &status, WNOHANG) <= 0) {
+    return -1;
+  }
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            0 == read_all(child.stats_fd, (uint8_t*)&stats, sizeof(stats));
+  if (!ok) {
+    log_msg(LOG_ERROR, "pid %d failed with status %d", (int)child.pid, status);
+  }
+  close(child.stats_fd);
+  child.stats_fd = -1;
+  child.pid = -1;
+  return ok ? 1 : 0;
+}
+
+// one background child at a time
+static const char* child_busy() {
+  if (g_data.snapshot.child.pid > 0) {
+    return "background save in progress";
+  }
+  if (g_data.aof.child.pid > 0) {
+    return "background log rewrite in progress";
+  }
+  if (g_data.checkpoint.child.pid > 0) {
+    return "background checkpoint in progress";
+  }
+  if (g_data.checkpoint.merge) {
+    return "checkpoint merge in progress";
+  }
+  if (g_data.repl.child.pid > 0) {
+    return "replica sync in progress";
+  }
+  return NULL;
+}
+
+static void checkpoint_prune();
+
+// save
+static void do_save(std::vector<std::string>&, Buffer& out) {
+  if (const char* busy = child_busy()) {
+    return out_err(&out, ERR_BAD_ARG, busy);
+  }
+  const std::string& path = g_data.snapshot.path;
+  SnapStats stats;
+  snapshot_stamp();
+  bool ok = snapshot_write(tmp_path(path), path.c_str(), stats);
+  g_data.snapshot.last_ok = ok;
+  if (!ok) {
+    log_msg(LOG_ERROR, "save: %s", strerror(errno));
+    return out_err(&out, ERR_BAD_ARG, "save failed");
+  }
+  g_data.snapshot.last_save_ms = get_realtime_msec();
+  snapshot_log("save", stats);
+  checkpoint_prune();
+  return out_ok(&out);
+}
+
+// bgsave: the forked child writes a point-in-time copy of the keyspace
+static void do_bgsave(std::vector<std::string>&, Buffer& out) {
+  auto& snapshot = g_data.snapshot;
+  if (const char* busy = child_busy()) {
+    return out_err(&out, ERR_BAD_ARG, busy);
+  }
+  snapshot_stamp();
+  if (!snapshot_fork(snapshot.child, tmp_path(snapshot.path),
+                     snapshot.path.c_str())) {
+    return out_err(&out, ERR_BAD_ARG, "fork() failed");
+  }
+  log_msg(LOG_INFO, "bgsave: started by pid %d", (int)snapshot.child.pid);
+  return out_ok(&out);
+}
+
+// lastsave: unix time of the last successful save
+static void do_lastsave(std::vector<std::string>&, Buffer& out) {
+  return out_int(&out, (int64_t)(g_data.snapshot.last_save_ms / 1000));
+}
+
+// collect the bgsave child once it exits
+static void snapshot_reap() {
+  auto& snapshot = g_data.snapshot;
+  SnapStats stats;
+  int rv = snapshot_reap_child(snapshot.child, stats);
+  if (rv < 0) {
+    return;
+  }
+  snapshot.last_ok = rv > 0;
+  if (snapshot.last_ok) {
+    snapshot.last_save_ms = get_realtime_msec();
+    snapshot_log("bgsave", stats);
+    log_msg(LOG_INFO, "bgsave: copy-on-write %.1f MB",
+            (double)stats.cow_bytes / 1e6);
+    checkpoint_prune();
+  }
+}
+
+static std::string aof_rewrite_path() { return g_data.aof.path + ".rewrite"; }
+
+// Compact the log. The child writes a snapshot of the keyspace, which is
+// how a log starts, and the commands that arrive meanwhile follow it.
+static bool aof_rewrite_start() {
+  auto& aof = g_data.aof;
+  // what is still queued is in the child's copy of the keyspace
+  if (!aof_flush()) {
+    die("aof_flush()");
+  }
+  snapshot_stamp();
+  if (!snapshot_fork(aof.child, aof_rewrite_path(), NULL)) {
+    return false;
+  }
+  aof_rewrite_begin();
+  log_msg(LOG_INFO, "aof rewrite: started by pid %d", (int)aof.child.pid);
+  return true;
+}
+
+// bgrewriteaof
+static void do_bgrewriteaof(std::vector<std::string>&, Buffer& out) {
+  if (!aof_enabled()) {
+    return out_err(&out, ERR_BAD_ARG, "append-only log is off");
+  }
+  if (const char* busy = child_busy()) {
+    return out_err(&out, ERR_BAD_ARG, busy);
+  }
+  if (!aof_rewrite_start()) {
+    return out_err(&out, ERR_BAD_ARG, "fork() failed");
+  }
+  return out_ok(&out);
+}
+
+// install the rewritten log once the child exits
+static void aof_rewrite_reap() {
+  auto& aof = g_data.aof;
+  SnapStats stats;
+  int rv = snapshot_reap_child(aof.child, stats);
+  if (rv < 0) {
+    return;
+  }
+  std::string tmp = aof_rewrite_path();
+  uint64_t old_size = aof_stats().size;
+  if (rv == 0 || !aof_rewrite_end(tmp.c_str(), aof.path.c_str())) {
+    aof_rewrite_abort();
+    unlink(tmp.c_str());
+    log_msg(LOG_ERROR, "aof rewrite: failed, keeping the old log");
+    return;
+  }
+  aof.rewrites++;
+  uint64_t new_size = aof_stats().size;
+  log_msg(LOG_INFO,
+          "aof rewrite: %.1f MB -> %.1f MB, %llu keys in %.3f s, %.1f MB "
+          "logged meanwhile, copy-on-write %.1f MB",
+          (double)old_size / 1e6, (double)new_size / 1e6,
+          (unsigned long long)stats.keys, (double)stats.usec / 1e6,
+          (double)(new_size - stats.bytes) / 1e6,
+          (double)stats.cow_bytes / 1e6);
+}
+
+// rewrite once the log has grown by a percentage since the last rewrite
+static void aof_rewrite_auto() {
+  auto& aof = g_data.aof;
+  if (!aof_enabled() || aof.auto_pct == 0 || child_busy()) {
+    return;
+  }
+  AofStats stats = aof_stats();
+  if (stats.size < aof.auto_min_size ||
+      stats.size < stats.base_size + stats.base_size / 100 * aof.auto_pct) {
+    return;
+  }
+  log_msg(LOG_INFO, "aof rewrite: %.1f MB, was %.1f MB after the last one",
+          (double)stats.size / 1e6, (double)stats.base_size / 1e6);
+  if (!aof_rewrite_start()) {
+    log_msg(LOG_ERROR, "aof rewrite: fork() failed");
+  }
+}
+
+// `checked` is for payloads that this server did not write: a zset member
+// twice or a NaN score would break the zset, so they fail the entry
+static Entry* snapshot_load_entry(SnapReader* r, uint8_t type,
+                                  bool checked = false) {
+  size_t klen = 0;
+  const char* key = snap_get_str(r, klen);
+  if (!r->ok) {
+    return NULL;
+  }
+  Entry* ent = entry_new(type == k_snap_zset ? T_ZSET : T_STR);
+  ent->key.assign(key, klen);
+  ent->node.hcode = str_hash((uint8_t*)key, klen);
+  if (type == k_snap_str) {
+    size_t len = 0;
+    const char* val = snap_get_str(r, len);
+    if (val) {
+      ent->str.assign(val, len);
+    }
+  } else {
+    if (g_data.zset_arena) {
+      zset_use_arena(&ent->zset);
+    }
+    // members are stored in order; a member takes at least 9 bytes
+    uint64_t count = snap_get_varint(r);
+    count = std::min<uint64_t>(count, (r->end - r->cur) / 9);
+    std::vector<ZNode*> nodes;
+    nodes.reserve(count);
+    hm_reserve(&ent->zset.hmap, count);
+    for (uint64_t i = 0; i < count && r->ok; i++) {
+      double score = snap_get_dbl(r);
+      size_t len = 0;
+      const char* name = snap_get_str(r, len);
+      if (name && checked &&
+          (isnan(score) || zset_lookup(&ent->zset, name, len))) {
+        r->ok = false;
+        break;
+      }
+      if (name) {
+        nodes.push_back(zset_stage(&ent->zset, name, len, score));
+      }
+    }
+    zset_build_from(&ent->zset, nodes.data(), nodes.size());
+  }
+  if (!r->ok) {
+    entry_del(ent);
+    return NULL;
+  }
+  return ent;
+}
+
+// a read-only mapping of a whole file
+struct FileMap {
+  const uint8_t* data = NULL;
+  size_t size = 0;
+};
+
+static bool file_map(const char* path, FileMap& map) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  map.size = ok ? (size_t)st.st_size : 0;
+  if (map.size > 0) {
+    void* ptr = mmap(NULL, map.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = ptr != MAP_FAILED;
+    if (ok) {
+      map.data = (const uint8_t*)ptr;
+      madvise(ptr, map.size, MADV_WILLNEED);  // start the readahead
+    }
+  }
+  close(fd);
+  return ok;
+}
+
+static void file_unmap(FileMap& map) {
+  if (map.data) {
+    munmap((void*)map.data, map.size);
+  }
+  map = FileMap{};
+}
+
+constexpr size_t k_load_chunk = 16 << 20;  // below this, one thread
+constexpr size_t k_load_threads = 8;
+
+struct LoadedEntry {
+  Entry* ent = NULL;
+  uint64_t expire_ms = 0;  // wall clock, 0 for none
+};
+
+// a run of whole records, decoded by one thread
+struct SnapChunk {
+  const uint8_t* begin = NULL;
+  const uint8_t* end = NULL;
+  std::vector<LoadedEntry> ents;
+  const uint8_t* eof = NULL;  // where the eof byte was found
+  bool ok = true;
+};
+
+// Parse and allocate entries without touching shared state; the keyspace
+// and the TTL heap are only updated by the main thread.
+static void snapshot_decode_chunk(SnapChunk* chunk) {
+  SnapReader r;
+  r.begin = r.cur = chunk->begin;
+  r.end = chunk->end;
+  while (r.cur < r.end) {
+    uint8_t type = snap_get_u8(&r);
+    if (!r.ok || type == k_snap_eof) {
+      chunk->eof = r.cur;
+      break;
+    }
+    LoadedEntry le;
+    le.expire_ms = (type & k_snap_ttl) ? snap_get_u64(&r) : 0;
+    type &= ~k_snap_ttl;
+    if (type != k_snap_str && type != k_snap_zset) {
+      r.ok = false;
+      break;
+    }
+    le.ent = snapshot_load_entry(&r, type);
+    if (!le.ent) {
+      break;
+    }
+    chunk->ents.push_back(le);
+  }
+  chunk->ok = r.ok;
+}
+
+// cut the records into about `n` runs of similar size, ending at eof
+static bool snapshot_split(SnapReader* r, size_t n,
+                           std::vector<SnapChunk>& chunks) {
+  size_t target = (size_t)(r->end - r->cur) / n + 1;
+  const uint8_t* begin = r->cur;
+  while (true) {
+    const uint8_t* rec = r->cur;
+    uint8_t type = snap_skip(r);
+    if (!r->ok) {
+      return false;
+    }
+    if (type == k_snap_eof || (size_t)(r->cur - begin) >= target) {
+      SnapChunk chunk;
+      chunk.begin = begin;
+      chunk.end = type == k_snap_eof ? rec : r->cur;
+      chunks.push_back(std::move(chunk));
+      begin = r->cur;
+    }
+    if (type == k_snap_eof) {
+      return true;
+    }
+  }
+}
+
+// Decode a snapshot at the start of `data` into the keyspace. Returns the
+// bytes it spans, or 0 if it is corrupt. Keys that expired while down are
+// dropped unless `keep_expired`, which a log replayed on top of it needs.
+// Large snapshots are cut into runs of records that are decoded on several
+// threads, while this thread checks the CRC.
+static size_t snapshot_decode(const uint8_t* data, size_t size,
+                              bool keep_expired, uint64_t& keys) {
+  SnapReader r;
+  uint64_t nkeys = 0, created_ms = 0;
+  if (!snap_open(&r, data, size, nkeys, created_ms)) {
+    return 0;
+  }
+  size_t nthreads = std::min<size_t>(std::thread::hardware_concurrency(),
+                                     std::min(size / k_load_chunk + 1,
+                                              k_load_threads));
+  std::vector<SnapChunk> chunks;
+  bool ok = true;
+  if (nthreads > 1) {
+    ok = snapshot_split(&r, nthreads, chunks);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; ok && i < chunks.size(); i++) {
+      threads.emplace_back(&snapshot_decode_chunk, &chunks[i]);
+    }
+    ok = ok && snap_verify(&r);
+    for (std::thread& t : threads) {
+      t.join();
+    }
+  } else {
+    chunks.resize(1);
+    chunks[0].begin = r.cur;
+    chunks[0].end = r.end;
+    snapshot_decode_chunk(&chunks[0]);
+    r.cur = chunks[0].eof;
+    ok = r.cur && snap_verify(&r);
+  }
+  size_t total = 0;
+  for (const SnapChunk& chunk : chunks) {
+    ok = ok && chunk.ok;
+    total += chunk.ents.size();
+  }
+
+  // the header count is only a hint, the records are what was written
+  hm_reserve(&g_data.db, hm_size(&g_data.db) + total);
+  uint64_t wall_ms = get_realtime_msec();
+  for (SnapChunk& chunk : chunks) {
+    for (LoadedEntry& le : chunk.ents) {
+      Entry* ent = le.ent;
+      if (!ok || (le.expire_ms && le.expire_ms <= wall_ms && !keep_expired)) {
+        entry_del(ent);  // expired while down
+        continue;
+      }
+      db_insert(ent);
+      if (le.expire_ms) {
+        entry_set_ttl(ent, le.expire_ms > wall_ms ? le.expire_ms - wall_ms : 0);
+      }
+      keys++;
+    }
+  }
+  return ok ? (size_t)(r.cur - data) : 0;
+}
+
+// load the snapshot at startup; a missing file is an empty keyspace
+static bool snapshot_load(const char* path) {
+  uint64_t start_us = get_monotonic_usec();
+  FileMap map;
+  if (!file_map(path, map)) {
+    return errno == ENOENT;
+  }
+  SnapStats stats;
+  size_t used = snapshot_decode(map.data, map.size, false, stats.keys);
+  stats.bytes = map.size;
+  SnapReader r;
+  uint64_t nkeys = 0;
+  if (used > 0) {
+    snap_open(&r, map.data, map.size, nkeys, g_data.snapshot.stamp_ms);
+  }
+  file_unmap(map);
+  if (used == 0 || used != stats.bytes) {
+    log_msg(LOG_ERROR, "snapshot %s: bad file or checksum", path);
+    return false;
+  }
+  stats.usec = get_monotonic_usec() - start_us;
+  snapshot_log("snapshot loaded", stats);
+  return true;
+}
+
+// Checkpoints. A delta is a snapshot of the keys changed since the one
+// before, named <dbfile>.delta.<created_ms>, with deleted keys written as
+// such. Startup applies the deltas newer than the snapshot in order. Once
+// there are --checkpoint-max-deltas of them a thread merges them into the
+// snapshot file, without touching the keyspace.
+
+static std::string delta_path(uint64_t created_ms) {
+  return g_data.snapshot.path + ".delta." + std::to_string(created_ms);
+}
+
+// the deltas of the snapshot path on disk, oldest first
+static std::vector<DeltaFile> delta_list() {
+  const std::string& path = g_data.snapshot.path;
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+  std::string prefix =
+      (slash == std::string::npos ? path : path.substr(slash + 1)) + ".delta.";
+  std::vector<DeltaFile> deltas;
+  DIR* d = opendir(dir.c_str());
+  while (struct dirent* de = d ? readdir(d) : NULL) {
+    const char* name = de->d_name;
+    if (0 != strncmp(name, prefix.data(), prefix.size())) {
+      continue;
+    }
+    char* end = NULL;
+    uint64_t created_ms = strtoull(name + prefix.size(), &end, 10);
+    if (end != name + prefix.size() && *end == '\0') {
+      deltas.push_back(DeltaFile{created_ms, delta_path(created_ms)});
+    }
+  }
+  if (d) {
+    closedir(d);
+  }
+  std::sort(deltas.begin(), deltas.end(),
+            [](const DeltaFile& a, const DeltaFile& b) {
+              return a.created_ms < b.created_ms;
+            });
+  return deltas;
+}
+
+static void db_remove(const char* name, size_t len) {
+  LookupKey key;
+  key.key.assign(name, len);
+  key.node.hcode = str_hash((uint8_t*)name, len);
+  if (HNode* node = hm_delete(&g_data.db, &key.node, &entry_eq)) {
+    entry_del(container_of(node, Entry, node));
+  }
+}
+
+static bool cb_collect(HNode* node, void* arg) {
+  ((std::vector<Entry*>*)arg)->push_back(container_of(node, Entry, node));
+  return true;
+}
+
+// drop every key
+static void db_clear() {
+  std::vector<Entry*> ents;
+  hm_foreach(&g_data.db, &cb_collect, &ents);
+  hm_clear(&g_data.db);
+  for (Entry* ent : ents) {
+    entry_del(ent);
+  }
+}
+
+// Replace the keys in a delta; the whole file is checked first. One that
+// is not `trusted`, a restore payload, also has every entry loaded and
+// checked before any key is replaced: the checksum says nothing about who
+// made it.
+static bool delta_apply(const uint8_t* data, size_t size, bool trusted,
+                        uint64_t& keys) {
+  SnapReader r;
+  uint64_t nkeys = 0, created_ms = 0;
+  if (!snap_open(&r, data, size, nkeys, created_ms)) {
+    return false;
+  }
+  const uint8_t* begin = r.cur;
+  while (r.ok && snap_skip(&r) != k_snap_eof) {
+  }
+  if (!r.ok || !snap_verify(&r)) {
+    return false;
+  }
+  for (r.cur = begin; !trusted;) {
+    uint8_t type = snap_get_u8(&r);
+    if (type == k_snap_eof) {
+      break;
+    }
+    if (type & k_snap_ttl) {
+      (void)snap_get_u64(&r);
+    }
+    type &= ~k_snap_ttl;
+    size_t len = 0;
+    Entry* ent = NULL;
+    if (type == k_snap_del ? !snap_get_str(&r, len)
+                           : !(ent = snapshot_load_entry(&r, type, true))) {
+      return false;
+    }
+    if (ent) {
+      entry_del(ent);
+    }
+  }
+  r.cur = begin;
+  uint64_t wall_ms = get_realtime_msec();
+  while (true) {
+    uint8_t type = snap_get_u8(&r);
+    if (type == k_snap_eof) {
+      return true;
+    }
+    uint64_t expire_ms = (type & k_snap_ttl) ? snap_get_u64(&r) : 0;
+    type &= ~k_snap_ttl;
+    if (type == k_snap_del) {
+      size_t len = 0;
+      const char* name = snap_get_str(&r, len);
+      db_remove(name, len);
+      if (!g_data.loading) {
+        key_dirty(std::string(name, len));
+      }
+      continue;
+    }
+    Entry* ent = snapshot_load_entry(&r, type, !trusted);
+    if (!ent) {
+      return false;
+    }
+    db_remove(ent->key.data(), ent->key.size());
+    if (!g_data.loading) {
+      key_dirty(ent->key);
+    }
+    if (expire_ms && expire_ms <= wall_ms) {
+      entry_del(ent);  // expired while down
+      continue;
+    }
+    db_insert(ent);
+    if (expire_ms) {
+      entry_set_ttl(ent, expire_ms - wall_ms);
+    }
+    keys++;
+  }
+}
+
+// after snapshot_load()
+static bool checkpoint_load() {
+  auto& checkpoint = g_data.checkpoint;
+  uint64_t base_ms = g_data.snapshot.stamp_ms;
+  for (const DeltaFile& delta : delta_list()) {
+    if (delta.created_ms <= base_ms) {
+      // merged, or superseded by a later save
+      unlink(delta.path.c_str());
+      continue;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    FileMap map;
+    SnapStats stats;
+    if (!file_map(delta.path.c_str(), map) ||
+        !delta_apply(map.data, map.size, true, stats.keys)) {
+      log_msg(LOG_ERROR, "checkpoint %s: bad file or checksum",
+              delta.path.c_str());
+      file_unmap(map);
+      return false;
+    }
+    stats.bytes = map.size;
+    stats.usec = get_monotonic_usec() - start_us;
+    file_unmap(map);
+    snapshot_log("checkpoint delta loaded", stats);
+    checkpoint.deltas.push_back(delta);
+    g_data.snapshot.stamp_ms = delta.created_ms;
+  }
+  checkpoint.last_ms = get_monotonic_msec();
+  return true;
+}
+
+// the records of a snapshot file, with their keys
+struct SnapRecord {
+  std::string_view key;
+  const uint8_t* begin = NULL;
+  const uint8_t* end = NULL;
+};
+
+// step over the next record; false at the end or on damage (r->ok)
+static bool snap_next_record(SnapReader* r, SnapRecord& rec) {
+  rec.begin = r->cur;
+  if (snap_skip(r) == k_snap_eof || !r->ok) {
+    return false;
+  }
+  rec.end = r->cur;
+  SnapReader hdr = *r;
+  hdr.cur = rec.begin;
+  if (snap_get_u8(&hdr) & k_snap_ttl) {
+    snap_get_u64(&hdr);
+  }
+  size_t len = 0;
+  const char* key = snap_get_str(&hdr, len);
+  rec.key = std::string_view(key, len);
+  return true;
+}
+
+struct DeltaMerge {
+  std::thread thread;
+  std::atomic<bool> done{false};
+  std::string path;  // the snapshot
+  std::vector<DeltaFile> deltas;
+  // results
+  bool ok = false;
+  SnapStats stats;
+};
+
+// Rewrite the snapshot file with the deltas folded in: the records of keys
+// that no delta has are copied as they are, then the latest record of each
+// key in the deltas that still exists. Runs on its own thread.
+static void delta_merge(DeltaMerge* m) {
+  uint64_t start_us = get_monotonic_usec();
+  std::vector<FileMap> maps(m->deltas.size());
+  std::unordered_map<std::string_view, SnapRecord> latest;
+  bool ok = true;
+  for (size_t i = 0; ok && i < m->deltas.size(); i++) {
+    SnapReader r;
+    uint64_t nkeys = 0, created_ms = 0;
+    ok = file_map(m->deltas[i].path.c_str(), maps[i]) &&
+         snap_open(&r, maps[i].data, maps[i].size, nkeys, created_ms);
+    SnapRecord rec;
+    while (ok && snap_next_record(&r, rec)) {
+      latest[rec.key] = rec;
+    }
+    ok = ok && r.ok && snap_verify(&r);
+  }
+
+  // a missing snapshot is an empty one
+  FileMap base;
+  SnapReader r;
+  uint64_t nkeys = 0, created_ms = 0;
+  if (!file_map(m->path.c_str(), base)) {
+    ok = ok && errno == ENOENT;
+  } else {
+    ok = ok && snap_open(&r, base.data, base.size, nkeys, created_ms);
+  }
+  std::string tmp = m->path + ".merge";
+  SnapWriter w;
+  w.fd = ok ? open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+            : -1;
+  ok = ok && w.fd >= 0;
+  if (ok) {
+    snap_begin(&w, nkeys + latest.size(), m->deltas.back().created_ms);
+    SnapRecord rec;
+    while (base.data && snap_next_record(&r, rec)) {
+      if (!latest.count(rec.key)) {
+        snap_put(&w, rec.begin, rec.end - rec.begin);
+        m->stats.keys++;
+      }
+    }
+    ok = !base.data || (r.ok && snap_verify(&r));
+    for (const auto& it : latest) {
+      const SnapRecord& rec = it.second;
+      if ((rec.begin[0] & ~k_snap_ttl) != k_snap_del) {
+        snap_put(&w, rec.begin, rec.end - rec.begin);
+        m->stats.keys++;
+      }
+    }
+    ok = snap_end(&w) && ok;
+    if (!ok) {
+      close(w.fd);
+      unlink(tmp.c_str());
+    }
+    ok = ok && snap_commit(w.fd, tmp.c_str(), m->path.c_str());
+  }
+  for (FileMap& map : maps) {
+    file_unmap(map);
+  }
+  file_unmap(base);
+  m->ok = ok;
+  m->stats.bytes = w.nbytes;
+  m->stats.usec = get_monotonic_usec() - start_us;
+  m->done.store(true, std::memory_order_release);
+}
+
+// write the keys changed since the last delta in a forked child
+static bool checkpoint_start() {
+  auto& checkpoint = g_data.checkpoint;
+  checkpoint.last_ms = get_monotonic_msec();
+  if (checkpoint.dirty.empty()) {
+    return true;
+  }
+  snapshot_stamp();
+  checkpoint.child_ms = g_data.snapshot.stamp_ms;
+  std::string path = delta_path(checkpoint.child_ms);
+  checkpoint.writing.swap(checkpoint.dirty);
+  if (!snapshot_fork(checkpoint.child, tmp_path(path), path.c_str(),
+                     &checkpoint.writing)) {
+    checkpoint.dirty.swap(checkpoint.writing);
+    return false;
+  }
+  log_msg(LOG_INFO, "checkpoint: %zu keys by pid %d",
+          checkpoint.writing.size(), (int)checkpoint.child.pid);
+  return true;
+}
+
+// checkpoint
+static void do_checkpoint(std::vector<std::string>&, Buffer& out) {
+  if (g_data.checkpoint.secs == 0) {
+    return out_err(&out, ERR_BAD_ARG, "checkpoints are off");
+  }
+  if (const char* busy = child_busy()) {
+    return out_err(&out, ERR_BAD_ARG, busy);
+  }
+  if (!checkpoint_start()) {
+    return out_err(&out, ERR_BAD_ARG, "fork() failed");
+  }
+  return out_ok(&out);
+}
+
+// a saved snapshot includes every delta
+static void checkpoint_prune() {
+  for (const DeltaFile& delta : g_data.checkpoint.deltas) {
+    unlink(delta.path.c_str());
+  }
+  g_data.checkpoint.deltas.clear();
+}
+
+static void checkpoint_reap() {
+  auto& checkpoint = g_data.checkpoint;
+  SnapStats stats;
+  int rv = snapshot_reap_child(checkpoint.child, stats);
+  if (rv > 0) {
+    checkpoint.deltas.push_back(
+        DeltaFile{checkpoint.child_ms, delta_path(checkpoint.child_ms)});
+    checkpoint.writing.clear();
+    snapshot_log("checkpoint", stats);
+  } else if (rv == 0) {
+    // those keys go into the next one
+    unlink(tmp_path(delta_path(checkpoint.child_ms)).c_str());
+    checkpoint.dirty.insert(checkpoint.writing.begin(),
+                            checkpoint.writing.end());
+    checkpoint.writing.clear();
+  }
+
+  DeltaMerge* m = checkpoint.merge;
+  if (!m || !m->done.load(std::memory_order_acquire)) {
+    return;
+  }
+  m->thread.join();
+  checkpoint.merge = NULL;
+  if (m->ok) {
+    // the deltas written meanwhile stay
+    for (const DeltaFile& delta : m->deltas) {
+      unlink(delta.path.c_str());
+    }
+    checkpoint.deltas.erase(checkpoint.deltas.begin(),
+                            checkpoint.deltas.begin() + m->deltas.size());
+    checkpoint.merges++;
+    snapshot_log("checkpoint merge", m->stats);
+  } else {
+    log_msg(LOG_ERROR, "checkpoint merge: failed, keeping the deltas");
+  }
+  delete m;
+}
+
+// a delta every --checkpoint-secs, then a merge when there are enough
+static void checkpoint_auto() {
+  auto& checkpoint = g_data.checkpoint;
+  if (checkpoint.secs == 0 || child_busy()) {
+    return;
+  }
+  if (checkpoint.deltas.size() >= checkpoint.max_deltas) {
+    DeltaMerge* m = new DeltaMerge();
+    m->path = g_data.snapshot.path;
+    m->deltas = checkpoint.deltas;
+    checkpoint.merge = m;
+    m->thread = std::thread(&delta_merge, m);
+    log_msg(LOG_INFO, "checkpoint merge: %zu deltas", m->deltas.size());
+    return;
+  }
+  if (get_monotonic_msec() >= checkpoint.last_ms + checkpoint.secs * 1000 &&
+      !checkpoint_start()) {
+    log_msg(LOG_ERROR, "checkpoint: fork() failed");
+  }
+}
+
+// map a dataset built by kvbuild for --static
+static bool static_open(const char* path) {
+  uint64_t start_us = get_monotonic_usec();
+  if (!ds_open(path, &g_data.dataset)) {
+    log_msg(LOG_ERROR, "static dataset %s: not found or corrupt", path);
+    return false;
+  }
+  log_msg(LOG_INFO, "static dataset mapped: %llu keys, %.1f MB in %.3f s",
+          (unsigned long long)g_data.dataset.hdr->nkeys,
+          (double)g_data.dataset.size / 1e6,
+          (double)(get_monotonic_usec() - start_us) / 1e6);
+  return true;
+}
+
+// PEXPIRE key ttl_ms
+static void do_expire(std::vector<std::string>& cmd, Buffer& out) {
+  int64_t ttl_ms = 0;
+  if (!str2int(cmd[2], ttl_ms)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int64");
+  }
+
+  LookupKey key;
+  key.key.swap(cmd[1]);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  HNode* node = db_lookup(&key);
+  if (node) {
+    Entry* ent = container_of(node, Entry, node);
+    entry_set_ttl(ent, ttl_ms);
+  }
+  return out_int(&out, node ? 1 : 0);
+}
+
+// pexpireat key unix_ms; a time in the past expires the key now
+static void do_expireat(std::vector<std::string>& cmd, Buffer& out) {
+  int64_t at_ms = 0;
+  if (!str2int(cmd[2], at_ms)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int64");
+  }
+  int64_t now_ms = (int64_t)get_realtime_msec();
+
+  LookupKey key;
+  key.key.swap(cmd[1]);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  HNode* node = db_lookup(&key);
+  if (node) {
+    Entry* ent = container_of(node, Entry, node);
+    entry_set_ttl(ent, at_ms > now_ms ? at_ms - now_ms : 0);
+  }
+  return out_int(&out, node ? 1 : 0);
+}
+
+// PTTL key
+static void do_ttl(std::vector<std::string>& cmd, Buffer& out) {
+  LookupKey key;
+  key.key.swap(cmd[1]);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+
+  HNode* node = db_lookup(&key);
+  if (!node) {
+    return out_int(&out, -2);  // not found
+  }
+
+  Entry* ent = container_of(node, Entry, node);
+  if (ent->heap_idx == (size_t)-1) {
+    return out_int(&out, -1);  // no TTL
+  }
+
+  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+  uint64_t now_ms = get_monotonic_msec();
+  return out_int(&out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+}
+
+// A static dataset answers lookups from the mapped file, with the values
+// sent straight from the page cache.
+static const DsRec* static_lookup(const std::string& key) {
+  return ds_lookup(&g_data.dataset, key.data(), key.size());
+}
+
+static void do_static_get(Conn* conn, std::vector<std::string>& cmd,
+                          Buffer& out) {
+  const DsRec* rec = static_lookup(cmd[1]);
+  if (!rec) {
+    return out_nil(&out);
+  }
+  if (rec->type != DS_STR) {
+    return out_err(&out, ERR_BAD_TYP, "not a string value");
+  }
+  return out_str_ref(conn, &out, ds_str(rec), rec->size);
+}
+
+// false for a key of another type; a missing key, like an empty zset, leaves
+// `rec` NULL
+static bool static_zset(const std::string& key, const DsRec*& rec) {
+  rec = static_lookup(key);
+  return !rec || rec->type == DS_ZSET;
+}
+
+static void do_static_zscore(std::vector<std::string>& cmd, Buffer& out) {
+  const DsRec* rec = NULL;
+  if (!static_zset(cmd[1], rec)) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+  const std::string& name = cmd[2];
+  int64_t rank = rec ? ds_zrank(&g_data.dataset, rec, name.data(), name.size())
+                     : -1;
+  const DsMember* m = rank < 0 ? NULL : ds_zat(&g_data.dataset, rec, rank);
+  return m ? out_dbl(&out, m->score) : out_nil(&out);
+}
+
+static void do_static_zrank(std::vector<std::string>& cmd, Buffer& out) {
+  const DsRec* rec = NULL;
+  if (!static_zset(cmd[1], rec)) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+  const std::string& name = cmd[2];
+  int64_t rank = rec ? ds_zrank(&g_data.dataset, rec, name.data(), name.size())
+                     : -1;
+  return rank < 0 ? out_nil(&out) : out_int(&out, rank);
+}
+
+// the members are in order, so the offset is plain arithmetic on the rank
+static void do_static_zquery(Conn* conn, std::vector<std::string>& cmd,
+                             Buffer& out) {
+  double score = 0;
+  if (!str2dbl(cmd[2], score)) {
+    return out_err(&out, ERR_BAD_ARG, "expect fp number");
+  }
+  const std::string& name = cmd[3];
+  int64_t offset = 0, limit = 0;
+  if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int");
+  }
+  const DsRec* rec = NULL;
+  if (!static_zset(cmd[1], rec)) {
+    return out_err(&out, ERR_BAD_TYP, "expect zset");
+  }
+  if (limit <= 0 || !rec) {
+    return out_arr(&out, 0);
+  }
+
+  const Dataset* ds = &g_data.dataset;
+  int64_t card = (int64_t)ds_zcard(rec);
+  int64_t rank =
+      (int64_t)ds_zseekge(ds, rec, score, name.data(), name.size());
+  // like znode_offset(), nothing when the seek or the offset misses
+  bool in_range = rank < card && offset >= -rank && offset < card - rank;
+  rank = in_range ? rank + offset : card;
+
+  size_t ctx = out_begin_arr(&out);
+  int64_t n = 0;
+  for (; rank < card && n < limit; rank++) {
+    const DsMember* m = ds_zat(ds, rec, (uint64_t)rank);
+    if (!m) {
+      break;
+    }
+    out_str_ref(conn, &out, ds_name(m), m->len);
+    out_dbl(&out, m->score);
+    n += 2;
+  }
+  out_end_arr(&out, ctx, (uint32_t)n);
+}
+
+static void do_info(std::vector<std::string>& cmd, Buffer& out);
+
+static void do_static_request(Conn* conn, std::vector<std::string>& cmd,
+                              Buffer& out) {
   if (cmd.size() == 2 && cmd[0] == "get") {
+    do_static_get(conn, cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "zscore") {
+    do_static_zscore(cmd, out);
+  } else if (cmd.size() == 6 && cmd[0] == "zquery") {
+    do_static_zquery(conn, cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "zrank") {
+    do_static_zrank(cmd, out);
+  } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "info") {
+    do_info(cmd, out);
+  } else {
+    out_err(&out, ERR_READ_ONLY,
+            "static dataset: get, zscore, zquery, zrank, info");
+  }
+}
+
+// Replication. A replica connects to the primary and sends `psync id
+// offset`. The primary replies with `continue` and streams request frames
+// from its backlog if it still holds `offset` of stream `id`; otherwise it
+// forks a snapshot, replies with `fullresync`, and sends the snapshot and
+// then the frames from the offset it was taken at. Replicas ack their
+// offset every second and reject writes from clients.
+
+constexpr uint64_t k_repl_ping_ms = 1000;  // pings and acks
+constexpr uint64_t k_repl_timeout_ms = 60 * 1000;
+constexpr uint64_t k_repl_retry_ms = 1000;
+
+static const char* repl_state_name(uint32_t state) {
+  static const char* names[] = {
+      "none",       "wait_bgsave", "bgsave",   "send_snapshot", "online",
+      "connecting", "handshake",   "transfer", "connected",
+  };
+  return state < sizeof(names) / sizeof(names[0]) ? names[state] : "?";
+}
+
+// psync id offset, from a replica
+static void do_psync(Conn* conn, std::vector<std::string>& cmd, Buffer& out) {
+  auto& repl = g_data.repl;
+  if (!conn || conn->repl != REPL_NONE) {
+    return out_err(&out, ERR_BAD_ARG, "already a replica");
+  }
+  if (!repl.host.empty()) {
+    return out_err(&out, ERR_BAD_ARG, "a replica has no replicas");
+  }
+  int64_t off = 0;
+  if (!str2int(cmd[2], off)) {
+    return out_err(&out, ERR_BAD_ARG, "expect int");
+  }
+  // the stream starts with the first replica
+  if (repl.backlog.ring.empty()) {
+    backlog_init(&repl.backlog, repl.backlog_size);
+  }
+  struct sockaddr_in addr = {};
+  socklen_t addrlen = sizeof(addr);
+  char ip[INET_ADDRSTRLEN] = "?";
+  if (0 == getpeername(conn->fd, (struct sockaddr*)&addr, &addrlen)) {
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+  }
+  conn->repl_addr = ip;
+  conn->repl_addr += ":" + std::to_string(ntohs(addr.sin_port));
+  conn->repl_io_ms = get_monotonic_msec();
+  // no idle timeout, see repl_cron()
+  dlist_detach(&conn->timer_node);
+  dlist_init(&conn->timer_node);
+  repl.replicas.push_back(conn);
+
+  if (cmd[1] == repl.id && off >= (int64_t)backlog_start(&repl.backlog) &&
+      (uint64_t)off <= repl.backlog.off) {
+    conn->repl = REPL_ONLINE;
+    conn->repl_off = (uint64_t)off;
+    conn->repl_ack = (uint64_t)off;
+    log_msg(LOG_INFO, "replica %s: partial resync at offset %lld",
+            conn->repl_addr.c_str(), (long long)off);
+    out_arr(&out, 4);
+    out_str(&out, "continue", 8);
+    out_str(&out, repl.id.data(), repl.id.size());
+    out_int(&out, off);
+    return out_int(&out, 0);
+  }
+  // the reply comes with the snapshot, see repl_reap()
+  conn->repl = REPL_WAIT_BGSAVE;
+  log_msg(LOG_INFO, "replica %s: full sync", conn->repl_addr.c_str());
+  return out_nil(&out);
+}
+
+// replconf ack offset | replconf ping
+static void do_replconf(Conn* conn, std::vector<std::string>& cmd,
+                        Buffer& out) {
+  int64_t off = 0;
+  if (cmd.size() == 3 && cmd[1] == "ack" && str2int(cmd[2], off)) {
+    if (conn) {
+      conn->repl_ack = (uint64_t)off;
+    }
+  } else if (!(cmd.size() == 2 && cmd[1] == "ping")) {
+    return out_err(&out, ERR_BAD_ARG, "expect ack or ping");
+  }
+  return out_nil(&out);
+}
+
+// close the link to the primary; repl_cron() reconnects
+static void repl_drop_link() {
+  auto& repl = g_data.repl;
+  if (repl.link) {
+    repl.link->want_close = true;  // destroyed by the event loop
+    repl.link = NULL;
+  }
+  repl.retry_ms = 0;
+}
+
+// replicaof host port | replicaof no one
+static void do_replicaof(std::vector<std::string>& cmd, Buffer& out) {
+  auto& repl = g_data.repl;
+  if (cmd[1] == "no" && cmd[2] == "one") {
+    if (!repl.host.empty()) {
+      log_msg(LOG_INFO, "replica: promoted to primary");
+      repl_drop_link();
+      repl.host.clear();
+      // writes start here, so the old stream cannot be resumed
+      repl.id = repl_new_id();
+      repl.master_id.clear();
+      repl.master_off = 0;
+    }
+    return out_ok(&out);
+  }
+  if (aof_enabled() || g_data.checkpoint.secs > 0) {
+    return out_err(&out, ERR_BAD_ARG,
+                   "a replica keeps no append-only log or checkpoints");
+  }
+  int64_t port = 0;
+  struct in_addr addr = {};
+  if (!str2int(cmd[2], port) || port <= 0 || port > 65535 ||
+      inet_pton(AF_INET, cmd[1].c_str(), &addr) != 1) {
+    return out_err(&out, ERR_BAD_ARG, "expect an IPv4 address and a port");
+  }
+  // the replicas follow the stream of this server, which ends here
+  for (Conn* conn : repl.replicas) {
+    conn->want_close = true;
+  }
+  repl.backlog = ReplBacklog();
+  // reconnecting to the same primary resumes where the link left off
+  repl_drop_link();
+  repl.host = cmd[1];
+  repl.port = (uint16_t)port;
+  log_msg(LOG_INFO, "replica: following %s:%u", repl.host.c_str(),
+          (unsigned)repl.port);
+  return out_ok(&out);
+}
+
+// The positions of the keys of a command in `cmd`.
+static void cmd_keys(const std::vector<std::string>& cmd,
+                     std::vector<size_t>& pos) {
+  const std::string& name = cmd[0];
+  // the keys are cmd[first, last), and cmd[1] for a destination
+  size_t first = 1, last = 2;
+  int64_t numkeys = 0;
+  if (name == "zunion" || name == "zinter") {
+    first = 2;
+    last = 2 + (cmd.size() > 1 && str2int(cmd[1], numkeys) ? numkeys : 0);
+  } else if (name == "zunionstore" || name == "zinterstore") {
+    if (cmd.size() > 1) {
+      pos.push_back(1);
+    }
+    first = 3;
+    last = 3 + (cmd.size() > 2 && str2int(cmd[2], numkeys) ? numkeys : 0);
+  } else if (name == "bzpopmin" || name == "bzpopmax") {
+    last = cmd.size() - 1;
+  } else if (name == "migrate") {
+    first = 4;
+    last = cmd.size();
+  } else if (name == "keys" || name == "expirestats" || name == "save" ||
+             name == "bgsave" || name == "lastsave" ||
+             name == "bgrewriteaof" || name == "checkpoint" ||
+             name == "psync" || name == "replconf" || name == "replicaof" ||
+             name == "role" || name == "cluster" || name == "asking" ||
+             name == "restore" || name == "ping" || name == "hello" ||
+             name == "client" || name == "config" || name == "info") {
+    return;
+  }
+  for (size_t i = first; i < std::min(last, cmd.size()); i++) {
+    pos.push_back(i);
+  }
+}
+
+// The slot of the keys of a command: -1 if it has none, -2 if they are in
+// different slots. Multi-key commands only work within a slot.
+static int32_t cmd_slot(const std::vector<std::string>& cmd,
+                        const std::vector<size_t>& pos) {
+  int32_t slot = -1;
+  for (size_t i : pos) {
+    int32_t s = (int32_t)key_slot(cmd[i].data(), cmd[i].size());
+    if (slot >= 0 && s != slot) {
+      return -2;
+    }
+    slot = s;
+  }
+  return slot;
+}
+
+// ranges of consecutive slots on the same node: [start, end, host, port]
+static void out_cluster_slots(Buffer& out) {
+  const ClusterMap& cluster = g_data.cluster;
+  size_t ctx = out_begin_arr(&out);
+  uint32_t n = 0;
+  for (uint32_t start = 0; start < k_cluster_slots; n++) {
+    uint32_t end = start;
+    uint16_t owner = cluster.owner[start];
+    while (end + 1 < k_cluster_slots && cluster.owner[end + 1] == owner) {
+      end++;
+    }
+    const ClusterNode& node = cluster.nodes[owner];
+    out_arr(&out, 4);
+    out_int(&out, start);
+    out_int(&out, end);
+    out_str(&out, node.host.data(), node.host.size());
+    out_int(&out, node.port);
+    start = end + 1;
+  }
+  out_end_arr(&out, ctx, n);
+}
+
+static std::string node_addr(size_t idx) {
+  const ClusterNode& node = g_data.cluster.nodes[idx];
+  return node.host + ":" + std::to_string(node.port);
+}
+
+// up to `limit` keys in the slot; expired ones included until reclaimed
+static void out_slot_keys(uint32_t slot, int64_t limit, Buffer& out) {
+  DList* head = &g_data.slot_keys[slot];
+  size_t ctx = out_begin_arr(&out);
+  uint32_t n = 0;
+  for (DList* it = head->next; it != head && n < limit; it = it->next, n++) {
+    Entry* ent = container_of(it, Entry, slot_node);
+    out_str(&out, ent->key.data(), ent->key.size());
+  }
+  out_end_arr(&out, ctx, n);
+}
+
+// cluster slots | keyslot key | countkeysinslot slot |
+// getkeysinslot slot count | setslot slot (migrating|importing|node) addr |
+// setslot slot stable
+static void do_cluster(std::vector<std::string>& cmd, Buffer& out) {
+  ClusterMap& cluster = g_data.cluster;
+  const std::string& sub = cmd[1];
+  if (cmd.size() == 3 && sub == "keyslot") {
+    return out_int(&out, key_slot(cmd[2].data(), cmd[2].size()));
+  }
+  if (cluster.nodes.empty()) {
+    return out_err(&out, ERR_BAD_ARG, "cluster mode is off");
+  }
+  if (cmd.size() == 2 && sub == "slots") {
+    return out_cluster_slots(out);
+  }
+  int64_t slot = -1;
+  if (cmd.size() < 3 || !str2int(cmd[2], slot) || slot < 0 ||
+      slot >= k_cluster_slots) {
+    return out_err(&out, ERR_BAD_ARG, "expect a slot");
+  }
+  if (cmd.size() == 3 && sub == "countkeysinslot") {
+    int64_t n = 0;
+    DList* head = &g_data.slot_keys[slot];
+    for (DList* it = head->next; it != head; it = it->next) {
+      n++;
+    }
+    return out_int(&out, n);
+  }
+  int64_t limit = 0;
+  if (cmd.size() == 4 && sub == "getkeysinslot") {
+    if (!str2int(cmd[3], limit) || limit < 0) {
+      return out_err(&out, ERR_BAD_ARG, "expect a count");
+    }
+    return out_slot_keys((uint32_t)slot, limit, out);
+  }
+  if (cmd.size() == 4 && sub == "setslot" && cmd[3] == "stable") {
+    cluster.migrating[slot] = cluster.importing[slot] = -1;
+    return out_ok(&out);
+  }
+  ClusterNode node;
+  if (cmd.size() != 5 || sub != "setslot" ||
+      !cluster_parse_node(cmd[4], node)) {
+    return out_err(&out, ERR_BAD_ARG, "unknown cluster subcommand");
+  }
+  bool owned = cluster.owner[slot] == cluster.self;
+  size_t idx = cluster_node(&cluster, node);
+  if (cmd[3] == "migrating") {
+    if (!owned || idx == cluster.self) {
+      return out_err(&out, ERR_BAD_ARG, "not the owner of the slot");
+    }
+    cluster.migrating[slot] = (int32_t)idx;
+  } else if (cmd[3] == "importing") {
+    if (owned || idx == cluster.self) {
+      return out_err(&out, ERR_BAD_ARG, "already the owner of the slot");
+    }
+    cluster.importing[slot] = (int32_t)idx;
+  } else if (cmd[3] == "node") {
+    cluster.owner[slot] = (uint16_t)idx;
+    cluster.migrating[slot] = cluster.importing[slot] = -1;
+  } else {
+    return out_err(&out, ERR_BAD_ARG, "expect migrating, importing or node");
+  }
+  log_msg(LOG_INFO, "cluster: slot %d %s %s", (int)slot, cmd[3].c_str(),
+          node_addr(idx).c_str());
+  return out_ok(&out);
+}
+
+// ping [message]
+static void do_ping(std::vector<std::string>& cmd, Buffer& out) {
+  if (cmd.size() == 2) {
+    return out_str(&out, cmd[1].data(), cmd[1].size());
+  }
+  return out_str(&out, "PONG", 4);
+}
+
+// hello [2|3]: the RESP version of the replies to this connection
+static void do_hello(Conn* conn, std::vector<std::string>& cmd, Buffer& out) {
+  if (!conn || conn->proto < PROTO_RESP2) {
+    return out_err(&out, ERR_BAD_ARG, "expect a RESP connection");
+  }
+  if (cmd.size() == 2) {
+    if (cmd[1] != "2" && cmd[1] != "3") {
+      return out_err(&out, ERR_BAD_ARG, "expect protocol version 2 or 3");
+    }
+    conn->proto = cmd[1] == "3" ? PROTO_RESP3 : PROTO_RESP2;
+  }
+  // field names and values
+  out_arr(&out, 4);
+  out_str(&out, "proto", 5);
+  out_int(&out, conn->proto == PROTO_RESP3 ? 3 : 2);
+  out_str(&out, "role", 4);
+  if (g_data.repl.host.empty()) {
+    out_str(&out, "master", 6);
+  } else {
+    out_str(&out, "replica", 7);
+  }
+}
+
+// client info: who this connection is, as field names and values; the
+// process is known on the unix socket only
+static void do_client(Conn* conn, std::vector<std::string>& cmd,
+                      Buffer& out) {
+  if (cmd[1] != "info") {
+    return out_err(&out, ERR_BAD_ARG, "unknown subcommand");
+  }
+  if (!conn) {
+    return out_nil(&out);
+  }
+  static const char* const protos[] = {"unknown", "bin", "resp2", "resp3"};
+  bool local = conn->peer_cred.pid >= 0;
+  out_arr(&out, local ? 10 : 4);
+  out_str(&out, "addr", 4);
+  out_str(&out, conn->peer_addr.data(), conn->peer_addr.size());
+  out_str(&out, "proto", 5);
+  out_str(&out, protos[conn->proto], strlen(protos[conn->proto]));
+  if (local) {
+    out_str(&out, "pid", 3);
+    out_int(&out, conn->peer_cred.pid);
+    out_str(&out, "uid", 3);
+    out_int(&out, conn->peer_cred.uid);
+    out_str(&out, "gid", 3);
+    out_int(&out, conn->peer_cred.gid);
+  }
+}
+
+// the settings of config get and config set, and of --config files
+static const ConfigVar g_config_vars[] = {
+    {"max-load-factor", &g_hm_conf.max_load_factor, 1, 64},
+    {"rehashing-work", &g_hm_conf.rehashing_work, 1, 1 << 20},
+    {"max-msg", &g_data.conf.max_msg, 4096, k_max_msg},
+    {"max-args", &g_data.conf.max_args, 1, k_max_args},
+    {"idle-timeout-ms", &g_data.conf.idle_timeout_ms, 1, 86400 * 1000},
+    {"io-timeout-ms", &g_data.conf.io_timeout_ms, 1, 86400 * 1000},
+    {"expire-budget-us", &g_data.expiry.budget_us, 0, 1000 * 1000},
+    {"conn-buffer-size", &g_data.conf.conn_buffer_size, 1024, 64 << 20},
+    {"latency-sample", &g_data.conf.latency_sample, 0, 1 << 20},
+};
+constexpr size_t k_config_nvars =
+    sizeof(g_config_vars) / sizeof(g_config_vars[0]);
+
+// config get pattern: name, value, ... of the matching settings
+// config set name value
+static void do_config(std::vector<std::string>& cmd, Buffer& out) {
+  if (cmd.size() == 3 && cmd[1] == "get") {
+    size_t ctx = out_begin_arr(&out);
+    uint32_t n = 0;
+    for (const ConfigVar& var : g_config_vars) {
+      if (fnmatch(cmd[2].c_str(), var.name, 0) == 0) {
+        out_str(&out, var.name, strlen(var.name));
+        out_int(&out, (int64_t)*var.val);
+        n += 2;
+      }
+    }
+    return out_end_arr(&out, ctx, n);
+  } else if (cmd.size() == 4 && cmd[1] == "set") {
+    std::string err;
+    if (!config_set(g_config_vars, k_config_nvars, cmd[2], cmd[3], err)) {
+      return out_err(&out, ERR_BAD_ARG, err);
+    }
+    log_msg(LOG_INFO, "config set %s %s", cmd[2].c_str(), cmd[3].c_str());
+    return out_ok(&out);
+  }
+  return out_err(&out, ERR_BAD_ARG, "expect get pattern or set name value");
+}
+
+// Calls are counted per command name, and one in `latency-sample` of
+// them is timed around do_request() into a latency histogram: reading the
+// clock twice costs ~8% of a pipelined get. Only the names in
+// k_cmd_names get an entry, so junk names do not grow the table.
+struct CmdStat {
+  HNode node;  // g_data.stats.cmds
+  std::string name;
+  uint64_t calls = 0;
+  Hist ns;  // the timed calls
+};
+
+static bool cmdstat_eq(HNode* node, HNode* key) {
+  CmdStat* stat = container_of(node, CmdStat, node);
+  LookupKey* keydata = container_of(key, LookupKey, node);
+  return stat->name == keydata->key;
+}
+
+// the names do_request() dispatches; keep in step with it
+static const char* const k_cmd_names[] = {
+    "asking",      "bgrewriteaof", "bgsave",      "bzpopmax",
+    "bzpopmin",    "checkpoint",   "client",      "cluster",
+    "config",      "del",          "expirestats", "get",
+    "getdel",      "getex",        "hello",       "info",
+    "keys",        "lastsave",     "migrate",     "pexpire",
+    "pexpireat",   "ping",         "psync",       "pttl",
+    "replconf",    "replicaof",    "restore",     "role",
+    "save",        "set",          "zadd",        "zcount",
+    "zinter",      "zinterstore",  "zpopmax",     "zpopmin",
+    "zquantile",   "zquery",       "zqueryr",     "zrandmember",
+    "zrangebyrank", "zrank",       "zrem",        "zscore",
+    "zunion",      "zunionstore",
+};
+
+static bool cmd_known(const std::string& name) {
+  for (const char* known : k_cmd_names) {
+    if (name == known) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the last entry looked up per slot, in front of the HMap: hashing the
+// name is most of the cost of counting a call
+static CmdStat* g_cmdstat_cache[64];
+
+static size_t cmdstat_slot(const std::string& name) {
+  return (name.size() * 7 + (uint8_t)name[0] + (uint8_t)name.back()) & 63;
+}
+
+struct CmdTimer {
+  CmdStat* stat = NULL;
+  std::string name;  // a known name until it has an entry
+  bool counted = false;
+  uint64_t start_ns = 0;  // 0 if not timed
+};
+
+// look up the name before the handler consumes `cmd`
+static void cmd_timer_start(CmdTimer* timer, std::vector<std::string>& cmd) {
+  if (cmd.empty() || cmd[0].empty()) {
+    return;
+  }
+  CmdStat*& cached = g_cmdstat_cache[cmdstat_slot(cmd[0])];
+  if (cached && cached->name == cmd[0]) {
+    timer->stat = cached;
+  } else {
+    LookupKey key;
+    key.key.swap(cmd[0]);
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.stats.cmds, &key.node, &cmdstat_eq);
+    if (node) {
+      timer->stat = cached = container_of(node, CmdStat, node);
+    } else if (cmd_known(key.key)) {
+      timer->name = key.key;
+    }
+    key.key.swap(cmd[0]);
+  }
+  timer->counted = true;
+  uint64_t every = g_data.conf.latency_sample;
+  bool timed = every > 0 && (timer->stat ? timer->stat->calls % every == 0
+                                         : !timer->name.empty());
+  if (timed) {
+    timer->start_ns = get_monotonic_nsec();
+  }
+}
+
+static void cmd_timer_stop(CmdTimer* timer) {
+  if (!timer->counted) {
+    return;
+  }
+  uint64_t ns = timer->start_ns ? get_monotonic_nsec() - timer->start_ns : 0;
+  g_data.stats.commands++;
+  if (!timer->stat) {
+    if (timer->name.empty()) {
+      return;  // not a command
+    }
+    timer->stat = new CmdStat();
+    timer->stat->name.swap(timer->name);
+    timer->stat->node.hcode = str_hash((uint8_t*)timer->stat->name.data(),
+                                       timer->stat->name.size());
+    hm_insert(&g_data.stats.cmds, &timer->stat->node);
+  }
+  timer->stat->calls++;
+  if (timer->start_ns) {
+    hist_add(&timer->stat->ns, ns);
+  }
+}
+
+// commands/sec, averaged over at least one second
+static void stats_update_rate(uint64_t now_ms) {
+  auto& stats = g_data.stats;
+  if (now_ms >= stats.rate_start_ms + 1000) {
+    stats.rate = (stats.commands - stats.rate_start_count) * 1000 /
+                 (now_ms - stats.rate_start_ms);
+    stats.rate_start_ms = now_ms;
+    stats.rate_start_count = stats.commands;
+  }
+}
+
+static void info_line(std::string& s, const char* name, uint64_t val) {
+  s += name;
+  s += ':';
+  s += std::to_string(val);
+  s += "\r\n";
+}
+
+static void info_server(std::string& s) {
+  info_line(s, "process_id", (uint64_t)getpid());
+  info_line(s, "tcp_port", g_data.stats.port);
+  info_line(s, "uptime_in_seconds",
+            (get_monotonic_msec() - g_data.stats.start_ms) / 1000);
+}
+
+static void info_clients(std::string& s) {
+  uint64_t clients = 0, blocked = 0;
+  for (Conn* conn : g_data.fd2conn) {
+    if (conn && conn->repl == REPL_NONE) {
+      clients++;
+      blocked += conn->blocked;
+    }
+  }
+  info_line(s, "connected_clients", clients);
+  info_line(s, "blocked_clients", blocked);
+  info_line(s, "connected_replicas", g_data.repl.replicas.size());
+}
+
+static void info_stats(std::string& s) {
+  auto& stats = g_data.stats;
+  stats_update_rate(get_monotonic_msec());
+  info_line(s, "total_connections_received", stats.connections);
+  info_line(s, "total_commands_processed", stats.commands);
+  info_line(s, "instantaneous_ops_per_sec", stats.rate);
+  info_line(s, "total_net_input_bytes", stats.net_in);
+  info_line(s, "total_net_output_bytes", stats.net_out);
+  info_line(s, "keyspace_hits", stats.hits);
+  info_line(s, "keyspace_misses", stats.misses);
+  info_line(s, "expired_keys", g_data.expiry.expired);
+  LogStats log = log_stats();
+  info_line(s, "log_written", log.written);
+  info_line(s, "log_dropped", log.dropped);
+  info_line(s, "log_suppressed", log.suppressed);
+}
+
+static void info_keyspace(std::string& s) {
+  size_t keys = g_data.dataset.data ? g_data.dataset.hdr->nkeys
+                                    : hm_size(&g_data.db);
+  if (keys > 0) {
+    s += "db0:keys=" + std::to_string(keys) +
+         ",expires=" + std::to_string(g_data.heap.size()) + "\r\n";
+  }
+}
+
+static bool cb_cmdstats(HNode* node, void* arg) {
+  ((std::vector<CmdStat*>*)arg)->push_back(container_of(node, CmdStat, node));
+  return true;
+}
+
+// calls, total and mean time, and latency quantiles in microseconds; the
+// total is the mean of the timed calls times the calls
+static void info_commandstats(std::string& s) {
+  std::vector<CmdStat*> stats;
+  hm_foreach(&g_data.stats.cmds, &cb_cmdstats, (void*)&stats);
+  std::sort(stats.begin(), stats.end(), [](CmdStat* a, CmdStat* b) {
+    return a->name < b->name;
+  });
+  for (CmdStat* stat : stats) {
+    const Hist* h = &stat->ns;
+    double usec = hist_mean(h) / 1e3;
+    char line[256];
+    snprintf(line, sizeof(line),
+             "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,"
+             "p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+             stat->name.c_str(), (unsigned long long)stat->calls,
+             (unsigned long long)(usec * (double)stat->calls), usec,
+             (double)hist_quantile(h, 0.5) / 1e3,
+             (double)hist_quantile(h, 0.99) / 1e3,
+             (double)hist_quantile(h, 0.999) / 1e3);
+    s += line;
+  }
+}
+
+// info [section]: "name:value" lines under a "# Section" header per
+// section, as Redis tools expect
+static void do_info(std::vector<std::string>& cmd, Buffer& out) {
+  static const std::pair<const char*, void (*)(std::string&)> sections[] = {
+      {"server", &info_server},     {"clients", &info_clients},
+      {"stats", &info_stats},       {"keyspace", &info_keyspace},
+      {"commandstats", &info_commandstats},
+  };
+  const char* want = cmd.size() == 2 ? cmd[1].c_str() : "all";
+  std::string s;
+  for (const auto& section : sections) {
+    if (strcasecmp(want, "all") != 0 && strcasecmp(want, section.first)) {
+      continue;
+    }
+    if (!s.empty()) {
+      s += "\r\n";
+    }
+    s += "# ";
+    s += (char)toupper(section.first[0]);
+    s += section.first + 1;
+    s += "\r\n";
+    section.second(s);
+  }
+  if (s.empty()) {
+    return out_err(&out, ERR_BAD_ARG, "unknown section");
+  }
+  return out_str(&out, s.data(), s.size());
+}
+
+// asking: the next command may use a slot that is being imported
+static void do_asking(Conn* conn, std::vector<std::string>&, Buffer& out) {
+  if (conn) {
+    conn->asking = true;
+  }
+  return out_ok(&out);
+}
+
+// restore payload: the keys in a snapshot frame from migrate, replacing
+// any that are here
+static void do_restore(std::vector<std::string>& cmd, Buffer& out) {
+  uint64_t keys = 0;
+  if (!delta_apply((const uint8_t*)cmd[1].data(), cmd[1].size(), false,
+                   keys)) {
+    return out_err(&out, ERR_BAD_ARG, "bad payload");
+  }
+  return out_int(&out, (int64_t)keys);
+}
+
+constexpr size_t k_migrate_frame = 1 << 20;  // restore payload, about
+
+static bool send_all(int fd, const std::string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t rv =
+        send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (rv <= 0) {
+      return false;
+    }
+    done += (size_t)rv;
+  }
+  return true;
+}
+
+// Send the restore frames over a blocking socket, all of them before the
+// first reply is read. Empty if every frame was applied.
+static std::string migrate_send(const struct sockaddr_in& addr,
+                                int64_t timeout_ms,
+                                const std::vector<std::string>& frames) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return strerror(errno);
+  }
+  struct timeval tv = {};
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  std::string err;
+  if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    err = strerror(errno);
+  }
+  for (size_t i = 0; err.empty() && i < frames.size(); i++) {
+    if (!send_all(fd, frames[i])) {
+      err = strerror(errno);
+    }
+  }
+  std::vector<uint8_t> reply;
+  for (size_t i = 0; err.empty() && i < frames.size(); i++) {
+    uint32_t len = 0;
+    if (read_all(fd, (uint8_t*)&len, 4) != 0 || len == 0 ||
+        len > k_max_msg) {
+      err = "no reply";
+      break;
+    }
+    reply.resize(len);
+    if (read_all(fd, reply.data(), len) != 0) {
+      err = "no reply";
+    } else if (reply[0] == TAG_ERR && len >= 9) {
+      // code, then the message
+      err.assign((const char*)&reply[9], len - 9);
+    } else if (reply[0] != TAG_INT) {
+      err = "bad reply";
+    }
+  }
+  close(fd);
+  return err;
+}
+
+// migrate host port timeout_ms key [key...]: move the keys to another
+// server in restore frames. They are deleted here once the target has
+// applied all of them; the missing ones are skipped.
+static void do_migrate(std::vector<std::string>& cmd, Buffer& out) {
+  // not a logged write, but it deletes the keys
+  if (!g_data.repl.host.empty()) {
+    return out_err(&out, ERR_READ_ONLY, "replica is read-only");
+  }
+  int64_t port = 0, timeout_ms = 0;
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  if (!str2int(cmd[2], port) || port <= 0 || port > 65535 ||
+      inet_pton(AF_INET, cmd[1].c_str(), &addr.sin_addr) != 1) {
+    return out_err(&out, ERR_BAD_ARG, "expect an IPv4 address and a port");
+  }
+  addr.sin_port = htons((uint16_t)port);
+  if (!str2int(cmd[3], timeout_ms) || timeout_ms <= 0) {
+    return out_err(&out, ERR_BAD_ARG, "expect a timeout in ms");
+  }
+
+  std::vector<std::string> frames;
+  std::vector<std::string> moved;
+  SnapWriter w;
+  SnapArg snap;
+  snap.w = &w;
+  snap.mono_ms = get_monotonic_msec();
+  snap.wall_ms = get_realtime_msec();
+  for (size_t i = 4; i < cmd.size(); i++) {
+    LookupKey key;
+    key.key = cmd[i];
+    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (w.data.empty()) {
+      snap_begin(&w, 0, 0);  // the key count is only a hint
+    }
+    uint64_t written = snap.keys;
+    if (node) {
+      cb_snap_entry(node, &snap);
+    }
+    if (snap.keys != written) {
+      moved.push_back(cmd[i]);
+    }
+    bool last = i + 1 == cmd.size();
+    if (snap.keys > 0 && (w.data.size() >= k_migrate_frame || last)) {
+      snap_end(&w);
+      if (w.data.size() + 64 > k_max_msg) {
+        return out_err(&out, ERR_TOO_BIG, "key too big to migrate");
+      }
+      frames.push_back(req_frame({"restore", w.data}));
+      w = SnapWriter();
+      snap.keys = 0;
+    }
+  }
+  if (frames.empty()) {
+    return out_int(&out, 0);
+  }
+  std::string err = migrate_send(addr, timeout_ms, frames);
+  if (!err.empty()) {
+    return out_err(&out, ERR_BAD_ARG,
+                   "migrate to " + cmd[1] + ":" + cmd[2] + ": " + err);
+  }
+  for (const std::string& name : moved) {
+    db_remove(name.data(), name.size());
+    key_dirty(name);
+    aof_feed({"del", name});
+  }
+  return out_int(&out, (int64_t)moved.size());
+}
+
+// role: the replication state, with offsets into the write stream
+static void do_role(std::vector<std::string>&, Buffer& out) {
+  auto& repl = g_data.repl;
+  uint64_t now_ms = get_monotonic_msec();
+  if (repl.host.empty()) {
+    // per replica: address, state, acked offset, ms since it was heard from
+    out_arr(&out, 4);
+    out_str(&out, "master", 6);
+    out_str(&out, repl.id.data(), repl.id.size());
+    out_int(&out, (int64_t)repl.backlog.off);
+    out_arr(&out, (uint32_t)repl.replicas.size());
+    for (Conn* conn : repl.replicas) {
+      const char* state = repl_state_name(conn->repl);
+      out_arr(&out, 4);
+      out_str(&out, conn->repl_addr.data(), conn->repl_addr.size());
+      out_str(&out, state, strlen(state));
+      out_int(&out, (int64_t)conn->repl_ack);
+      out_int(&out, (int64_t)(now_ms - conn->repl_io_ms));
+    }
+    return;
+  }
+  // the applied offset and ms since the primary was heard from
+  Conn* link = repl.link;
+  std::string primary = repl.host + ":" + std::to_string(repl.port);
+  const char* state = link ? repl_state_name(link->repl) : "connect";
+  out_arr(&out, 5);
+  out_str(&out, "replica", 7);
+  out_str(&out, primary.data(), primary.size());
+  out_str(&out, state, strlen(state));
+  out_int(&out, (int64_t)repl.master_off);
+  out_int(&out, link ? (int64_t)(now_ms - link->repl_io_ms) : -1);
+}
+
+static void do_request(Conn* conn, std::vector<std::string>& cmd,
+                       struct Buffer& out) {
+  // leave room for the length header
+  size_t header_idx = response_begin(&out);
+  size_t ref_bytes = conn ? conn->out_ref_bytes : 0;
+
+  // Route the command
+  if (g_data.dataset.data) {
+    do_static_request(conn, cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "get") {
     do_get(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "set") {
+  } else if (cmd.size() >= 3 && cmd[0] == "set") {
     do_set(cmd, out);
+  } else if (cmd.size() >= 2 && cmd[0] == "getex") {
+    do_getex(cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "getdel") {
+    do_getdel(cmd, out);
   } else if (cmd.size() == 2 && cmd[0] == "del") {
     do_del(cmd, out);
   } else if (cmd.size() == 1 && cmd[0] == "keys") {
@@ -615,31 +3696,391 @@ static void do_request(std::vector<std::string>& cmd, struct Buffer& out) {
     do_zqueryr(cmd, out);
   } else if (cmd.size() == 3 && cmd[0] == "zrank") {
     do_zrank(cmd, out);
+  } else if (cmd.size() == 4 && cmd[0] == "zrangebyrank") {
+    do_zrangebyrank(cmd, out);
+  } else if (cmd.size() >= 3 && cmd[0] == "zquantile") {
+    do_zquantile(cmd, out);
+  } else if ((cmd.size() == 2 || cmd.size() == 3) &&
+             cmd[0] == "zrandmember") {
+    do_zrandmember(cmd, out);
+  } else if (cmd.size() >= 3 && cmd[0] == "zunion") {
+    do_zsetop(cmd, out, false);
+  } else if (cmd.size() >= 3 && cmd[0] == "zinter") {
+    do_zsetop(cmd, out, true);
+  } else if (cmd.size() >= 4 && cmd[0] == "zunionstore") {
+    do_zsetopstore(cmd, out, false);
+  } else if (cmd.size() >= 4 && cmd[0] == "zinterstore") {
+    do_zsetopstore(cmd, out, true);
+  } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "zpopmin") {
+    do_zpop(cmd, out, false);
+  } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd[0] == "zpopmax") {
+    do_zpop(cmd, out, true);
+  } else if (cmd.size() >= 3 && cmd[0] == "bzpopmin") {
+    do_bzpop(conn, cmd, out, false);
+  } else if (cmd.size() >= 3 && cmd[0] == "bzpopmax") {
+    do_bzpop(conn, cmd, out, true);
   } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
     do_expire(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "pexpireat") {
+    do_expireat(cmd, out);
   } else if (cmd.size() == 2 && cmd[0] == "pttl") {
     do_ttl(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "expirestats") {
+    do_expirestats(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "save") {
+    do_save(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "bgsave") {
+    do_bgsave(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "lastsave") {
+    do_lastsave(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "bgrewriteaof") {
+    do_bgrewriteaof(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "checkpoint") {
+    do_checkpoint(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "psync") {
+    do_psync(conn, cmd, out);
+  } else if (cmd.size() >= 2 && cmd[0] == "replconf") {
+    do_replconf(conn, cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "replicaof") {
+    do_replicaof(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "role") {
+    do_role(cmd, out);
+  } else if (cmd.size() >= 2 && cmd[0] == "cluster") {
+    do_cluster(cmd, out);
+  } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "ping") {
+    do_ping(cmd, out);
+  } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "hello") {
+    do_hello(conn, cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "client") {
+    do_client(conn, cmd, out);
+  } else if (cmd.size() >= 3 && cmd[0] == "config") {
+    do_config(cmd, out);
+  } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "info") {
+    do_info(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "asking") {
+    do_asking(conn, cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "restore") {
+    do_restore(cmd, out);
+  } else if (cmd.size() >= 5 && cmd[0] == "migrate") {
+    do_migrate(cmd, out);
   } else {
     out_err(&out, ERR_UNKNOWN, "unknown command.");
   }
-
-  // size is current - initial - k_header_size
-  uint32_t payload_size =
-      (uint32_t)(buf_size(&out) - header_idx - k_header_size);
-
-  // patch into placeholder
-  memcpy(out.data_begin + header_idx, &payload_size, k_header_size);
+
+  if (conn && (conn->blocked || conn->repl == REPL_WAIT_BGSAVE)) {
+    // no reply until woken up or timed out, or until the snapshot is ready
+    out.data_end = out.data_begin + header_idx;
+    return;
+  }
+  if (conn) {
+    ref_bytes = conn->out_ref_bytes - ref_bytes;
+  }
+  response_end(&out, header_idx, ref_bytes);
+}
+
+// how a command is written to the append-only log
+enum {
+  AOF_SKIP = 0,   // read-only
+  AOF_FRAME = 1,  // the request frame as received
+  AOF_TTL = 2,    // the frame, then the resulting expiry as an absolute time
+};
+
+static uint32_t aof_classify(const std::vector<std::string>& cmd) {
+  if (cmd.empty()) {
+    return AOF_SKIP;
+  }
+  const std::string& name = cmd[0];
+  if (name == "set") {
+    return cmd.size() > 3 ? AOF_TTL : AOF_FRAME;
+  } else if (name == "getex") {
+    return cmd.size() > 2 ? AOF_TTL : AOF_SKIP;
+  } else if (name == "pexpire" || name == "pexpireat") {
+    return AOF_TTL;
+  } else if (name == "del" || name == "getdel" || name == "zadd" ||
+             name == "zrem" || name == "zpopmin" || name == "zpopmax" ||
+             name == "bzpopmin" || name == "bzpopmax" ||
+             name == "zunionstore" || name == "zinterstore" ||
+             name == "restore") {
+    return AOF_FRAME;
+  }
+  return AOF_SKIP;
+}
+
+// a relative TTL would restart on replay
+static void aof_feed_expireat(std::string& name) {
+  LookupKey key;
+  key.key.swap(name);
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  Entry* ent = node ? container_of(node, Entry, node) : NULL;
+  if (!ent || ent->heap_idx == (size_t)-1) {
+    return;
+  }
+  uint64_t now_ms = get_monotonic_msec();
+  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+  uint64_t at_ms =
+      get_realtime_msec() + (expire_at > now_ms ? expire_at - now_ms : 0);
+  aof_feed({"pexpireat", ent->key, std::to_string(at_ms)});
+}
+
+// a whole reply that is an error
+static void reply_err(Buffer& out, uint32_t code, const std::string& msg) {
+  size_t header_idx = response_begin(&out);
+  out_err(&out, code, msg);
+  response_end(&out, header_idx);
+}
+
+static bool key_exists(const std::string& name) {
+  LookupKey key;
+  key.key = name;
+  key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+  return db_lookup(&key) != NULL;
+}
+
+// The keys of the command are on another node. A migrating slot is served
+// here while all of its keys still are; keys that already moved, or are
+// new, are asked for at the target.
+static bool cluster_redirect(Conn* conn, const std::vector<std::string>& cmd,
+                             Buffer& out) {
+  const ClusterMap& cluster = g_data.cluster;
+  bool asking = conn->asking;  // for this command only
+  conn->asking = false;
+  std::vector<size_t> pos;
+  if (!cmd.empty()) {
+    cmd_keys(cmd, pos);
+  }
+  int32_t slot = cmd_slot(cmd, pos);
+  if (slot == -2) {
+    reply_err(out, ERR_BAD_ARG, "keys in different slots");
+    return true;
+  }
+  if (slot < 0) {
+    return false;
+  }
+  std::string where = std::to_string(slot) + " ";
+  if (cluster.owner[slot] == cluster.self) {
+    int32_t target = cluster.migrating[slot];
+    if (target < 0 || cmd[0] == "migrate") {
+      return false;
+    }
+    size_t missing = 0;
+    for (size_t i : pos) {
+      missing += key_exists(cmd[i]) ? 0 : 1;
+    }
+    if (missing == 0) {
+      return false;
+    }
+    if (missing < pos.size()) {
+      reply_err(out, ERR_BAD_ARG, "try again, the slot is migrating");
+    } else {
+      reply_err(out, ERR_ASK, where + node_addr(target));
+    }
+    return true;
+  }
+  if (asking && cluster.importing[slot] >= 0) {
+    return false;
+  }
+  reply_err(out, ERR_MOVED, where + node_addr(cluster.owner[slot]));
+  return true;
+}
+
+// Run a parsed command. Writes that succeed go to the log and the replicas
+// as `frame`, or as a frame made from `cmd` if it is NULL. A NULL `conn` is
+// the primary's stream applied on a replica.
+static void run_cmd(Conn* conn, std::vector<std::string>& cmd,
+                    const uint8_t* frame, size_t frame_len, Buffer& out) {
+  if (conn && !g_data.cluster.nodes.empty() &&
+      cluster_redirect(conn, cmd, out)) {
+    return;
+  }
+
+  auto& repl = g_data.repl;
+  uint32_t log = AOF_SKIP;
+  if (aof_enabled() || g_data.checkpoint.secs > 0 ||
+      !repl.backlog.ring.empty() || !repl.host.empty()) {
+    log = aof_classify(cmd);
+  }
+  if (conn && log != AOF_SKIP && !repl.host.empty()) {
+    return reply_err(out, ERR_READ_ONLY, "replica is read-only");
+  }
+  std::string made;
+  if (log != AOF_SKIP && !frame) {
+    made = req_frame(cmd);
+    frame = (const uint8_t*)made.data();
+    frame_len = made.size();
+  }
+  // the keys it writes; the handlers consume `cmd`, and have not checked
+  // its size yet
+  std::vector<std::string> keys;
+  if (log != AOF_SKIP && (cmd[0] == "bzpopmin" || cmd[0] == "bzpopmax")) {
+    if (cmd.size() >= 3) {
+      keys.assign(cmd.begin() + 1, cmd.end() - 1);
+    }
+  } else if (log != AOF_SKIP && cmd[0] != "restore" && cmd.size() >= 2) {
+    keys.push_back(cmd[1]);  // restore marks its own
+  }
+  size_t reply_idx = buf_size(&out);
+  CmdTimer timer;
+  cmd_timer_start(&timer, cmd);
+  do_request(conn, cmd, out);
+  cmd_timer_stop(&timer);
+  // blocked or failed commands changed nothing
+  bool blocked = conn && conn->blocked;
+  uint8_t* tag = out.data_begin + reply_idx + k_header_size;
+  bool replied = buf_size(&out) > reply_idx + k_header_size;
+  if (replied && *tag == TAG_OK && (!conn || conn->proto < PROTO_RESP2)) {
+    *tag = TAG_NIL;  // the binary protocol has no OK
+  }
+  if (log != AOF_SKIP && !blocked && *tag != TAG_ERR) {
+    for (const std::string& key : keys) {
+      key_dirty(key);
+    }
+    propagate(frame, frame_len);
+    if (log == AOF_TTL && !keys.empty()) {
+      aof_feed_expireat(keys[0]);
+    }
+  }
+}
+
+// Parse and run the request body at `request`. False if it is malformed.
+static bool run_request(Conn* conn, const uint8_t* request, uint32_t len,
+                        Buffer& out) {
+  std::vector<std::string> cmd;
+  size_t max_args = conn ? g_data.conf.max_args : k_max_args;
+  if (parse_req(request, len, max_args, cmd) < 0) {
+    return false;
+  }
+  run_cmd(conn, cmd, request - k_header_size, k_header_size + len, out);
+  serve_ready_keys();
+  return true;
+}
+
+// commands that block or change what the connection is
+static bool batch_refused(const std::vector<std::string>& cmd) {
+  return !cmd.empty() && (cmd[0] == "bzpopmin" || cmd[0] == "bzpopmax" ||
+                          cmd[0] == "psync" || cmd[0] == "replconf");
+}
+
+// Run the commands of a batch frame back to back: no other client's
+// command, nor a blocked pop woken by one of them, comes in between. The
+// reply is one array with a value or an error per command. Writes go to
+// the log and the replicas one command at a time. Once the reply would not
+// fit in k_max_msg, the rest of the commands are not run and get an error.
+// False if malformed.
+static bool run_batch(Conn* conn, const uint8_t* request, uint32_t len,
+                      Buffer& out) {
+  const uint8_t* end = request + len;
+  uint32_t n = 0;
+  size_t max_args = g_data.conf.max_args;
+  if (!read_u32(request, end, n) || (n & ~k_batch_flag) > max_args) {
+    return false;
+  }
+  n &= ~k_batch_flag;
+  std::vector<std::vector<std::string>> cmds(n);
+  for (std::vector<std::string>& cmd : cmds) {
+    if (parse_cmd(request, end, max_args, cmd) < 0) {
+      return false;
+    }
+  }
+  if (request != end) {
+    return false;
+  }
+
+  static const char k_too_big[] = "batch reply too big";
+  // an error element, kept free for each command after the current one
+  constexpr size_t k_err_size = 1 + 4 + 4 + sizeof(k_too_big) - 1;
+  size_t header_idx = response_begin(&out);
+  size_t ref_bytes = conn->out_ref_bytes;
+  out_arr(&out, n);
+  bool full = false;
+  for (size_t i = 0; i < cmds.size(); i++) {
+    std::vector<std::string>& cmd = cmds[i];
+    if (full) {
+      out_err(&out, ERR_TOO_BIG, k_too_big);
+      continue;
+    }
+    if (batch_refused(cmd)) {
+      out_err(&out, ERR_BAD_ARG, "not allowed in a batch");
+      continue;
+    }
+    size_t reply_idx = buf_size(&out);
+    run_cmd(conn, cmd, NULL, 0, out);
+    // drop the length header of the reply; it is an element now
+    uint8_t* reply = out.data_begin + reply_idx;
+    memmove(reply, reply + k_header_size,
+            buf_size(&out) - reply_idx - k_header_size);
+    out.data_end -= k_header_size;
+    for (auto it = conn->out_refs.rbegin();
+         it != conn->out_refs.rend() && it->pos > reply_idx; ++it) {
+      it->pos -= k_header_size;
+    }
+    size_t size = buf_size(&out) - header_idx - k_header_size +
+                  (conn->out_ref_bytes - ref_bytes);
+    if (size + (cmds.size() - i - 1) * k_err_size > k_max_msg) {
+      // replace the reply; the command has run
+      while (!conn->out_refs.empty() &&
+             conn->out_refs.back().pos > reply_idx) {
+        conn->out_ref_bytes -= conn->out_refs.back().len;
+        conn->out_refs.pop_back();
+      }
+      out.data_end = out.data_begin + reply_idx;
+      out_err(&out, ERR_TOO_BIG, k_too_big);
+      full = true;
+    }
+  }
+  serve_ready_keys();
+  response_end(&out, header_idx, conn->out_ref_bytes - ref_bytes);
+  return true;
+}
+
+// a RESP request; the name of a command is case-insensitive
+static bool try_one_resp(Conn* conn) {
+  Buffer* in = &conn->incoming;
+  if (buf_size(in) == 0 || buf_size(in) < conn->resp_need) {
+    return false;  // continue to want read
+  }
+  std::vector<std::string> cmd;
+  int64_t used =
+      resp_parse(in->data_begin, buf_size(in), g_data.conf.max_args,
+                 g_data.conf.max_msg, cmd, conn->resp_need);
+  if (used < 0) {
+    conn->want_close = true;  // protocol error
+    return false;
+  }
+  if (used == 0) {
+    return false;
+  }
+  if (!cmd.empty()) {
+    std::string& name = cmd[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    size_t reply_idx = buf_size(&conn->outgoing);
+    run_cmd(conn, cmd, NULL, 0, conn->outgoing);
+    serve_ready_keys();
+    reply_encode(conn, reply_idx);
+  }
+  buf_consume(in, (size_t)used);
+  return true;
 }
 
 static bool try_one_request(Conn* conn) {
+  if (conn->blocked) {
+    return false;  // keep the pipeline queued
+  }
   // 3. try to parse the buffer
   // protocol message header
   if (buf_size(&conn->incoming) < k_header_size) {
-    return false;  // continue to want read
+    return conn->proto >= PROTO_RESP2 && try_one_resp(conn);
   }
   uint32_t len = 0;
   memcpy(&len, conn->incoming.data_begin, k_header_size);
-  if (len > k_max_msg) {
+  if (conn->proto == PROTO_UNKNOWN) {
+    // a length no frame can have is text
+    conn->proto = len > k_max_msg ? PROTO_RESP2 : PROTO_BIN;
+  }
+  if (conn->proto >= PROTO_RESP2) {
+    return try_one_resp(conn);
+  }
+  if (len > g_data.conf.max_msg) {
     conn->want_close = true;  // protocol error
     return false;
   }
@@ -649,23 +4090,558 @@ static bool try_one_request(Conn* conn) {
   }
 
   const uint8_t* request = conn->incoming.data_begin + k_header_size;
+  // a replica gets the write stream, not replies to its acks
+  bool quiet = conn->repl != REPL_NONE;
+  size_t reply_idx = buf_size(&conn->outgoing);
+  uint32_t nstr = 0;
+  if (len >= 4) {
+    memcpy(&nstr, request, 4);
+  }
+  bool ok = (nstr & k_batch_flag)
+                ? run_batch(conn, request, len, conn->outgoing)
+                : run_request(conn, request, len, conn->outgoing);
+  if (!ok) {
+    conn->want_close = true;
+    return false;
+  }
+  if (quiet) {
+    conn->outgoing.data_end = conn->outgoing.data_begin + reply_idx;
+  }
 
-  std::vector<std::string> cmd;
-  if (parse_req(request, len, cmd) < 0) {
+  buf_consume(&conn->incoming, k_header_size + len);
+  return true;
+}
+
+// Replay the append-only log: a snapshot of the keyspace when the log was
+// started, then request frames. A frame torn by a crash at the end is cut
+// off; any other damage stops the start.
+static bool aof_load(const char* path) {
+  uint64_t start_us = get_monotonic_usec();
+  FileMap data;
+  if (!file_map(path, data)) {
+    log_msg(LOG_ERROR, "aof %s: %s", path, strerror(errno));
+    return false;
+  }
+  uint64_t keys = 0;
+  size_t pos = snapshot_decode(data.data, data.size, true, keys);
+  if (pos == 0) {
+    log_msg(LOG_ERROR, "aof %s: bad snapshot preamble", path);
+    file_unmap(data);
+    return false;
+  }
+  Buffer out;  // replies are discarded
+  buf_init(&out, 4 * 1024);
+  uint64_t cmds = 0;
+  bool ok = true;
+  while (ok && pos < data.size) {
+    size_t left = data.size - pos;
+    uint32_t len = 0;
+    if (left >= k_header_size) {
+      memcpy(&len, data.data + pos, k_header_size);
+    }
+    if (len > k_max_msg) {
+      log_msg(LOG_ERROR, "aof %s: bad length at offset %zu", path, pos);
+      ok = false;
+    } else if (left < k_header_size || left - k_header_size < len) {
+      log_msg(LOG_WARN, "aof %s: cutting off %zu bytes of a torn write", path,
+              left);
+      ok = truncate(path, (off_t)pos) == 0;
+      break;
+    } else {
+      std::vector<std::string> cmd;
+      const uint8_t* frame = data.data + pos + k_header_size;
+      if (parse_req(frame, len, k_max_args, cmd) < 0) {
+        log_msg(LOG_ERROR, "aof %s: bad command at offset %zu", path, pos);
+        ok = false;
+        break;
+      }
+      do_request(NULL, cmd, out);
+      buf_clear(&out);
+      pos += k_header_size + len;
+      cmds++;
+    }
+  }
+  buf_destroy(&out);
+  if (ok) {
+    uint64_t usec = get_monotonic_usec() - start_us;
+    log_msg(LOG_INFO,
+            "aof loaded: %llu keys and %llu commands, %.1f MB in %.3f s",
+            (unsigned long long)keys, (unsigned long long)cmds,
+            (double)data.size / 1e6, (double)usec / 1e6);
+  }
+  file_unmap(data);
+  return ok;
+}
+
+static bool conn_has_output(Conn* conn) {
+  return buf_size(&conn->outgoing) > 0 || !conn->out_refs.empty();
+}
+
+constexpr size_t k_max_iov = 64;
+
+// `outgoing` cut at each OutRef, with the referenced bytes in between
+static size_t out_iovecs(Conn* conn, struct iovec* iov) {
+  uint8_t* data = conn->outgoing.data_begin;
+  size_t n = 0, pos = 0;
+  for (const OutRef& ref : conn->out_refs) {
+    if (n + 3 > k_max_iov) {
+      return n;
+    }
+    if (ref.pos > pos) {
+      iov[n++] = {data + pos, ref.pos - pos};
+      pos = ref.pos;
+    }
+    iov[n++] = {(void*)ref.data, ref.len};
+  }
+  if (buf_size(&conn->outgoing) > pos) {
+    iov[n++] = {data + pos, buf_size(&conn->outgoing) - pos};
+  }
+  return n;
+}
+
+// drop `len` sent bytes from the front of `outgoing` and `out_refs`
+static void out_consumed(Conn* conn, size_t len) {
+  size_t from_buf = 0;
+  while (len > 0 && !conn->out_refs.empty()) {
+    OutRef& ref = conn->out_refs.front();
+    size_t before = std::min(len, ref.pos - from_buf);
+    from_buf += before;
+    len -= before;
+    size_t sent = std::min(len, ref.len);
+    ref.data += sent;
+    ref.len -= sent;
+    conn->out_ref_bytes -= sent;
+    len -= sent;
+    if (ref.len > 0) {
+      break;
+    }
+    conn->out_refs.pop_front();
+  }
+  from_buf += len;
+  buf_consume(&conn->outgoing, from_buf);
+  for (OutRef& ref : conn->out_refs) {
+    ref.pos -= from_buf;
+  }
+}
+
+// the snapshot forked for replicas, and the one a replica receives
+static std::string repl_snapshot_path() {
+  return tmp_path(g_data.snapshot.path + ".repl");
+}
+static std::string repl_sync_path() { return g_data.snapshot.path + ".sync"; }
+
+static void repl_send(Conn* conn, const std::vector<std::string>& args) {
+  std::string frame = req_frame(args);
+  buf_append(&conn->outgoing, (const uint8_t*)frame.data(), frame.size());
+  conn->want_write = true;
+  conn->write_deferred = true;
+}
+
+static void repl_conn_closed(Conn* conn) {
+  auto& repl = g_data.repl;
+  if (conn->repl_fd >= 0) {
+    close(conn->repl_fd);
+  }
+  if (conn->repl == REPL_TRANSFER && conn == repl.link) {
+    unlink(repl_sync_path().c_str());
+  }
+  std::vector<Conn*>& replicas = repl.replicas;
+  if (std::find(replicas.begin(), replicas.end(), conn) != replicas.end()) {
+    log_msg(LOG_INFO, "replica %s: gone", conn->repl_addr.c_str());
+    replicas.erase(std::remove(replicas.begin(), replicas.end(), conn),
+                   replicas.end());
+  }
+  if (conn == repl.link) {
+    if (conn->repl >= REPL_HANDSHAKE) {
+      log_msg(LOG_WARN, "replica: lost the link to the primary");
+    }
+    repl.link = NULL;
+    repl.retry_ms = get_monotonic_msec() + k_repl_retry_ms;
+  }
+}
+
+// fork a snapshot for the replicas that wait for a full sync
+static void repl_sync_start() {
+  auto& repl = g_data.repl;
+  bool waiting = false;
+  for (Conn* conn : repl.replicas) {
+    waiting = waiting || conn->repl == REPL_WAIT_BGSAVE;
+  }
+  if (!waiting || child_busy()) {
+    return;
+  }
+  bool ok = snapshot_fork(repl.child, repl_snapshot_path(), NULL);
+  if (!ok) {
+    log_msg(LOG_ERROR, "replica sync: fork() failed");
+  }
+  for (Conn* conn : repl.replicas) {
+    if (conn->repl == REPL_WAIT_BGSAVE) {
+      conn->repl = REPL_BGSAVE;
+      conn->want_close = !ok;
+    }
+  }
+  // the stream continues from here
+  repl.child_off = repl.backlog.off;
+}
+
+// hand the snapshot to the replicas once the child exits
+static void repl_reap() {
+  auto& repl = g_data.repl;
+  SnapStats stats;
+  int rv = snapshot_reap_child(repl.child, stats);
+  if (rv < 0) {
+    return;
+  }
+  std::string path = repl_snapshot_path();
+  for (Conn* conn : repl.replicas) {
+    if (conn->repl != REPL_BGSAVE) {
+      continue;
+    }
+    struct stat st;
+    int fd = rv > 0 ? open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      conn->want_close = true;
+      continue;
+    }
+    conn->repl = REPL_SEND_SNAPSHOT;
+    conn->repl_fd = fd;
+    conn->repl_left = (uint64_t)st.st_size;
+    conn->repl_off = repl.child_off;
+    conn->repl_ack = repl.child_off;
+    size_t header_idx = response_begin(&conn->outgoing);
+    out_arr(&conn->outgoing, 4);
+    out_str(&conn->outgoing, "fullresync", 10);
+    out_str(&conn->outgoing, repl.id.data(), repl.id.size());
+    out_int(&conn->outgoing, (int64_t)repl.child_off);
+    out_int(&conn->outgoing, (int64_t)conn->repl_left);
+    response_end(&conn->outgoing, header_idx);
+  }
+  unlink(path.c_str());  // the replicas hold it open
+  if (rv > 0) {
+    snapshot_log("replica sync", stats);
+  }
+}
+
+constexpr size_t k_repl_chunk = 256 * 1024;  // queued per replica
+constexpr size_t k_repl_pending_max = 256 << 20;
+
+// Queue the snapshot, then the stream from the backlog, a chunk at a time.
+// A replica that falls further behind than the backlog is dropped and has
+// to sync in full.
+static void repl_pump() {
+  auto& repl = g_data.repl;
+  repl_sync_start();
+  for (Conn* conn : repl.replicas) {
+    Buffer* out = &conn->outgoing;
+    if (conn->repl_pending.size() > k_repl_pending_max) {
+      log_msg(LOG_WARN, "replica %s: too many writes during the sync",
+              conn->repl_addr.c_str());
+      conn->want_close = true;
+      continue;
+    }
+    while (conn->repl == REPL_SEND_SNAPSHOT && buf_size(out) < k_repl_chunk) {
+      uint8_t buf[64 * 1024];
+      size_t n = (size_t)std::min<uint64_t>(sizeof(buf), conn->repl_left);
+      ssize_t rv = n ? read(conn->repl_fd, buf, n) : 0;
+      if (n && rv <= 0) {
+        conn->want_close = true;
+        break;
+      }
+      buf_append(out, buf, (size_t)rv);
+      conn->repl_left -= (uint64_t)rv;
+      if (conn->repl_left == 0) {
+        close(conn->repl_fd);
+        conn->repl_fd = -1;
+        // caught up with the backlog
+        std::string& pending = conn->repl_pending;
+        buf_append(out, (const uint8_t*)pending.data(), pending.size());
+        conn->repl_off = repl.child_off + pending.size();
+        std::string().swap(pending);
+        conn->repl = REPL_ONLINE;
+      }
+    }
+    if (conn->repl == REPL_ONLINE) {
+      if (conn->repl_off < backlog_start(&repl.backlog)) {
+        log_msg(LOG_WARN, "replica %s: fell behind the backlog",
+                conn->repl_addr.c_str());
+        conn->want_close = true;
+        continue;
+      }
+      if (buf_size(out) < k_repl_chunk) {
+        conn->repl_off +=
+            backlog_read(&repl.backlog, conn->repl_off, out, k_repl_chunk);
+      }
+    }
+    // acks keep coming while the stream is written
+    conn->want_read = true;
+    if (conn_has_output(conn)) {
+      conn->want_write = true;
+      conn->write_deferred = true;
+    }
+  }
+}
+
+// connect to the primary; psync goes out once the socket is writable
+static void repl_connect() {
+  auto& repl = g_data.repl;
+  repl.retry_ms = get_monotonic_msec() + k_repl_retry_ms;
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(repl.port);
+  inet_pton(AF_INET, repl.host.c_str(), &addr.sin_addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    log_msg(LOG_ERROR, "replica: socket(): %s", strerror(errno));
+    return;
+  }
+  fd_set_nonblock(fd);
+  int rv = connect(fd, (const struct sockaddr*)&addr, sizeof(addr));
+  if (rv < 0 && errno != EINPROGRESS) {
+    log_msg(LOG_WARN, "replica: connect to %s:%u: %s", repl.host.c_str(),
+            (unsigned)repl.port, strerror(errno));
+    close(fd);
+    return;
+  }
+  Conn* conn = new Conn();
+  conn->fd = fd;
+  conn->want_write = true;
+  conn->repl = REPL_CONNECTING;
+  conn->repl_io_ms = get_monotonic_msec();
+  dlist_init(&conn->timer_node);
+  buf_init(&conn->incoming, 64 * 1024);
+  buf_init(&conn->outgoing, 4 * 1024);
+  conn_register(conn);
+  repl.link = conn;
+}
+
+// the link is up once connect() succeeded
+static bool repl_handshake(Conn* conn) {
+  auto& repl = g_data.repl;
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+    log_msg(LOG_WARN, "replica: connect to %s:%u: %s", repl.host.c_str(),
+            (unsigned)repl.port, strerror(err ? err : errno));
     conn->want_close = true;
     return false;
   }
+  conn->repl = REPL_HANDSHAKE;
+  conn->want_read = true;
+  conn->repl_io_ms = get_monotonic_msec();
+  const std::string& id = repl.master_id;
+  repl_send(conn, {"psync", id.empty() ? "?" : id,
+                   std::to_string(repl.master_off)});
+  return true;
+}
 
-  do_request(cmd, conn->outgoing);
+static bool read_tag_str(const uint8_t*& cur, const uint8_t* end,
+                         std::string& out) {
+  uint32_t len = 0;
+  return cur < end && *cur++ == TAG_STR && read_u32(cur, end, len) &&
+         read_str(cur, end, len, out);
+}
 
-  buf_consume(&conn->incoming, k_header_size + len);
+static bool read_tag_int(const uint8_t*& cur, const uint8_t* end,
+                         int64_t& out) {
+  if (cur + 9 > end || *cur++ != TAG_INT) {
+    return false;
+  }
+  memcpy(&out, cur, 8);
+  cur += 8;
+  return true;
+}
+
+// [mode, id, offset, snapshot bytes], the reply to psync
+static bool repl_sync_reply(Conn* conn) {
+  auto& repl = g_data.repl;
+  Buffer* in = &conn->incoming;
+  uint32_t len = 0;
+  if (buf_size(in) < k_header_size) {
+    return false;
+  }
+  memcpy(&len, in->data_begin, k_header_size);
+  if (k_header_size + len > buf_size(in)) {
+    return false;
+  }
+  const uint8_t* cur = in->data_begin + k_header_size;
+  const uint8_t* end = cur + len;
+  std::string mode, id;
+  int64_t off = 0, size = 0;
+  uint32_t n = 0;
+  bool ok = cur < end && *cur++ == TAG_ARR && read_u32(cur, end, n) &&
+            n == 4 && read_tag_str(cur, end, mode) &&
+            read_tag_str(cur, end, id) && read_tag_int(cur, end, off) &&
+            read_tag_int(cur, end, size) && off >= 0 && size >= 0;
+  buf_consume(in, k_header_size + len);
+  if (ok && mode == "continue" && id == repl.master_id &&
+      (uint64_t)off == repl.master_off) {
+    log_msg(LOG_INFO, "replica: partial resync at offset %lld",
+            (long long)off);
+    conn->repl = REPL_CONNECTED;
+    return true;
+  }
+  if (ok && mode == "fullresync") {
+    conn->repl_fd = open(repl_sync_path().c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ok = conn->repl_fd >= 0;
+  }
+  if (!ok || mode != "fullresync") {
+    log_msg(LOG_ERROR, "replica: psync refused by %s:%u", repl.host.c_str(),
+            (unsigned)repl.port);
+    conn->want_close = true;
+    return false;
+  }
+  log_msg(LOG_INFO, "replica: full sync, %.1f MB at offset %lld",
+          (double)size / 1e6, (long long)off);
+  conn->repl = REPL_TRANSFER;
+  conn->repl_left = (uint64_t)size;
+  repl.master_id = id;
+  repl.master_off = (uint64_t)off;
+  return true;
+}
+
+// replace the keyspace with the snapshot from the primary
+static bool repl_load() {
+  uint64_t start_us = get_monotonic_usec();
+  std::string tmp = repl_sync_path();
+  FileMap map;
+  if (!file_map(tmp.c_str(), map)) {
+    return false;
+  }
+  db_clear();
+  SnapStats stats;
+  stats.bytes = map.size;
+  size_t used = snapshot_decode(map.data, map.size, false, stats.keys);
+  file_unmap(map);
+  if (used == 0 || used != stats.bytes) {
+    log_msg(LOG_ERROR, "replica: bad snapshot from the primary");
+    unlink(tmp.c_str());
+    return false;
+  }
+  // a restart comes back with it
+  if (rename(tmp.c_str(), g_data.snapshot.path.c_str()) != 0) {
+    log_msg(LOG_WARN, "replica: rename(): %s", strerror(errno));
+  }
+  stats.usec = get_monotonic_usec() - start_us;
+  snapshot_log("replica loaded", stats);
   return true;
 }
 
+// the snapshot, written to disk as it arrives
+static void repl_transfer(Conn* conn) {
+  Buffer* in = &conn->incoming;
+  size_t n = (size_t)std::min<uint64_t>(buf_size(in), conn->repl_left);
+  if (n > 0 && write_all(conn->repl_fd, in->data_begin, n) != 0) {
+    log_msg(LOG_ERROR, "replica: write(): %s", strerror(errno));
+    conn->want_close = true;
+    return;
+  }
+  buf_consume(in, n);
+  conn->repl_left -= n;
+  if (conn->repl_left > 0) {
+    return;
+  }
+  close(conn->repl_fd);
+  conn->repl_fd = -1;
+  if (!repl_load()) {
+    conn->want_close = true;
+    return;
+  }
+  conn->repl = REPL_CONNECTED;
+}
+
+// apply the request frames of the stream
+static void repl_apply(Conn* conn) {
+  auto& repl = g_data.repl;
+  Buffer* in = &conn->incoming;
+  Buffer out;  // replies are discarded
+  buf_init(&out, 4 * 1024);
+  while (buf_size(in) >= k_header_size) {
+    uint32_t len = 0;
+    memcpy(&len, in->data_begin, k_header_size);
+    if (len > k_max_msg) {
+      conn->want_close = true;
+      break;
+    }
+    if (k_header_size + len > buf_size(in)) {
+      break;
+    }
+    if (!run_request(NULL, in->data_begin + k_header_size, len, out)) {
+      log_msg(LOG_ERROR, "replica: bad command at offset %llu",
+              (unsigned long long)repl.master_off);
+      conn->want_close = true;
+      break;
+    }
+    buf_clear(&out);
+    buf_consume(in, k_header_size + len);
+    repl.master_off += k_header_size + len;
+  }
+  buf_destroy(&out);
+}
+
+// what arrives on the link to the primary
+static void repl_process(Conn* conn) {
+  if (conn != g_data.repl.link) {
+    buf_clear(&conn->incoming);  // a link that was dropped
+    return;
+  }
+  if (conn->repl == REPL_HANDSHAKE && !repl_sync_reply(conn)) {
+    return;
+  }
+  if (conn->repl == REPL_TRANSFER) {
+    repl_transfer(conn);
+  }
+  if (conn->repl == REPL_CONNECTED && !conn->want_close) {
+    repl_apply(conn);
+  }
+}
+
+// pings and acks, timeouts, and reconnecting to the primary
+static void repl_cron(uint64_t now_ms) {
+  auto& repl = g_data.repl;
+  if (!repl.replicas.empty() && now_ms >= repl.ping_ms + k_repl_ping_ms) {
+    // only for the replicas; the log does not need it
+    std::string frame = req_frame({"replconf", "ping"});
+    repl_feed((const uint8_t*)frame.data(), frame.size());
+    repl.ping_ms = now_ms;
+  }
+  for (Conn* conn : repl.replicas) {
+    if (conn->repl == REPL_ONLINE &&
+        now_ms >= conn->repl_io_ms + k_repl_timeout_ms) {
+      log_msg(LOG_WARN, "replica %s: timed out", conn->repl_addr.c_str());
+      conn->want_close = true;
+    }
+  }
+  Conn* link = repl.link;
+  if (link && link->repl == REPL_CONNECTED &&
+      now_ms >= repl.ack_ms + k_repl_ping_ms) {
+    repl_send(link, {"replconf", "ack", std::to_string(repl.master_off)});
+    repl.ack_ms = now_ms;
+  }
+  if (link && now_ms >= link->repl_io_ms + k_repl_timeout_ms) {
+    log_msg(LOG_WARN, "replica: the primary timed out");
+    repl_drop_link();
+  }
+  if (!repl.host.empty() && !repl.link && now_ms >= repl.retry_ms) {
+    repl_connect();
+  }
+}
+
 static void handle_write(Conn* conn) {
+  if (conn->repl == REPL_CONNECTING && !repl_handshake(conn)) {
+    return;
+  }
   conn->last_active_ms = get_monotonic_msec();
-  ssize_t rv =
-      write(conn->fd, conn->outgoing.data_begin, buf_size(&conn->outgoing));
+  ssize_t rv = 0;
+  if (conn->out_refs.empty()) {
+    rv = write(conn->fd, conn->outgoing.data_begin, buf_size(&conn->outgoing));
+  } else {
+    struct iovec iov[k_max_iov];
+    rv = writev(conn->fd, iov, (int)out_iovecs(conn, iov));
+  }
   if (rv < 0 && errno == EAGAIN) {
     return;  // not ready
   }
@@ -673,17 +4649,22 @@ static void handle_write(Conn* conn) {
     conn->want_close = true;
     return;  // error
   }
+  g_data.stats.net_out += (uint64_t)rv;
   // remove written data from outgoing
-  buf_consume(&conn->outgoing, (size_t)rv);
+  out_consumed(conn, (size_t)rv);
   // update readiness intention
-  if (buf_size(&conn->outgoing) == 0) {
+  if (!conn_has_output(conn)) {
     conn->want_write = false;
     conn->want_read = true;
-    dlist_detach(&conn->timer_node);
-    dlist_insert_before(&g_data.idle_list, &conn->timer_node);
+    if (!conn->blocked && conn->repl == REPL_NONE) {
+      dlist_detach(&conn->timer_node);
+      dlist_insert_before(&g_data.idle_list, &conn->timer_node);
+    }
   }
 }
 
+static void handle_requests(Conn* conn);
+
 static void handle_read(Conn* conn) {
   conn->last_active_ms = get_monotonic_msec();
   // 1. do a nonblocking read
@@ -693,10 +4674,22 @@ static void handle_read(Conn* conn) {
     conn->want_close = true;
     return;
   }
+  g_data.stats.net_in += (uint64_t)bytes_read;
   // 2. add new data to conn incoming buffer
   buf_append(&conn->incoming, buf, (size_t)bytes_read);
-  dlist_detach(&conn->timer_node);
-  dlist_insert_before(&g_data.io_list, &conn->timer_node);
+  if (conn->repl != REPL_NONE) {
+    conn->repl_io_ms = conn->last_active_ms;
+  } else if (!conn->blocked) {
+    dlist_detach(&conn->timer_node);
+    dlist_insert_before(&g_data.io_list, &conn->timer_node);
+  }
+  handle_requests(conn);
+}
+
+static void handle_requests(Conn* conn) {
+  if (conn->repl >= REPL_CONNECTING) {
+    return repl_process(conn);
+  }
   // 3. try to parse the buffer
   // 4. process the parsed message
   // 5. remove the message from conn incoming buffer
@@ -704,16 +4697,69 @@ static void handle_read(Conn* conn) {
   }
 
   // update readiness intention
-  if (buf_size(&conn->outgoing) > 0) {
+  if (conn_has_output(conn)) {
     conn->want_read = false;
     conn->want_write = true;
-    // optimistic write
-    return handle_write(conn);
+    // optimistic write, after the log is written at the end of the iteration
+    conn->write_deferred = true;
   }
 }
 
-constexpr uint64_t k_idle_timeout_ms = 5 * 1000;
-constexpr uint64_t k_io_timeout_ms = 1 * 1000;
+// expired keys/sec, averaged over at least one second
+static void expiry_update_rate(uint64_t now_ms) {
+  auto& expiry = g_data.expiry;
+  if (now_ms >= expiry.rate_start_ms + 1000) {
+    expiry.rate = (expiry.expired - expiry.rate_start_count) * 1000 /
+                  (now_ms - expiry.rate_start_ms);
+    expiry.rate_start_ms = now_ms;
+    expiry.rate_start_count = expiry.expired;
+  }
+}
+
+// estimate the share of TTL keys that are already expired; heap slots are
+// an unbiased sample of them
+static double sample_expired_frac(uint64_t now_ms) {
+  constexpr size_t k_samples = 16;
+  const std::vector<HeapItem>& heap = g_data.heap;
+  if (heap.empty()) {
+    return 0;
+  }
+  static std::mt19937_64 rng{1};
+  size_t expired = 0;
+  for (size_t i = 0; i < k_samples; i++) {
+    expired += heap[rng() % heap.size()].val <= now_ms;
+  }
+  return (double)expired / k_samples;
+}
+
+// Reclaim expired keys within a CPU-time budget. The budget grows with the
+// sampled share of expired keys, up to 10x, so a TTL storm is drained
+// faster while a trickle of expiries costs next to nothing.
+static void process_expiry(uint64_t now_ms) {
+  auto& expiry = g_data.expiry;
+  uint64_t budget_us =
+      (uint64_t)((double)expiry.budget_us * (1 + 9 * expiry.expired_frac));
+  uint64_t start_us = get_monotonic_usec();
+  const std::vector<HeapItem>& heap = g_data.heap;
+  bool over_budget = false;
+  for (size_t n = 0; !heap.empty() && heap[0].val <= now_ms; n++) {
+    if ((n & 15) == 15 && get_monotonic_usec() - start_us >= budget_us) {
+      over_budget = true;
+      break;
+    }
+    entry_expire(container_of(heap[0].ref, Entry, heap_idx));
+  }
+  expiry.cycles++;
+  if (over_budget) {
+    expiry.cycles_over_budget++;
+    expiry.expired_frac = sample_expired_frac(now_ms);
+    expiry.backlog = (uint64_t)(expiry.expired_frac * (double)heap.size());
+  } else {
+    expiry.expired_frac = 0;
+    expiry.backlog = 0;
+  }
+  expiry_update_rate(now_ms);
+}
 
 static int32_t next_timer_ms() {
   uint64_t now_ms = get_monotonic_msec();
@@ -721,58 +4767,117 @@ static int32_t next_timer_ms() {
 
   if (!dlist_empty(&g_data.idle_list)) {
     Conn* conn = container_of(g_data.idle_list.next, Conn, timer_node);
-    next_ms = std::min(next_ms, conn->last_active_ms + k_idle_timeout_ms);
+    next_ms = std::min(next_ms,
+                       conn->last_active_ms + g_data.conf.idle_timeout_ms);
   }
   if (!dlist_empty(&g_data.io_list)) {
     Conn* conn = container_of(g_data.io_list.next, Conn, timer_node);
-    next_ms = std::min(next_ms, conn->last_active_ms + k_io_timeout_ms);
+    next_ms = std::min(next_ms,
+                       conn->last_active_ms + g_data.conf.io_timeout_ms);
   }
   if (!g_data.heap.empty()) {
     next_ms = std::min(next_ms, g_data.heap[0].val);
   }
+  if (!g_data.block_heap.empty()) {
+    next_ms = std::min(next_ms, g_data.block_heap[0].val);
+  }
+  if (!g_data.repl.replicas.empty() || !g_data.repl.host.empty()) {
+    next_ms = std::min(next_ms, now_ms + k_repl_ping_ms);
+  }
+  if (child_busy()) {
+    next_ms = std::min(next_ms, now_ms + 100);  // poll for its exit
+  } else if (g_data.checkpoint.secs > 0) {
+    next_ms = std::min(next_ms, g_data.checkpoint.last_ms +
+                                    g_data.checkpoint.secs * 1000);
+  }
   if (next_ms == UINT64_MAX) return -1;
   if (next_ms <= now_ms) return 0;
   return (int32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same(HNode* node, HNode* key) { return node == key; }
-
 static void process_timers() {
   uint64_t now_ms = get_monotonic_msec();
+  stats_update_rate(now_ms);
   while (!dlist_empty(&g_data.idle_list)) {
     Conn* conn = container_of(g_data.idle_list.next, Conn, timer_node);
-    uint64_t next_ms = conn->last_active_ms + k_idle_timeout_ms;
+    uint64_t next_ms = conn->last_active_ms + g_data.conf.idle_timeout_ms;
     if (next_ms >= now_ms) {
       break;
     }
-    fprintf(stderr, "removing idle connection: %d\n", conn->fd);
+    log_msg(LOG_INFO, "removing idle connection: %d", conn->fd);
     conn_destroy(conn);
   }
   while (!dlist_empty(&g_data.io_list)) {
     Conn* conn = container_of(g_data.io_list.next, Conn, timer_node);
-    uint64_t next_ms = conn->last_active_ms + k_io_timeout_ms;
+    uint64_t next_ms = conn->last_active_ms + g_data.conf.io_timeout_ms;
     if (next_ms >= now_ms) {
       break;
     }
-    fprintf(stderr, "removing io timeout connection: %d\n", conn->fd);
+    log_msg(LOG_INFO, "removing io timeout connection: %d", conn->fd);
     conn_destroy(conn);
   }
 
-  constexpr size_t k_max_works = 2000;
-  size_t nworks = 0;
-  const std::vector<HeapItem>& heap = g_data.heap;
-  while (!heap.empty() && heap[0].val < now_ms && nworks++ < k_max_works) {
-    Entry* ent = container_of(heap[0].ref, Entry, heap_idx);
-    hm_delete(&g_data.db, &ent->node, &hnode_same);
-    fprintf(stderr, "key expired: %s\n", ent->key.c_str());
-    entry_del(ent);  // delete the key
+  const std::vector<HeapItem>& block_heap = g_data.block_heap;
+  while (!block_heap.empty() && block_heap[0].val <= now_ms) {
+    Conn* conn = container_of(block_heap[0].ref, Conn, block_heap_idx);
+    size_t header_idx = response_begin(&conn->outgoing);
+    out_nil(&conn->outgoing);
+    response_end(&conn->outgoing, header_idx);
+    reply_encode(conn, header_idx);
+    conn_wake(conn);
   }
+
+  process_expiry(now_ms);
+  snapshot_reap();
+  aof_rewrite_reap();
+  aof_rewrite_auto();
+  checkpoint_reap();
+  checkpoint_auto();
+  repl_reap();
+  repl_cron(now_ms);
 }
 
-int main() {
-  dlist_init(&g_data.idle_list);
-  dlist_init(&g_data.io_list);
+// the node at our port is this server
+static bool cluster_open(const char* spec, uint16_t port) {
+  ClusterMap& cluster = g_data.cluster;
+  if (!cluster_parse(spec, &cluster)) {
+    return false;
+  }
+  size_t found = 0;
+  for (size_t i = 0; i < cluster.nodes.size(); i++) {
+    if (cluster.nodes[i].port == port) {
+      cluster.self = i;
+      found++;
+    }
+  }
+  if (found != 1) {
+    cluster = ClusterMap();
+    return false;
+  }
+  // never resized again, the entries link into it
+  g_data.slot_keys.resize(k_cluster_slots);
+  for (DList& head : g_data.slot_keys) {
+    dlist_init(&head);
+  }
+  const ClusterNode& self = cluster.nodes[cluster.self];
+  log_msg(LOG_INFO, "cluster: node %zu of %zu, %s:%u", cluster.self + 1,
+          cluster.nodes.size(), self.host.c_str(), (unsigned)self.port);
+  return true;
+}
 
+// resume the pipelines of connections that were just unblocked
+static void process_unblocked() {
+  while (!g_data.unblocked.empty()) {
+    Conn* conn = g_data.unblocked.back();
+    g_data.unblocked.pop_back();
+    handle_requests(conn);
+    if (conn->want_close) {
+      conn_destroy(conn);
+    }
+  }
+}
+
+static int listen_tcp(uint16_t port) {
   int fd = socket(AF_INET, SOCK_STREAM, 0);  // get socket fd
   if (fd < 0) die("socket()");
   int val = 1;
@@ -786,7 +4891,7 @@ int main() {
   struct sockaddr_in addr = {};  // address to bind to the socket that the
                                  // server will listen on
   addr.sin_family = AF_INET;
-  addr.sin_port = htons(1234);
+  addr.sin_port = htons(port);
   addr.sin_addr.s_addr = htonl(0);
   if (bind(fd, (const struct sockaddr*)&addr,
            sizeof(addr)) < 0) {  // // binds the socket to this address
@@ -797,18 +4902,201 @@ int main() {
                                     // incoming connections
     die("listen()");
   }
+  return fd;
+}
+
+// Co-located clients skip the TCP stack. Who may connect is set by the
+// permissions of the socket file, which exist from the moment it is bound.
+static int listen_unix(const char* path, mode_t perm) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) die("socket()");
+  fd_set_nonblock(fd);
+  // left by a previous run
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    (void)unlink(path);
+  }
+  mode_t mask = umask(~perm & 0777);
+  int rv = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if (rv < 0) die("bind()");
+  if (listen(fd, SOMAXCONN) < 0) die("listen()");
+  return fd;
+}
+
+int main(int argc, char** argv) {
+  const char* logfile = NULL;
+  int loglevel = LOG_INFO;
+  const char* static_path = NULL;
+  uint16_t port = 1234;  // 0 is no TCP listener
+  const char* unix_path = NULL;
+  mode_t unix_perm = 0700;
+  const char* cluster_spec = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strcmp(argv[i], "--zset-arena")) {
+      g_data.zset_arena = true;
+    } else if (0 == strcmp(argv[i], "--expire-budget-us") && i + 1 < argc) {
+      g_data.expiry.budget_us = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--config") && i + 1 < argc) {
+      // settings from the file; options after it override them
+      std::string err;
+      if (!config_load(argv[++i], g_config_vars, k_config_nvars, err)) {
+        fprintf(stderr, "--config %s\n", err.c_str());
+        return 1;
+      }
+    } else if (0 == strcmp(argv[i], "--dbfile") && i + 1 < argc) {
+      g_data.snapshot.path = argv[++i];
+    } else if (0 == strcmp(argv[i], "--appendonly")) {
+      g_data.aof.enabled = true;
+    } else if (0 == strcmp(argv[i], "--appendfile") && i + 1 < argc) {
+      g_data.aof.path = argv[++i];
+    } else if (0 == strcmp(argv[i], "--appendfsync") && i + 1 < argc &&
+               aof_parse_fsync(argv[i + 1], g_data.aof.fsync)) {
+      i++;
+    } else if (0 == strcmp(argv[i], "--auto-aof-rewrite-percentage") &&
+               i + 1 < argc) {
+      g_data.aof.auto_pct = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--auto-aof-rewrite-min-size") &&
+               i + 1 < argc) {
+      g_data.aof.auto_min_size = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--checkpoint-secs") && i + 1 < argc) {
+      g_data.checkpoint.secs = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--checkpoint-max-deltas") &&
+               i + 1 < argc) {
+      g_data.checkpoint.max_deltas = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--port") && i + 1 < argc) {
+      port = (uint16_t)strtoul(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--unixsocket") && i + 1 < argc &&
+               strlen(argv[i + 1]) < sizeof(sockaddr_un::sun_path)) {
+      unix_path = argv[++i];
+    } else if (0 == strcmp(argv[i], "--unixsocketperm") && i + 1 < argc) {
+      unix_perm = (mode_t)strtoul(argv[++i], NULL, 8) & 0777;
+    } else if (0 == strcmp(argv[i], "--replicaof") && i + 2 < argc) {
+      g_data.repl.host = argv[++i];
+      g_data.repl.port = (uint16_t)strtoul(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--cluster") && i + 1 < argc) {
+      cluster_spec = argv[++i];
+    } else if (0 == strcmp(argv[i], "--repl-backlog-size") && i + 1 < argc) {
+      g_data.repl.backlog_size = strtoull(argv[++i], NULL, 10);
+    } else if (0 == strcmp(argv[i], "--static") && i + 1 < argc) {
+      static_path = argv[++i];
+    } else if (0 == strcmp(argv[i], "--logfile") && i + 1 < argc) {
+      logfile = argv[++i];
+    } else if (0 == strcmp(argv[i], "--loglevel") && i + 1 < argc &&
+               log_parse_level(argv[i + 1], loglevel)) {
+      i++;
+    } else {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (!log_init(logfile, loglevel)) {
+    die("log_init()");
+  }
+  dlist_init(&g_data.idle_list);
+  dlist_init(&g_data.io_list);
+  if (static_path && g_data.aof.enabled) {
+    fprintf(stderr, "--static is read-only, it excludes --appendonly\n");
+    return 1;
+  }
+  if (g_data.checkpoint.secs > 0 && g_data.aof.enabled) {
+    fprintf(stderr, "--checkpoint-secs excludes --appendonly\n");
+    return 1;
+  }
+  struct in_addr primary = {};
+  if (!g_data.repl.host.empty() &&
+      (static_path || g_data.aof.enabled || g_data.checkpoint.secs > 0 ||
+       inet_pton(AF_INET, g_data.repl.host.c_str(), &primary) != 1)) {
+    fprintf(stderr,
+            "--replicaof takes an IPv4 address and a port, and excludes "
+            "--static, --appendonly and --checkpoint-secs\n");
+    return 1;
+  }
+  if (port == 0 && !unix_path) {
+    fprintf(stderr, "--port 0 needs --unixsocket\n");
+    return 1;
+  }
+  g_data.repl.id = repl_new_id();
+  g_data.stats.start_ms = get_monotonic_msec();
+  g_data.stats.port = port;
+  if (cluster_spec && !cluster_open(cluster_spec, port)) {
+    fprintf(stderr,
+            "--cluster takes host:port,host:port,... with one node at "
+            "--port\n");
+    return 1;
+  }
+  // nothing is loaded, the pages are read on demand
+  if (static_path && !static_open(static_path)) {
+    die("static_open()");
+  }
+  // with the log on, it has the whole keyspace and the snapshot is ignored
+  const char* aof_path = g_data.aof.path.c_str();
+  bool aof_exists = g_data.aof.enabled && access(aof_path, F_OK) == 0;
+  g_data.loading = true;
+  if (aof_exists && !aof_load(aof_path)) {
+    die("aof_load()");
+  }
+  if (!static_path && !aof_exists &&
+      !snapshot_load(g_data.snapshot.path.c_str())) {
+    die("snapshot_load()");
+  }
+  if (g_data.checkpoint.secs > 0 && !checkpoint_load()) {
+    die("checkpoint_load()");
+  }
+  g_data.loading = false;
+  if (g_data.aof.enabled) {
+    // a new log starts with a snapshot of what is loaded
+    SnapStats stats;
+    snapshot_stamp();
+    if (!aof_exists &&
+        !snapshot_write(tmp_path(g_data.aof.path), aof_path, stats)) {
+      die("snapshot_write()");
+    }
+    if (!aof_open(aof_path, g_data.aof.fsync)) {
+      die("aof_open()");
+    }
+  }
+
+  // a unix socket client that goes away fails the write with EPIPE
+  signal(SIGPIPE, SIG_IGN);
+  // the listening sockets go first in poll_args
+  std::vector<int> listen_fds;
+  if (port != 0) {
+    listen_fds.push_back(listen_tcp(port));
+  }
+  if (unix_path) {
+    listen_fds.push_back(listen_unix(unix_path, unix_perm));
+  }
 
   // event loop
   std::vector<struct pollfd> poll_args;
   while (true) {
+    // the log is written before any reply that depends on it
+    if (!aof_flush()) {
+      die("aof_flush()");
+    }
+    repl_pump();
     // prepare poll args
     poll_args.clear();
-    // put the listening socket in first position
-    struct pollfd pfd = {fd, POLLIN, 0};
-    poll_args.push_back(pfd);
+    // put the listening sockets in first position
+    for (int fd : listen_fds) {
+      poll_args.push_back({fd, POLLIN, 0});
+    }
     // the rest are connection sockets
     for (Conn* conn : g_data.fd2conn) {
       if (!conn) continue;
+      if (conn->write_deferred) {
+        conn->write_deferred = false;
+        handle_write(conn);
+      }
+      if (conn->want_close) {
+        conn_destroy(conn);
+        continue;
+      }
       struct pollfd pfd = {conn->fd, 0, 0};
       // poll() flags depending on application intent
       if (conn->want_read) {
@@ -825,19 +5113,17 @@ int main() {
     if (rv < 0 && errno == EINTR) continue;
     if (rv < 0) die("poll()");
 
-    // handle listening socket
-    if (poll_args[0].revents & POLLIN) {
-      if (Conn* conn = handle_accept(fd)) {
-        // add into mapping of fd to Conn
-        if (g_data.fd2conn.size() <= (size_t)conn->fd) {
-          g_data.fd2conn.resize(2 * conn->fd);
+    // handle listening sockets
+    for (size_t i = 0; i < listen_fds.size(); i++) {
+      if (poll_args[i].revents & POLLIN) {
+        if (Conn* conn = handle_accept(listen_fds[i])) {
+          conn_register(conn);
         }
-        g_data.fd2conn[conn->fd] = conn;
       }
     }
 
     // handle connection sockets
-    for (size_t i = 1; i < poll_args.size(); i++) {
+    for (size_t i = listen_fds.size(); i < poll_args.size(); i++) {
       uint32_t ready = poll_args[i].revents;
       if (ready == 0) {
         continue;
@@ -854,6 +5140,7 @@ int main() {
       }
     }
     process_timers();
+    process_unblocked();
   }
 
   return 0;
@@ -0,0 +1,235 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+constexpr size_t k_snap_flush = 64 * 1024;
+
+static uint32_t g_crc_table[256];
+
+static void crc32c_init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));  // Castagnoli
+    }
+    g_crc_table[i] = crc;
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t len) {
+  if (g_crc_table[1] == 0) {
+    crc32c_init_table();
+  }
+  for (size_t i = 0; i < len; i++) {
+    crc = g_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const uint8_t* data, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word = 0;
+    memcpy(&word, data, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; len > 0; data++, len--) {
+    crc = __builtin_ia32_crc32qi(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  if (has_sse42) {
+    return ~crc32c_hw(crc, data, len);
+  }
+#endif
+  return ~crc32c_sw(crc, data, len);
+}
+
+static void snap_flush(SnapWriter* w) {
+  if (w->fd < 0 || w->data.empty()) {
+    return;
+  }
+  if (!w->failed &&
+      write_all(w->fd, (uint8_t*)w->data.data(), w->data.size()) < 0) {
+    w->failed = true;
+  }
+  w->data.clear();
+}
+
+void snap_put(SnapWriter* w, const void* data, size_t len) {
+  w->crc = crc32c(w->crc, (const uint8_t*)data, len);
+  w->data.append((const char*)data, len);
+  w->nbytes += len;
+  if (w->data.size() >= k_snap_flush) {
+    snap_flush(w);
+  }
+}
+
+void snap_put_u8(SnapWriter* w, uint8_t val) { snap_put(w, &val, 1); }
+void snap_put_u64(SnapWriter* w, uint64_t val) { snap_put(w, &val, 8); }
+void snap_put_dbl(SnapWriter* w, double val) { snap_put(w, &val, 8); }
+
+void snap_put_varint(SnapWriter* w, uint64_t val) {
+  uint8_t buf[10];
+  size_t n = 0;
+  do {
+    buf[n] = (uint8_t)(val & 0x7f);
+    val >>= 7;
+    buf[n++] |= val ? 0x80 : 0;
+  } while (val);
+  snap_put(w, buf, n);
+}
+
+void snap_put_str(SnapWriter* w, const char* s, size_t len) {
+  snap_put_varint(w, len);
+  snap_put(w, s, len);
+}
+
+void snap_begin(SnapWriter* w, uint64_t nkeys, uint64_t created_ms) {
+  snap_put(w, k_snap_magic, sizeof(k_snap_magic));
+  snap_put_u64(w, nkeys);
+  snap_put_u64(w, created_ms);
+}
+
+bool snap_end(SnapWriter* w) {
+  snap_put_u8(w, k_snap_eof);
+  uint32_t crc = w->crc;
+  w->data.append((const char*)&crc, 4);  // not part of the checksum
+  w->nbytes += 4;
+  snap_flush(w);
+  return !w->failed;
+}
+
+static bool snap_need(SnapReader* r, size_t n) {
+  if (!r->ok || (size_t)(r->end - r->cur) < n) {
+    r->ok = false;
+    return false;
+  }
+  return true;
+}
+
+uint8_t snap_get_u8(SnapReader* r) {
+  return snap_need(r, 1) ? *r->cur++ : 0;
+}
+
+uint64_t snap_get_u64(SnapReader* r) {
+  uint64_t val = 0;
+  if (snap_need(r, 8)) {
+    memcpy(&val, r->cur, 8);
+    r->cur += 8;
+  }
+  return val;
+}
+
+double snap_get_dbl(SnapReader* r) {
+  double val = 0;
+  if (snap_need(r, 8)) {
+    memcpy(&val, r->cur, 8);
+    r->cur += 8;
+  }
+  return val;
+}
+
+uint64_t snap_get_varint(SnapReader* r) {
+  uint64_t val = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (!snap_need(r, 1)) {
+      return 0;
+    }
+    uint8_t byte = *r->cur++;
+    val |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return val;
+    }
+  }
+  r->ok = false;  // too long
+  return 0;
+}
+
+const char* snap_get_str(SnapReader* r, size_t& len) {
+  len = (size_t)snap_get_varint(r);
+  if (!snap_need(r, len)) {
+    return NULL;
+  }
+  const char* s = (const char*)r->cur;
+  r->cur += len;
+  return s;
+}
+
+bool snap_open(SnapReader* r, const uint8_t* data, size_t size,
+               uint64_t& nkeys, uint64_t& created_ms) {
+  if (size < k_snap_header_size + 1 + 4 ||
+      0 != memcmp(data, k_snap_magic, sizeof(k_snap_magic))) {
+    return false;
+  }
+  r->begin = data;
+  r->cur = data + sizeof(k_snap_magic);
+  r->end = data + size;
+  r->ok = true;
+  nkeys = snap_get_u64(r);
+  created_ms = snap_get_u64(r);
+  return r->ok;
+}
+
+bool snap_verify(SnapReader* r) {
+  if (!r->ok || r->cur == r->begin || r->cur[-1] != k_snap_eof ||
+      !snap_need(r, 4)) {
+    return false;
+  }
+  uint32_t crc = 0;
+  memcpy(&crc, r->cur, 4);
+  r->ok = crc == crc32c(0, r->begin, (size_t)(r->cur - r->begin));
+  r->cur += 4;
+  return r->ok;
+}
+
+uint8_t snap_skip(SnapReader* r) {
+  uint8_t type = snap_get_u8(r);
+  if (!r->ok || type == k_snap_eof) {
+    return type;
+  }
+  if (type & k_snap_ttl) {
+    snap_get_u64(r);
+  }
+  size_t len = 0;
+  snap_get_str(r, len);  // key
+  switch (type & ~k_snap_ttl) {
+    case k_snap_str:
+      snap_get_str(r, len);
+      break;
+    case k_snap_zset:
+      for (uint64_t n = snap_get_varint(r); n > 0 && r->ok; n--) {
+        snap_get_dbl(r);
+        snap_get_str(r, len);
+      }
+      break;
+    case k_snap_del:
+      break;
+    default:
+      r->ok = false;
+  }
+  return type;
+}
+
+bool snap_commit(int fd, const char* tmp, const char* path) {
+  bool ok = fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || (path && rename(tmp, path) != 0)) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
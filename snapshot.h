@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// Binary snapshot encoding.
+//
+// +-------+-------+------------+---------+-----+---------+------+--------+
+// | magic | nkeys | created_ms | record1 | ... | recordn | 0xff | crc32c |
+// +-------+-------+------------+---------+-----+---------+------+--------+
+//
+// Integers are little-endian; lengths and counts are LEB128 varints. Each
+// record is a type byte, an optional wall-clock expiry in ms (when the type
+// has k_snap_ttl set), the key, then the value:
+//   k_snap_str:  len, bytes
+//   k_snap_zset: count, then count x (score as f64, len, name) in order
+//   k_snap_del:  none; the key was deleted (in a checkpoint delta only)
+// The CRC32C covers everything before it. A snapshot is self-delimiting, so
+// it can also start a longer file.
+
+constexpr char k_snap_magic[8] = {'K', 'V', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr size_t k_snap_header_size = 8 + 8 + 8;
+constexpr uint8_t k_snap_str = 1;
+constexpr uint8_t k_snap_zset = 2;
+constexpr uint8_t k_snap_del = 3;
+constexpr uint8_t k_snap_ttl = 0x80;  // flag on the type byte
+constexpr uint8_t k_snap_eof = 0xff;
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len);
+
+// Writes either to a file (fd >= 0), flushing every 64K, or into `data`.
+struct SnapWriter {
+  int fd = -1;
+  std::string data;
+  uint32_t crc = 0;
+  uint64_t nbytes = 0;
+  bool failed = false;
+};
+
+void snap_put(SnapWriter* w, const void* data, size_t len);
+void snap_put_u8(SnapWriter* w, uint8_t val);
+void snap_put_u64(SnapWriter* w, uint64_t val);
+void snap_put_dbl(SnapWriter* w, double val);
+void snap_put_varint(SnapWriter* w, uint64_t val);
+void snap_put_str(SnapWriter* w, const char* s, size_t len);
+void snap_begin(SnapWriter* w, uint64_t nkeys, uint64_t created_ms);
+bool snap_end(SnapWriter* w);  // trailer and final flush
+
+// Bounds-checked decoding; `ok` turns false on the first overrun.
+struct SnapReader {
+  const uint8_t* begin = NULL;
+  const uint8_t* cur = NULL;
+  const uint8_t* end = NULL;
+  bool ok = true;
+};
+
+uint8_t snap_get_u8(SnapReader* r);
+uint64_t snap_get_u64(SnapReader* r);
+double snap_get_dbl(SnapReader* r);
+uint64_t snap_get_varint(SnapReader* r);
+const char* snap_get_str(SnapReader* r, size_t& len);
+// validate the magic; positions the reader at the first record
+bool snap_open(SnapReader* r, const uint8_t* data, size_t size,
+               uint64_t& nkeys, uint64_t& created_ms);
+// after the eof byte: check the CRC, leaving the reader past the snapshot
+bool snap_verify(SnapReader* r);
+// step over a record without decoding it; returns its type byte, which is
+// k_snap_eof at the end
+uint8_t snap_skip(SnapReader* r);
+
+// atomically replace `path` with the snapshot in `tmp`; with a NULL `path`
+// `tmp` is only made durable
+bool snap_commit(int fd, const char* tmp, const char* path);
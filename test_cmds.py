@@ -68,11 +68,261 @@ $ ./client zqueryr zset 2 n2 1 4
 $ ./client zqueryr zset 2 n2 2 4
 (arr) len=0
 (arr) end
+$ ./client zadd zs2 3 n2
+(int) 1
+$ ./client zadd zs2 4 n3
+(int) 1
+$ ./client zunion 2 zset zs2
+(arr) len=6
+(str) n1
+(dbl) 1.1
+(str) n3
+(dbl) 4
+(str) n2
+(dbl) 5
+(arr) end
+$ ./client zinter 2 zset zs2 weights 2 1 aggregate max
+(arr) len=2
+(str) n2
+(dbl) 4
+(arr) end
+$ ./client zinter 2 zset missing
+(arr) len=0
+(arr) end
+$ ./client zunionstore zdst 2 zset zs2 aggregate min
+(int) 3
+$ ./client zquery zdst 1 "" 0 10
+(arr) len=6
+(str) n1
+(dbl) 1.1
+(str) n2
+(dbl) 2
+(str) n3
+(dbl) 4
+(arr) end
+$ ./client zinterstore zdst 2 zdst zs2
+(int) 2
+$ ./client zscore zdst n3
+(dbl) 8
+$ ./client zunion 3 zset zs2
+(err) 4 bad numkeys
+$ ./client zadd zpop 1 a
+(int) 1
+$ ./client zadd zpop 2 b
+(int) 1
+$ ./client zadd zpop 3 c
+(int) 1
+$ ./client zpopmax zpop
+(arr) len=2
+(str) c
+(dbl) 3
+(arr) end
+$ ./client zpopmin zpop 5
+(arr) len=4
+(str) a
+(dbl) 1
+(str) b
+(dbl) 2
+(arr) end
+$ ./client zadd zpop 4 d
+(int) 1
+$ ./client zadd zpop 5 e
+(int) 1
+$ ./client zpopmin zpop -1
+(err) 4 count is negative
+$ ./client zpopmin zpop 9223372036854775807
+(arr) len=4
+(str) d
+(dbl) 4
+(str) e
+(dbl) 5
+(arr) end
+$ ./client bzpopmin zpop zs2 1
+(arr) len=3
+(str) zs2
+(str) n2
+(dbl) 3
+(arr) end
+$ ./client bzpopmax zpop 0.1
+(nil)
+$ ./client zrangebyrank zdst 0 0
+(arr) len=2
+(str) n2
+(dbl) 5
+(arr) end
+$ ./client zrangebyrank zdst -1 -1
+(arr) len=2
+(str) n3
+(dbl) 8
+(arr) end
+$ ./client zrangebyrank zdst 1 0
+(arr) len=0
+(arr) end
+$ ./client zquantile zdst 0 0.5 1
+(arr) len=6
+(str) n2
+(dbl) 5
+(str) n3
+(dbl) 8
+(str) n3
+(dbl) 8
+(arr) end
+$ ./client zquantile zdst 2
+(err) 4 expect quantile in [0, 1]
+$ ./client zrandmember zdst 5
+(arr) len=4
+(str) n2
+(dbl) 5
+(str) n3
+(dbl) 8
+(arr) end
+$ ./client zrandmember zdst -100000000000
+(err) 2 count out of range
+$ ./client zrandmember zdst -9223372036854775808
+(err) 2 count out of range
+$ ./client zrandmember missing
+(arr) len=0
+(arr) end
+$ ./client set gone v
+(nil)
+$ ./client pexpire gone 0
+(int) 1
+$ ./client get gone
+(nil)
+$ ./client pttl gone
+(int) -2
+$ ./client set sk v1 px 100000 nx
+(int) 1
+$ ./client set sk v2 nx
+(int) 0
+$ ./client set sk v2 xx get keepttl
+(str) v1
+$ ./client set sk v3
+(nil)
+$ ./client pttl sk
+(int) -1
+$ ./client set sk v4 ex 0
+(err) 4 invalid expire time
+$ ./client set sk v4 nx xx
+(err) 4 syntax error
+$ ./client getex sk px 50000
+(str) v3
+$ ./client getex sk persist
+(str) v3
+$ ./client pttl sk
+(int) -1
+$ ./client getdel sk
+(str) v3
+$ ./client get sk
+(nil)
+$ ./client set sk v5 get
+(nil)
+$ ./client set zset v get
+(err) 3 a non-string value exists
+$ ./client pexpireat sk 4102444800000
+(int) 1
+$ ./client getex sk persist
+(str) v5
+$ ./client pexpireat sk 1
+(int) 1
+$ ./client get sk
+(nil)
+$ ./client pexpireat sk 1
+(int) 0
+$ ./client bgrewriteaof
+(err) 4 append-only log is off
+$ ./client checkpoint
+(err) 4 checkpoints are off
+$ ./client replicaof no one
+(nil)
+$ ./client replicaof localhost 1234
+(err) 4 expect an IPv4 address and a port
+$ ./client replconf sync
+(err) 4 expect ack or ping
+$ ./client cluster keyslot foo
+(int) 12182
+$ ./client cluster keyslot {user1000}.following
+(int) 3443
+$ ./client cluster slots
+(err) 4 cluster mode is off
+$ ./client cluster setslot 1 stable
+(err) 4 cluster mode is off
+$ ./client asking
+(nil)
+$ ./client restore junk
+(err) 4 bad payload
+$ ./client migrate 127.0.0.1 1 100 missing
+(int) 0
+$ ./client migrate localhost 1 100 missing
+(err) 4 expect an IPv4 address and a port
+$ ./client ping
+(str) PONG
+$ ./client ping hi
+(str) hi
+$ ./client hello 3
+(err) 4 expect a RESP connection
+$ ./client --batch set bk 1 ; get bk ; zadd bk 1 x ; bzpopmin bk 0 ; del bk
+(arr) len=5
+(nil)
+(str) 1
+(err) 3 expect zset
+(err) 4 not allowed in a batch
+(int) 1
+(arr) end
+$ ./client --batch get bk
+(arr) len=1
+(nil)
+(arr) end
+$ ./client client list
+(err) 4 unknown subcommand
+$ ./client config get max-args
+(arr) len=2
+(str) max-args
+(int) 200000
+(arr) end
+$ ./client config set max-args 0
+(err) 4 max-args is in [1, 200000]
+$ ./client config set rehashing-work 64
+(nil)
+$ ./client config get rehash*
+(arr) len=2
+(str) rehashing-work
+(int) 64
+(arr) end
+$ ./client config set rehashing-work 128
+(nil)
+$ ./client config set nosuch 1
+(err) 4 unknown setting nosuch
+$ ./client config get latency-sample
+(arr) len=2
+(str) latency-sample
+(int) 16
+(arr) end
+$ ./client info nosuch
+(err) 4 unknown section
+$ ./client bzpopmin dupk dupk 0 &
+(arr) len=3
+(str) dupk
+(str) a
+(dbl) 1
+(arr) end
+$ ./client zadd dupsrc 1 a
+(int) 1
+$ ./client zadd dupsrc 2 b
+(int) 1
+$ ./client zunionstore dupk 1 dupsrc
+(int) 2
+$ ./client zrangebyrank dupk 0 -1
+(arr) len=2
+(str) b
+(dbl) 2
+(arr) end
 '''
 
 
 import shlex
 import subprocess
+import time
 
 cmds = []
 outputs = []
@@ -87,7 +337,333 @@ for x in lines:
     else:
         outputs[-1] = outputs[-1] + x + '\n'
 
+# a command ending in '&' runs in the background, blocked while the ones
+# after it run; its output is checked at the end
 assert len(cmds) == len(outputs)
+background = []
 for cmd, expect in zip(cmds, outputs):
+    if cmd.endswith(' &'):
+        proc = subprocess.Popen(shlex.split(cmd[:-2]), stdout=subprocess.PIPE)
+        background.append((cmd, proc, expect))
+        time.sleep(0.2)
+        continue
     out = subprocess.check_output(shlex.split(cmd)).decode('utf-8')
     assert out == expect, f'cmd:{cmd} out:{out} expect:{expect}'
+for cmd, proc, expect in background:
+    out = proc.communicate(timeout=5)[0].decode('utf-8')
+    assert out == expect, f'cmd:{cmd} out:{out} expect:{expect}'
+
+
+# restore payloads that a client built: the checksum is right, the zset
+# is not
+import socket
+import struct
+
+
+def crc32c(data):
+    crc = 0xffffffff
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1))
+    return crc ^ 0xffffffff
+
+
+def snap_zset(key, members):
+    body = b'KVSNAP01' + struct.pack('<QQ', 1, 0)
+    body += bytes([2, len(key)]) + key + bytes([len(members)])
+    for score, name in members:
+        body += struct.pack('<d', score) + bytes([len(name)]) + name
+    body += b'\xff'
+    return body + struct.pack('<I', crc32c(body))
+
+
+def cmd_body(args):
+    body = struct.pack('<I', len(args))
+    for a in args:
+        body += struct.pack('<I', len(a)) + a
+    return body
+
+
+def request(body, port=1234):
+    with socket.create_connection(('127.0.0.1', port)) as s:
+        s.sendall(struct.pack('<I', len(body)) + body)
+        reply = bytearray()
+        while len(reply) < 4 or len(reply) < 4 + struct.unpack('<I', reply[:4])[0]:
+            data = s.recv(1 << 20)
+            if not data:
+                raise Exception('connection closed')
+            reply += data
+    return bytes(reply[4:])
+
+
+def call(*args, port=1234):
+    return request(cmd_body(args), port)
+
+
+bad_payloads = [
+    snap_zset(b'rz', [(1, b'a'), (2, b'a')]),
+    snap_zset(b'rz', [(float('nan'), b'a')]),
+]
+for payload in bad_payloads:
+    reply = call(b'restore', payload)
+    assert reply[0] == 1 and b'bad payload' in reply, reply
+assert call(b'zscore', b'rz', b'a') == b'\x00'
+assert call(b'restore', snap_zset(b'rz', [(1, b'a'), (2, b'b')])) == \
+    b'\x03' + struct.pack('<q', 1)
+assert call(b'zrem', b'rz', b'a') == b'\x03' + struct.pack('<q', 1)
+assert call(b'zscore', b'rz', b'a') == b'\x00'
+assert call(b'del', b'rz') == b'\x03' + struct.pack('<q', 1)
+
+
+# RESP: a nil that means success is +OK, and an error stays on one line
+def resp_call(*args):
+    req = b'*%d\r\n' % len(args)
+    for a in args:
+        req += b'$%d\r\n%s\r\n' % (len(a), a)
+    with socket.create_connection(('127.0.0.1', 1234)) as s:
+        s.sendall(req)
+        reply = b''
+        while not reply.endswith(b'\r\n'):
+            reply += s.recv(4096)
+    return reply
+
+
+assert resp_call(b'SET', b'respk', b'v') == b'+OK\r\n'
+assert resp_call(b'set', b'respk', b'w', b'get') == b'$1\r\nv\r\n'
+assert resp_call(b'config', b'set', b'x\r\n+OK', b'1') == \
+    b'-ERR unknown setting x  +OK\r\n'
+assert resp_call(b'del', b'respk') == b':1\r\n'
+# only the reply of a command that succeeded is +OK, in a pipeline too
+with socket.create_connection(('127.0.0.1', 1234)) as s:
+    s.sendall(b'SET respk v\r\nSET respk w NX\r\nGET respnone\r\n'
+              b'DEL respk\r\n')
+    reply = b''
+    while reply.count(b'\r\n') < 4:
+        reply += s.recv(4096)
+assert reply == b'+OK\r\n:0\r\n$-1\r\n:1\r\n', reply
+
+
+# a batch reply stops short of the message limit
+def batch_call(*cmds):
+    body = struct.pack('<I', len(cmds) | 1 << 31)
+    for args in cmds:
+        body += cmd_body(args)
+    return request(body)
+
+
+big = b'x' * (12 << 20)
+assert call(b'set', b'bigk', big) == b'\x00'
+reply = batch_call(*[[b'get', b'bigk']] * 4)
+assert reply[:5] == b'\x05' + struct.pack('<I', 4)
+elem = b'\x02' + struct.pack('<I', len(big)) + big
+err = b'\x01' + struct.pack('<II', 2, 19) + b'batch reply too big'
+assert reply[5:] == elem * 2 + err * 2
+assert call(b'del', b'bigk') == b'\x03' + struct.pack('<q', 1)
+
+
+# only the names the server dispatches get an entry in commandstats
+assert call(b'nosuchcmd', b'k')[0] == 1
+assert b'nosuchcmd' not in call(b'info', b'commandstats')
+
+
+# servers of their own, in a scratch directory, for the tests that log
+# writes or restart
+import os
+import tempfile
+
+SERVER = os.path.abspath('server')
+
+
+def start_server(dir, port, *opts):
+    proc = subprocess.Popen([SERVER, '--port', str(port), *opts], cwd=dir,
+                            stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            return proc
+        except OSError:
+            time.sleep(0.05)
+    raise Exception(f'server on {port} did not start')
+
+
+def stop_server(proc):
+    proc.terminate()
+    proc.wait()
+
+
+# writes with no arguments, when they are logged
+for opts in [['--appendonly'], ['--checkpoint-secs', '60']]:
+    with tempfile.TemporaryDirectory() as dir:
+        proc = start_server(dir, 1235, *opts)
+        for name in [b'del', b'zadd', b'bzpopmin', b'bzpopmax', b'pexpire',
+                     b'set', b'getex', b'zunionstore', b'restore']:
+            assert call(name, port=1235)[0] == 1, name
+        assert call(b'bzpopmin', b'k', port=1235)[0] == 1
+        assert call(b'ping', port=1235) == b'\x02\x04\x00\x00\x00PONG'
+        stop_server(proc)
+
+# a replica refuses to migrate keys away
+with tempfile.TemporaryDirectory() as dir:
+    proc = start_server(dir, 1235, '--replicaof', '127.0.0.1', '1')
+    reply = call(b'migrate', b'127.0.0.1', b'1234', b'100', b'k', port=1235)
+    assert reply[:5] == b'\x01' + struct.pack('<I', 5), reply
+    stop_server(proc)
+
+# the log is flushed before the server dies
+with tempfile.TemporaryDirectory() as dir:
+    with open(os.path.join(dir, 'dump.kvs'), 'wb') as f:
+        f.write(b'garbage')
+    proc = subprocess.run([SERVER, '--port', '1235'], cwd=dir,
+                          stderr=subprocess.PIPE, timeout=5)
+    assert proc.returncode != 0
+    assert b'bad file or checksum' in proc.stderr, proc.stderr
+
+
+# persistence: a server restarted in the same directory has the same data
+def parse(d, i=0):
+    tag = d[i]
+    i += 1
+    if tag == 0:
+        return None, i
+    if tag == 1:
+        code, n = struct.unpack_from('<II', d, i)
+        return ('err', code, d[i + 8:i + 8 + n]), i + 8 + n
+    if tag == 2:
+        n, = struct.unpack_from('<I', d, i)
+        return d[i + 4:i + 4 + n], i + 4 + n
+    if tag == 3:
+        return struct.unpack_from('<q', d, i)[0], i + 8
+    if tag == 4:
+        return struct.unpack_from('<d', d, i)[0], i + 8
+    n, = struct.unpack_from('<I', d, i)
+    i += 4
+    vals = []
+    for _ in range(n):
+        v, i = parse(d, i)
+        vals.append(v)
+    return vals, i
+
+
+def value(*args, port=1235):
+    return parse(call(*args, port=port))[0]
+
+
+def wait_for(cond, what):
+    for _ in range(200):
+        if cond():
+            return
+        time.sleep(0.05)
+    raise Exception(f'timed out waiting for {what}')
+
+
+def fill():
+    assert value(b'set', b'k', b'v') is None
+    assert value(b'set', b't', b'v', b'px', b'100000') is None
+    assert value(b'zadd', b'z', b'1.5', b'a') == 1
+    assert value(b'set', b'gone', b'v') is None
+    assert value(b'del', b'gone') == 1
+
+
+def check():
+    assert value(b'get', b'k') == b'v'
+    assert 0 < value(b'pttl', b't') <= 100000
+    assert value(b'zscore', b'z', b'a') == 1.5
+    assert value(b'get', b'gone') is None
+
+
+# save, and bgsave once the child has renamed its file
+for save in [b'save', b'bgsave']:
+    with tempfile.TemporaryDirectory() as dir:
+        dump = os.path.join(dir, 'dump.kvs')
+        proc = start_server(dir, 1235)
+        fill()
+        assert value(save) is None
+        wait_for(lambda: os.path.exists(dump), 'the snapshot')
+        stop_server(proc)
+        proc = start_server(dir, 1235)
+        check()
+        stop_server(proc)
+
+# the log is replayed, before and after a rewrite
+with tempfile.TemporaryDirectory() as dir:
+    aof = os.path.join(dir, 'appendonly.aof')
+    opts = ['--appendonly', '--appendfsync', 'always']
+    proc = start_server(dir, 1235, *opts)
+    fill()
+    stop_server(proc)
+    proc = start_server(dir, 1235, *opts)
+    check()
+    for i in range(100):
+        assert value(b'set', b'k', b'%d' % i) is None
+    size = os.path.getsize(aof)
+    assert value(b'bgrewriteaof') is None
+    # save is refused while a child runs; the snapshot is not read back
+    wait_for(lambda: value(b'save') is None, 'the rewrite')
+    assert os.path.getsize(aof) < size
+    assert value(b'set', b'k', b'v') is None
+    assert value(b'zadd', b'z', b'2', b'b') == 1
+    stop_server(proc)
+    proc = start_server(dir, 1235, *opts)
+    check()
+    assert value(b'zscore', b'z', b'b') == 2
+    stop_server(proc)
+
+# a base snapshot and the deltas written after it
+with tempfile.TemporaryDirectory() as dir:
+    opts = ['--checkpoint-secs', '3600']
+    proc = start_server(dir, 1235, *opts)
+    assert value(b'set', b'gone', b'v') is None
+    assert value(b'set', b'k', b'old') is None
+    assert value(b'save') is None
+    fill()
+    assert value(b'checkpoint') is None
+    wait_for(lambda: any('.delta.' in f and '.tmp.' not in f
+                         for f in os.listdir(dir)), 'the delta')
+    stop_server(proc)
+    proc = start_server(dir, 1235, *opts)
+    check()
+    stop_server(proc)
+
+
+# a replica: a full sync, then the write stream; it refuses writes
+with tempfile.TemporaryDirectory() as pdir, \
+        tempfile.TemporaryDirectory() as rdir:
+    primary = start_server(pdir, 1235)
+    fill()
+    replica = start_server(rdir, 1236, '--replicaof', '127.0.0.1', '1235')
+    wait_for(lambda: value(b'get', b'k', port=1236) == b'v', 'the sync')
+    assert value(b'zscore', b'z', b'a', port=1236) == 1.5
+    assert value(b'zadd', b'z', b'2', b'b') == 1
+    assert value(b'zadd')[0] == 'err'  # not sent on
+    assert value(b'del', b'k') == 1
+    wait_for(lambda: value(b'get', b'k', port=1236) is None, 'the stream')
+    assert value(b'zscore', b'z', b'b', port=1236) == 2
+    assert value(b'set', b'k', b'v', port=1236)[:2] == ('err', 5)
+    stop_server(replica)
+    stop_server(primary)
+
+# two cluster nodes; foo is in slot 12182, of the second one
+with tempfile.TemporaryDirectory() as dir:
+    spec = '127.0.0.1:1235,127.0.0.1:1236'
+    nodes = [start_server(dir, port, '--cluster', spec)
+             for port in [1235, 1236]]
+    assert value(b'set', b'foo', b'v') == \
+        ('err', 6, b'12182 127.0.0.1:1236')
+    assert value(b'set', b'foo', b'v', port=1236) is None
+    assert value(b'get', b'foo', port=1236) == b'v'
+    assert value(b'get', b'{user1000}.following', port=1236) == \
+        ('err', 6, b'3443 127.0.0.1:1235')
+    for proc in nodes:
+        stop_server(proc)
+
+
+# zset replies stop short of the message limit
+for i in range(40):
+    name = b'%02d' % i + b'x' * (1 << 20)
+    assert value(b'zadd', b'bigz', b'%d' % i, name, port=1234) == 1
+too_big = ('err', 2, b'reply too big')
+assert value(b'zrangebyrank', b'bigz', b'0', b'-1', port=1234) == too_big
+assert value(b'zunion', b'1', b'bigz', port=1234) == too_big
+assert len(value(b'zrangebyrank', b'bigz', b'0', b'9', port=1234)) == 20
+assert value(b'del', b'bigz', port=1234) == 1
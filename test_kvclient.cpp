@@ -0,0 +1,146 @@
+// Runs against a server on 127.0.0.1, port argv[1] or 1234.
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kvclient.h"
+
+static uint16_t g_port = 1234;
+
+static std::string reply_str(const KvReply& reply) {
+  KvValue v = kv_root(reply);
+  assert(kv_type(v) == KV_STR);
+  return std::string(kv_str(v));
+}
+
+// futures from several threads sharing a pool
+static void test_threads() {
+  KvClient* client = kv_connect("127.0.0.1", g_port, 4);
+  assert(client);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([client, t]() {
+      std::string key = "kvtest:" + std::to_string(t);
+      for (int i = 0; i < 200; i++) {
+        std::string val = std::to_string(i);
+        // the two may go out on different connections
+        KvReply set = kv_call(client, {"set", key, val}).get();
+        assert(kv_type(kv_root(set)) == KV_NIL);
+        assert(reply_str(kv_call(client, {"get", key}).get()) == val);
+      }
+      kv_call(client, {"del", key}).get();
+    });
+  }
+  for (std::thread& th : threads) {
+    th.join();
+  }
+  kv_close(client);
+}
+
+// callbacks on one connection run in request order
+static void test_order() {
+  KvClient* client = kv_connect("127.0.0.1", g_port, 1);
+  assert(client);
+  const int n = 1000;
+  int next = 0;
+  std::promise<void> done;
+  for (int i = 0; i < n; i++) {
+    std::string arg = std::to_string(i);
+    kv_call(client, {"ping", arg}, [&next, &done, i, n](KvValue v) {
+      assert(kv_type(v) == KV_STR);
+      assert(kv_str(v) == std::to_string(i));
+      assert(next == i);
+      if (++next == n) {
+        done.set_value();
+      }
+    });
+  }
+  done.get_future().get();
+  kv_close(client);
+}
+
+// a reply larger than one read()
+static void test_large() {
+  KvClient* client = kv_connect("127.0.0.1", g_port, 1);
+  assert(client);
+  std::string val(100 * 1024, 'x');
+  for (size_t i = 0; i < val.size(); i += 7) {
+    val[i] = 'a' + i % 26;
+  }
+  kv_call(client, {"set", "kvtest:large", val}).get();
+  assert(reply_str(kv_call(client, {"get", "kvtest:large"}).get()) == val);
+  kv_call(client, {"del", "kvtest:large"}).get();
+  kv_close(client);
+}
+
+static bool is_client_err(const KvReply& reply) {
+  KvValue v = kv_root(reply);
+  return kv_type(v) == KV_ERR && kv_err_code(v) == k_kv_err_client;
+}
+
+// a connection that drops fails the calls pending on it, and later ones
+static void test_failed_conn() {
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(lfd >= 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  assert(listen(lfd, 1) == 0);
+  socklen_t addrlen = sizeof(addr);
+  assert(getsockname(lfd, (struct sockaddr*)&addr, &addrlen) == 0);
+
+  KvClient* client = kv_connect("127.0.0.1", ntohs(addr.sin_port), 1);
+  assert(client);
+  std::vector<std::future<KvReply>> pending;
+  for (int i = 0; i < 3; i++) {
+    pending.push_back(kv_call(client, {"get", "k"}));
+  }
+  int fd = accept(lfd, NULL, NULL);
+  assert(fd >= 0);
+  close(fd);
+  close(lfd);
+  for (std::future<KvReply>& f : pending) {
+    assert(is_client_err(f.get()));
+  }
+  assert(is_client_err(kv_call(client, {"get", "k"}).get()));
+  kv_close(client);
+}
+
+// kv_close() from a callback, on the I/O thread
+static void test_close_in_callback() {
+  KvClient* client = kv_connect("127.0.0.1", g_port, 1);
+  assert(client);
+  std::promise<void> queued, closed;
+  std::shared_future<void> ready = queued.get_future().share();
+  kv_call(client, {"ping"}, [client, ready, &closed](KvValue) {
+    ready.wait();
+    kv_close(client);
+    closed.set_value();
+  });
+  // queued behind the ping, it fails once the client is closed
+  std::future<KvReply> pending =
+      kv_call(client, {"bzpopmin", "kvtest:none", "1"});
+  queued.set_value();
+  closed.get_future().get();
+  assert(is_client_err(pending.get()));
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    g_port = (uint16_t)atoi(argv[1]);
+  }
+  test_threads();
+  test_order();
+  test_large();
+  test_failed_conn();
+  test_close_in_callback();
+  return 0;
+}
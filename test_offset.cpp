@@ -70,6 +70,12 @@ static void test_case(uint32_t sz) {
     }
     assert(!avl_offset(node, -(int64_t)i - 1));
     assert(!avl_offset(node, sz - i));
+
+    // sequential iteration agrees with the rank offsets
+    AVLNode* next = avl_next(node);
+    AVLNode* prev = avl_prev(node);
+    assert(next == (i + 1 < sz ? avl_offset(node, +1) : NULL));
+    assert(prev == (i > 0 ? avl_offset(node, -1) : NULL));
   }
 
   dispose(c.root);
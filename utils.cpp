@@ -10,8 +10,13 @@
 
 #include <cstdint>
 
+void (*g_die_hook)() = NULL;
+
 void die(const char* msg) {
   int err = errno;
+  if (g_die_hook) {
+    g_die_hook();
+  }
   fprintf(stderr, "[%d] %s\n", err, msg);
   abort();
 }
@@ -21,9 +26,8 @@ void msg(const char* msg) { fprintf(stderr, "%s\n", msg); }
 void fd_set_nonblock(int fd) {
   int flags = fcntl(fd, F_GETFL, 0);
   flags |= O_NONBLOCK;
-  fcntl(fd, F_SETFL, flags);
-
-  if (errno) {
+  // check the return value, errno may be stale from an earlier call
+  if (flags < 0 || fcntl(fd, F_SETFL, flags) < 0) {
     die("fcntl() error");
   }
 }
@@ -41,6 +45,10 @@ void buf_destroy(struct Buffer* buf) {
   memset(buf, 0, sizeof(*buf));
 }
 
+void buf_clear(struct Buffer* buf) {
+  buf->data_begin = buf->data_end = buf->buffer_begin;
+}
+
 size_t buf_size(const struct Buffer* buf) {
   return buf->data_end - buf->data_begin;
 }
@@ -26,6 +26,8 @@ size_t buf_free_space(const struct Buffer* buf);
 void buf_append(struct Buffer* buf, const uint8_t* data, size_t len);
 void buf_consume(struct Buffer* buf, size_t len);
 
+// run by die() before it aborts, e.g. to flush a log
+extern void (*g_die_hook)();
 void die(const char* msg);
 void msg(const char* msg);
 void fd_set_nonblock(int fd);
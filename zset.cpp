@@ -4,22 +4,49 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "common.h"
 #include "hashtable.h"
 
-static ZNode* znode_new(const char* name, size_t len, double score) {
-  ZNode* node = (ZNode*)malloc(sizeof(ZNode) + len);
+static size_t znode_size(size_t len) { return offsetof(ZNode, name) + len; }
+
+static ZNode* znode_new(ZSet* zset, const char* name, size_t len,
+                        double score) {
+  ZNode* node = NULL;
+  if (zset->arena) {
+    node = (ZNode*)arena_alloc(zset->arena, znode_size(len));
+  } else {
+    node = (ZNode*)malloc(znode_size(len));
+  }
   assert(node);  // do not do this in real production server.
   avl_init(&node->tree);
   node->hmap.next = NULL;
   node->hmap.hcode = str_hash((uint8_t*)name, len);
   node->score = score;
-  node->len = len;
+  node->len = (uint32_t)len;
   memcpy(&node->name[0], name, len);
   return node;
 }
 
-static void znode_del(ZNode* node) { free(node); }
+static void znode_del(ZSet* zset, ZNode* node) {
+  if (zset->arena) {
+    arena_free(zset->arena, node, znode_size(node->len));
+  } else {
+    free(node);
+  }
+}
+
+// Allocate the nodes of an empty zset from a private arena instead of one
+// malloc() each. Saves the allocator overhead per member and lets
+// zset_clear() drop all nodes, and the arena, without walking the tree.
+void zset_use_arena(ZSet* zset) {
+  assert(!zset->root && hm_size(&zset->hmap) == 0);
+  if (!zset->arena) {
+    zset->arena = new Arena();
+  }
+}
 
 static bool zless(AVLNode* lhs, double score, const char* name, size_t len) {
   ZNode* zl = container_of(lhs, ZNode, tree);
@@ -69,7 +96,7 @@ bool zset_insert(ZSet* zset, const char* name, size_t len, double score) {
     zset_update(zset, node, score);
     return false;
   }
-  ZNode* node = znode_new(name, len, score);
+  ZNode* node = znode_new(zset, name, len, score);
   hm_insert(&zset->hmap, &node->hmap);
   tree_insert(zset, node);
   return true;
@@ -91,7 +118,7 @@ static bool hcmp(HNode* node, HNode* key) {
 }
 
 ZNode* zset_lookup(ZSet* zset, const char* name, size_t len) {
-  if (!zset->root) {
+  if (hm_size(&zset->hmap) == 0) {
     return NULL;
   }
   HKey key;
@@ -110,7 +137,7 @@ void zset_delete(ZSet* zset, ZNode* node) {
   HNode* found = hm_delete(&zset->hmap, &key.node, &hcmp);
   assert(found);
   zset->root = avl_del(&node->tree);
-  znode_del(node);
+  znode_del(zset, node);
 }
 
 ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len) {
@@ -139,15 +166,67 @@ ZNode* zset_seekle(ZSet* zset, double score, const char* name, size_t len) {
   return found ? container_of(found, ZNode, tree) : NULL;
 }
 
+ZNode* zset_min(ZSet* zset) {
+  AVLNode* node = zset->root;
+  while (node && node->left) {
+    node = node->left;
+  }
+  return node ? container_of(node, ZNode, tree) : NULL;
+}
+
+ZNode* zset_max(ZSet* zset) {
+  AVLNode* node = zset->root;
+  while (node && node->right) {
+    node = node->right;
+  }
+  return node ? container_of(node, ZNode, tree) : NULL;
+}
+
+// select by rank, descending from the root using the subtree counts
+ZNode* zset_at(ZSet* zset, int64_t rank) {
+  if (rank < 0 || rank >= (int64_t)avl_cnt(zset->root)) {
+    return NULL;
+  }
+  int64_t root_rank = avl_cnt(zset->root->left);
+  AVLNode* node = avl_offset(zset->root, rank - root_rank);
+  return node ? container_of(node, ZNode, tree) : NULL;
+}
+
+// number of nodes ordered before (score, name), in a single descent
+static int64_t tree_count_lt(AVLNode* node, double score, const char* name,
+                             size_t len) {
+  int64_t count = 0;
+  while (node) {
+    if (zless(node, score, name, len)) {
+      count += avl_cnt(node->left) + 1;
+      node = node->right;
+    } else {
+      node = node->left;
+    }
+  }
+  return count;
+}
+
+// number of nodes ordered before or equal to (score, name)
+static int64_t tree_count_le(AVLNode* node, double score, const char* name,
+                             size_t len) {
+  int64_t count = 0;
+  while (node) {
+    if (!zless(score, name, len, node)) {  // node <= target
+      count += avl_cnt(node->left) + 1;
+      node = node->right;
+    } else {
+      node = node->left;
+    }
+  }
+  return count;
+}
+
 int64_t zset_count(ZSet* zset, double lo_score, const char* lo_name,
                    size_t lo_len, double hi_score, const char* hi_name,
                    size_t hi_len) {
-  ZNode* lo = zset_seekge(zset, lo_score, lo_name, lo_len);
-  ZNode* hi = zset_seekle(zset, hi_score, hi_name, hi_len);
-  if (!lo || !hi) {
-    return 0;
-  }
-  int64_t count = avl_rank(&hi->tree) - avl_rank(&lo->tree) + 1;
+  int64_t count = tree_count_le(zset->root, hi_score, hi_name, hi_len) -
+                  tree_count_lt(zset->root, lo_score, lo_name, lo_len);
   return count < 0 ? 0 : count;
 }
 
@@ -156,17 +235,83 @@ ZNode* znode_offset(ZNode* node, int64_t offset) {
   return tnode ? container_of(tnode, ZNode, tree) : NULL;
 }
 
+ZNode* znode_next(ZNode* node) {
+  AVLNode* tnode = avl_next(&node->tree);
+  return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
+ZNode* znode_prev(ZNode* node) {
+  AVLNode* tnode = avl_prev(&node->tree);
+  return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
 static void tree_dispose(AVLNode* node) {
   if (!node) {
     return;
   }
   tree_dispose(node->left);
   tree_dispose(node->right);
-  znode_del(container_of(node, ZNode, tree));
+  free(container_of(node, ZNode, tree));
 }
 
 void zset_clear(ZSet* zset) {
   hm_clear(&zset->hmap);
-  tree_dispose(zset->root);
+  if (zset->arena) {
+    arena_clear(zset->arena);  // O(chunks)
+    delete zset->arena;
+    zset->arena = NULL;
+  } else {
+    tree_dispose(zset->root);
+  }
   zset->root = NULL;
 }
+
+ZNode* zset_stage(ZSet* zset, const char* name, size_t len, double score) {
+  assert(!zset->root);  // only valid before zset_build()
+  ZNode* node = znode_new(zset, name, len, score);
+  hm_insert(&zset->hmap, &node->hmap);
+  return node;
+}
+
+static bool cb_collect(HNode* node, void* arg) {
+  ((std::vector<ZNode*>*)arg)->push_back(container_of(node, ZNode, hmap));
+  return true;
+}
+
+// link sorted nodes into a perfectly balanced subtree
+static AVLNode* tree_build(ZNode** nodes, size_t n, AVLNode* parent) {
+  if (n == 0) {
+    return NULL;
+  }
+  size_t mid = n / 2;
+  AVLNode* node = &nodes[mid]->tree;
+  node->parent = parent;
+  node->left = tree_build(nodes, mid, node);
+  node->right = tree_build(nodes + mid + 1, n - mid - 1, node);
+  uint32_t l = avl_height(node->left);
+  uint32_t r = avl_height(node->right);
+  node->height = 1 + (l < r ? r : l);
+  node->cnt = (uint32_t)n;
+  return node;
+}
+
+static bool znode_less(ZNode* lhs, ZNode* rhs) {
+  return zless(&lhs->tree, &rhs->tree);
+}
+
+void zset_build(ZSet* zset) {
+  assert(!zset->root);
+  std::vector<ZNode*> nodes;
+  nodes.reserve(hm_size(&zset->hmap));
+  hm_foreach(&zset->hmap, &cb_collect, &nodes);
+  std::sort(nodes.begin(), nodes.end(), &znode_less);
+  zset->root = tree_build(nodes.data(), nodes.size(), NULL);
+}
+
+void zset_build_from(ZSet* zset, ZNode** nodes, size_t n) {
+  assert(!zset->root && n == hm_size(&zset->hmap));
+  if (!std::is_sorted(nodes, nodes + n, &znode_less)) {
+    std::sort(nodes, nodes + n, &znode_less);
+  }
+  zset->root = tree_build(nodes, n, NULL);
+}
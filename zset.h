@@ -1,28 +1,45 @@
 #pragma once
 
+#include "arena.h"
 #include "avl.h"
 #include "hashtable.h"
 
 struct ZSet {
   AVLNode* root = NULL;  // index by (score, name) using AVL tree
   HMap hmap;             // indey by name using hashmap
+  Arena* arena = NULL;   // optional node storage, see zset_use_arena()
 };
 
 struct ZNode {
   AVLNode tree;
   HNode hmap;
   double score = 0;
-  size_t len = 0;
+  uint32_t len = 0;
   char name[0];  // flexible size array at end of struct
 };
 
+void zset_use_arena(ZSet* zset);
+
 bool zset_insert(ZSet* zset, const char* name, size_t len, double score);
 ZNode* zset_lookup(ZSet* zset, const char* name, size_t len);
 void zset_delete(ZSet* zset, ZNode* node);
 ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len);
 ZNode* zset_seekle(ZSet* zset, double score, const char* name, size_t len);
+ZNode* zset_min(ZSet* zset);
+ZNode* zset_max(ZSet* zset);
+ZNode* zset_at(ZSet* zset, int64_t rank);
 int64_t zset_count(ZSet* zset, double lo_score, const char* lo_name,
                    size_t lo_len, double hi_score, const char* hi_name,
                    size_t hi_len);
 void zset_clear(ZSet* zset);
 ZNode* znode_offset(ZNode* node, int64_t offset);
+ZNode* znode_next(ZNode* node);
+ZNode* znode_prev(ZNode* node);
+
+// bulk construction: stage members into the hashmap only (their scores may
+// still be changed), then link all of them into a balanced tree at once.
+ZNode* zset_stage(ZSet* zset, const char* name, size_t len, double score);
+void zset_build(ZSet* zset);
+// zset_build() from every staged node, which skips the sort if they are
+// already in (score, name) order
+void zset_build_from(ZSet* zset, ZNode** nodes, size_t n);